@@ -21,10 +21,37 @@ along with RNNLIB.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <cmath>
 #include <limits>
 #include <iostream>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace kaldi {
 namespace nnet1 {
 
+template<class T> struct LogSpan;
+
+//log(1 + exp(-d)) sampled every 1/scale for d in [0, cutoff); the two
+//entries past the end are 0, so interpolating at the cutoff gives 0.
+//Linear interpolation is within scale^-2 / 32 (8e-6) of the exact value.
+template<class T> struct LogAddTable
+{
+	static const int scale = 64;
+	static const int cutoff = 16;
+	static const int size = scale * cutoff + 2;
+	static const LogAddTable table;
+
+	T values[size];
+
+	LogAddTable()
+	{
+		for (int i = 0; i < size - 2; i++)
+		{
+			values[i] = std::log(1.0 + std::exp(-static_cast<double>(i) / scale));
+		}
+		values[size - 2] = values[size - 1] = 0;
+	}
+};
+
 template<class T> class Log
 {
 	//data
@@ -77,6 +104,31 @@ public:
 		}
 		return x + std::log(1.0 + safe_exp(y - x));
 	}
+	//log_add with log(1 + exp(y - x)) interpolated from LogAddTable,
+	//within 2e-5 of log_add; differences beyond the cutoff add nothing
+	static T log_add_approx(T x, T y)
+	{
+		if (x == logZero)
+		{
+			return y;
+		}
+		if (y == logZero)
+		{
+			return x;
+		}
+		if (x < y) 
+		{
+			std::swap(x, y);
+		}
+		T p = (x - y) * LogAddTable<T>::scale;
+		if (p >= LogAddTable<T>::scale * LogAddTable<T>::cutoff)
+		{
+			return x;
+		}
+		int i = static_cast<int>(p);
+		const T *v = LogAddTable<T>::table.values + i;
+		return x + (v[0] + (p - i) * (v[1] - v[0]));
+	}
 	static T log_subtract(T x, T y)
 	{
 		if (y == logZero)
@@ -109,6 +161,28 @@ public:
 		}
 		return x - y;
 	}
+
+	//span functions: the scalar ones applied to n elements at a time,
+	//vectorized for float; out may be the same array as x or y. Unlike
+	//the scalar safe_exp, the float span safe_exp flushes results below
+	//the smallest normal float (x < log_simd::expLow) to 0 instead of
+	//returning a denormal, at every position of the span
+	static void safe_exp(const T *x, T *out, int n)
+	{
+		LogSpan<T>::safe_exp(x, out, n);
+	}
+	static void log_add(const T *x, const T *y, T *out, int n)
+	{
+		LogSpan<T>::log_add(x, y, out, n);
+	}
+	static void log_add_approx(const T *x, const T *y, T *out, int n)
+	{
+		LogSpan<T>::log_add_approx(x, y, out, n);
+	}
+	static void log_multiply(const T *x, const T *y, T *out, int n)
+	{
+		LogSpan<T>::log_multiply(x, y, out, n);
+	}
 	
 	//functions
 	Log(T v = 0, bool logScale = false):
@@ -209,11 +283,317 @@ template<class T> std::istream& operator >>(std::istream& in, Log<T>& l)
 	return in;
 }
 
+//span kernels, scalar version
+template<class T> struct LogSpan
+{
+	static void safe_exp(const T *x, T *out, int n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = Log<T>::safe_exp(x[i]);
+		}
+	}
+	static void log_add(const T *x, const T *y, T *out, int n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = Log<T>::log_add(x[i], y[i]);
+		}
+	}
+	static void log_add_approx(const T *x, const T *y, T *out, int n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = Log<T>::log_add_approx(x[i], y[i]);
+		}
+	}
+	static void log_multiply(const T *x, const T *y, T *out, int n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = Log<T>::log_multiply(x[i], y[i]);
+		}
+	}
+};
+
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__SSE2__)
+//float vectors of the widest instruction set enabled at compile time
+//(-mavx512f, -mavx2 or the SSE2 baseline), with the Cephes exp and log
+//polynomials; comparisons give masks, so logZero needs no branches
+namespace log_simd {
+
+#if defined(__AVX512F__)
+typedef __m512 vec;
+typedef __mmask16 mask;
+typedef __m512i ivec;
+static const int width = 16;
+inline vec set1(float x) { return _mm512_set1_ps(x); }
+inline vec load(const float *p) { return _mm512_loadu_ps(p); }
+inline void store(float *p, vec v) { _mm512_storeu_ps(p, v); }
+inline vec add(vec a, vec b) { return _mm512_add_ps(a, b); }
+inline vec sub(vec a, vec b) { return _mm512_sub_ps(a, b); }
+inline vec mul(vec a, vec b) { return _mm512_mul_ps(a, b); }
+inline vec div(vec a, vec b) { return _mm512_div_ps(a, b); }
+inline vec max(vec a, vec b) { return _mm512_max_ps(a, b); }
+inline vec min(vec a, vec b) { return _mm512_min_ps(a, b); }
+inline mask eq(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+inline mask lt(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+inline mask ge(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+inline mask mask_or(mask a, mask b) { return a | b; }
+inline vec select(mask m, vec a, vec b) { return _mm512_mask_blend_ps(m, b, a); }
+inline vec floor(vec a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF); }
+inline ivec to_int(vec a) { return _mm512_cvttps_epi32(a); }
+inline vec to_float(ivec a) { return _mm512_cvtepi32_ps(a); }
+inline ivec as_int(vec a) { return _mm512_castps_si512(a); }
+inline vec as_float(ivec a) { return _mm512_castsi512_ps(a); }
+inline ivec iset1(int x) { return _mm512_set1_epi32(x); }
+inline ivec iadd(ivec a, ivec b) { return _mm512_add_epi32(a, b); }
+inline ivec isub(ivec a, ivec b) { return _mm512_sub_epi32(a, b); }
+inline ivec iand(ivec a, ivec b) { return _mm512_and_si512(a, b); }
+inline ivec ior(ivec a, ivec b) { return _mm512_or_si512(a, b); }
+inline ivec shl23(ivec a) { return _mm512_slli_epi32(a, 23); }
+inline ivec shr23(ivec a) { return _mm512_srli_epi32(a, 23); }
+inline vec gather(const float *p, ivec i) { return _mm512_i32gather_ps(i, p, 4); }
+#elif defined(__AVX2__)
+typedef __m256 vec;
+typedef __m256 mask;
+typedef __m256i ivec;
+static const int width = 8;
+inline vec set1(float x) { return _mm256_set1_ps(x); }
+inline vec load(const float *p) { return _mm256_loadu_ps(p); }
+inline void store(float *p, vec v) { _mm256_storeu_ps(p, v); }
+inline vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+inline vec sub(vec a, vec b) { return _mm256_sub_ps(a, b); }
+inline vec mul(vec a, vec b) { return _mm256_mul_ps(a, b); }
+inline vec div(vec a, vec b) { return _mm256_div_ps(a, b); }
+inline vec max(vec a, vec b) { return _mm256_max_ps(a, b); }
+inline vec min(vec a, vec b) { return _mm256_min_ps(a, b); }
+inline mask eq(vec a, vec b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline mask lt(vec a, vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline mask ge(vec a, vec b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline mask mask_or(mask a, mask b) { return _mm256_or_ps(a, b); }
+inline vec select(mask m, vec a, vec b) { return _mm256_blendv_ps(b, a, m); }
+inline vec floor(vec a) { return _mm256_floor_ps(a); }
+inline ivec to_int(vec a) { return _mm256_cvttps_epi32(a); }
+inline vec to_float(ivec a) { return _mm256_cvtepi32_ps(a); }
+inline ivec as_int(vec a) { return _mm256_castps_si256(a); }
+inline vec as_float(ivec a) { return _mm256_castsi256_ps(a); }
+inline ivec iset1(int x) { return _mm256_set1_epi32(x); }
+inline ivec iadd(ivec a, ivec b) { return _mm256_add_epi32(a, b); }
+inline ivec isub(ivec a, ivec b) { return _mm256_sub_epi32(a, b); }
+inline ivec iand(ivec a, ivec b) { return _mm256_and_si256(a, b); }
+inline ivec ior(ivec a, ivec b) { return _mm256_or_si256(a, b); }
+inline ivec shl23(ivec a) { return _mm256_slli_epi32(a, 23); }
+inline ivec shr23(ivec a) { return _mm256_srli_epi32(a, 23); }
+inline vec gather(const float *p, ivec i) { return _mm256_i32gather_ps(p, i, 4); }
+#else
+typedef __m128 vec;
+typedef __m128 mask;
+typedef __m128i ivec;
+static const int width = 4;
+inline vec set1(float x) { return _mm_set1_ps(x); }
+inline vec load(const float *p) { return _mm_loadu_ps(p); }
+inline void store(float *p, vec v) { _mm_storeu_ps(p, v); }
+inline vec add(vec a, vec b) { return _mm_add_ps(a, b); }
+inline vec sub(vec a, vec b) { return _mm_sub_ps(a, b); }
+inline vec mul(vec a, vec b) { return _mm_mul_ps(a, b); }
+inline vec div(vec a, vec b) { return _mm_div_ps(a, b); }
+inline vec max(vec a, vec b) { return _mm_max_ps(a, b); }
+inline vec min(vec a, vec b) { return _mm_min_ps(a, b); }
+inline mask eq(vec a, vec b) { return _mm_cmpeq_ps(a, b); }
+inline mask lt(vec a, vec b) { return _mm_cmplt_ps(a, b); }
+inline mask ge(vec a, vec b) { return _mm_cmpge_ps(a, b); }
+inline mask mask_or(mask a, mask b) { return _mm_or_ps(a, b); }
+inline vec select(mask m, vec a, vec b)
+{
+	return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+inline vec floor(vec a)
+{
+	//truncate, then step down where that rounded up (negative inputs)
+	vec t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+}
+inline ivec to_int(vec a) { return _mm_cvttps_epi32(a); }
+inline vec to_float(ivec a) { return _mm_cvtepi32_ps(a); }
+inline ivec as_int(vec a) { return _mm_castps_si128(a); }
+inline vec as_float(ivec a) { return _mm_castsi128_ps(a); }
+inline ivec iset1(int x) { return _mm_set1_epi32(x); }
+inline ivec iadd(ivec a, ivec b) { return _mm_add_epi32(a, b); }
+inline ivec isub(ivec a, ivec b) { return _mm_sub_epi32(a, b); }
+inline ivec iand(ivec a, ivec b) { return _mm_and_si128(a, b); }
+inline ivec ior(ivec a, ivec b) { return _mm_or_si128(a, b); }
+inline ivec shl23(ivec a) { return _mm_slli_epi32(a, 23); }
+inline ivec shr23(ivec a) { return _mm_srli_epi32(a, 23); }
+inline vec gather(const float *p, ivec i)
+{
+	int k[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(k), i);
+	return _mm_setr_ps(p[k[0]], p[k[1]], p[k[2]], p[k[3]]);
+}
+#endif
+
+//lanes below this become 0. exp_core clamps its input here, so lanes
+//that are discarded (logZero and the like) still get a normal result
+//rather than a denormal one, which costs a microcode assist per lane:
+//exp(-87.33) = 1.0065 * 2^-126, just above the smallest normal, where
+//the exact bound log(2^-126) = -87.3365 rounds to just below it
+static const float expLow = -87.33f;
+
+//exp(x) for x in [expLow, 88.37]
+inline vec exp_core(vec x)
+{
+	x = min(max(x, set1(expLow)), set1(88.3762626647949f));
+	vec fx = floor(add(mul(x, set1(1.44269504088896341f)), set1(0.5f)));
+	x = sub(x, mul(fx, set1(0.693359375f)));
+	x = sub(x, mul(fx, set1(-2.12194440e-4f)));
+	vec z = mul(x, x);
+	vec y = set1(1.9875691500e-4f);
+	y = add(mul(y, x), set1(1.3981999507e-3f));
+	y = add(mul(y, x), set1(8.3334519073e-3f));
+	y = add(mul(y, x), set1(4.1665795894e-2f));
+	y = add(mul(y, x), set1(1.6666665459e-1f));
+	y = add(mul(y, x), set1(5.0000001201e-1f));
+	y = add(add(mul(y, z), x), set1(1.0f));
+	ivec e = shl23(iadd(to_int(fx), iset1(127)));
+	return mul(y, as_float(e));
+}
+
+//log(x) for normalized positive x
+inline vec log_core(vec x)
+{
+	ivec bits = as_int(x);
+	vec e = to_float(isub(shr23(bits), iset1(126)));
+	//mantissa in [0.5, 1)
+	x = as_float(ior(iand(bits, iset1(0x007fffff)), iset1(0x3f000000)));
+	mask small = lt(x, set1(0.707106781186547524f));
+	e = sub(e, select(small, set1(1.0f), set1(0.0f)));
+	x = sub(add(x, select(small, x, set1(0.0f))), set1(1.0f));
+	vec z = mul(x, x);
+	vec y = set1(7.0376836292e-2f);
+	y = add(mul(y, x), set1(-1.1514610310e-1f));
+	y = add(mul(y, x), set1(1.1676998740e-1f));
+	y = add(mul(y, x), set1(-1.2420140846e-1f));
+	y = add(mul(y, x), set1(1.4249322787e-1f));
+	y = add(mul(y, x), set1(-1.6668057665e-1f));
+	y = add(mul(y, x), set1(2.0000714765e-1f));
+	y = add(mul(y, x), set1(-2.4999993993e-1f));
+	y = add(mul(y, x), set1(3.3333331174e-1f));
+	y = mul(mul(y, x), z);
+	y = add(y, mul(e, set1(-2.12194440e-4f)));
+	y = sub(y, mul(z, set1(0.5f)));
+	return add(add(x, y), mul(e, set1(0.693359375f)));
+}
+
+//log(1 + x) for x in [0, 1], accurate also where 1 + x rounds to 1
+//(Goldberg's correction; see Higham, Accuracy and Stability, 1.14.1)
+inline vec log1p_core(vec x)
+{
+	vec u = add(set1(1.0f), x);
+	vec d = sub(u, set1(1.0f));
+	vec r = div(mul(log_core(u), x), d);
+	return select(eq(d, set1(0.0f)), x, r);
+}
+
+} // namespace log_simd
+
+//span kernels, vectorized for float
+template<> struct LogSpan<float>
+{
+	static void safe_exp(const float *x, float *out, int n)
+	{
+		using namespace log_simd;
+		const vec exp_max = set1(Log<float>::expMax);
+		const vec exp_limit = set1(Log<float>::expLimit);
+		const vec exp_low = set1(expLow), zero = set1(0.0f);
+		int i = 0;
+		for (; i + width <= n; i += width)
+		{
+			vec v = load(x + i);
+			vec r = exp_core(v);
+			r = select(ge(v, exp_limit), exp_max, r);
+			//covers logZero
+			r = select(lt(v, exp_low), zero, r);
+			store(out + i, r);
+		}
+		//the tail flushes like the vector lanes
+		for (; i < n; i++)
+		{
+			out[i] = x[i] < expLow ? 0.0f : Log<float>::safe_exp(x[i]);
+		}
+	}
+	static void log_add(const float *x, const float *y, float *out, int n)
+	{
+		using namespace log_simd;
+		const vec log_zero = set1(Log<float>::logZero);
+		const vec exp_low = set1(expLow), zero = set1(0.0f);
+		int i = 0;
+		for (; i + width <= n; i += width)
+		{
+			vec a = load(x + i), b = load(y + i);
+			vec hi = max(a, b), lo = min(a, b);
+			vec d = sub(lo, hi);
+			vec e = select(lt(d, exp_low), zero, exp_core(d));
+			vec r = add(hi, log1p_core(e));
+			//log_add(x, logZero) == x, whichever side holds it
+			store(out + i, select(eq(lo, log_zero), hi, r));
+		}
+		for (; i < n; i++)
+		{
+			out[i] = Log<float>::log_add(x[i], y[i]);
+		}
+	}
+	static void log_add_approx(const float *x, const float *y, float *out,
+	                           int n)
+	{
+		using namespace log_simd;
+		typedef LogAddTable<float> Table;
+		const vec log_zero = set1(Log<float>::logZero);
+		const vec scale = set1(Table::scale);
+		//past the cutoff the table interpolates to 0
+		const vec last = set1(Table::size - 2);
+		const float *values = Table::table.values;
+		int i = 0;
+		for (; i + width <= n; i += width)
+		{
+			vec a = load(x + i), b = load(y + i);
+			vec hi = max(a, b), lo = min(a, b);
+			vec p = min(mul(sub(hi, lo), scale), last);
+			ivec k = to_int(p);
+			vec v0 = gather(values, k), v1 = gather(values + 1, k);
+			vec r = add(hi, add(v0, mul(sub(p, to_float(k)), sub(v1, v0))));
+			store(out + i, select(eq(lo, log_zero), hi, r));
+		}
+		for (; i < n; i++)
+		{
+			out[i] = Log<float>::log_add_approx(x[i], y[i]);
+		}
+	}
+	static void log_multiply(const float *x, const float *y, float *out, int n)
+	{
+		using namespace log_simd;
+		const vec log_zero = set1(Log<float>::logZero);
+		int i = 0;
+		for (; i + width <= n; i += width)
+		{
+			vec a = load(x + i), b = load(y + i);
+			mask m = mask_or(eq(a, log_zero), eq(b, log_zero));
+			store(out + i, select(m, log_zero, add(a, b)));
+		}
+		for (; i < n; i++)
+		{
+			out[i] = Log<float>::log_multiply(x[i], y[i]);
+		}
+	}
+};
+#endif
+
 template <class T> const T Log<T>::expMax = std::numeric_limits<T>::max();
 template <class T> const T Log<T>::expMin = std::numeric_limits<T>::min();
 template <class T> const T Log<T>::expLimit = std::log(expMax);
 template <class T> const T Log<T>::logInfinity = std::numeric_limits<T>::max() - 10;
 template <class T> const T Log<T>::logZero = -Log<T>::logInfinity;
+template <class T> const LogAddTable<T> LogAddTable<T>::table;
 
 } // namespace nnet1
 } // namespace kaldi
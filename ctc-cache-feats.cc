@@ -0,0 +1,80 @@
+// ctc/ctc-cache-feats.cc
+
+#include "ctc/ctc-feature-cache.h"
+#include "ctc/ctc-utterance-reader.h"
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "base/timer.h"
+
+int main(int argc, char *argv[]) {
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  typedef kaldi::int32 int32;
+
+  try {
+    const char *usage =
+        "Write the final features of a data set once into a feature cache, a\n"
+        "page-aligned file with an index by utterance that ctc-train-perutt maps\n"
+        "into memory (feature rspecifier cache:<cache>) instead of reading,\n"
+        "normalizing and extending the features again every epoch.\n"
+        "\n"
+        "Usage:  ctc-cache-feats [options] <feature-rspecifier> <cache-out>\n"
+        "e.g.: \n"
+        " ctc-cache-feats --cmvn-stats=scp:cmvn.scp --utt2spk=ark:utt2spk --delta-order=2 scp:feats.scp train.cache\n";
+
+    ParseOptions po(usage);
+
+    CTCFeatureOptions feature_opts;
+    feature_opts.Register(&po);
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 2) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string feature_rspecifier = po.GetArg(1),
+        cache_filename = po.GetArg(2);
+
+    SequentialBaseFloatMatrixReader feature_reader(feature_rspecifier);
+    RandomAccessDoubleMatrixReaderMapped cmvn_reader;
+    bool have_cmvn = (feature_opts.cmvn_rspecifier != "");
+    if (have_cmvn) {
+      cmvn_reader.Open(feature_opts.cmvn_rspecifier,
+                       feature_opts.utt2spk_rspecifier);
+    }
+
+    CTCFeatureCacheWriter cache_writer;
+    cache_writer.Open(cache_filename);
+
+    Timer time;
+    Matrix<BaseFloat> feats, scratch;
+    int32 num_done = 0, num_no_cmvn = 0;
+    kaldi::int64 total_frames = 0;
+    for (; !feature_reader.Done(); feature_reader.Next()) {
+      std::string utt = feature_reader.Key();
+      if (have_cmvn && !cmvn_reader.HasKey(utt)) {
+        KALDI_WARN << utt << ", missing CMVN stats";
+        num_no_cmvn++;
+        continue;
+      }
+      feats.Swap(&feature_reader.Value());
+      TransformCTCFeatures(feature_opts,
+                           have_cmvn ? &cmvn_reader.Value(utt) : NULL,
+                           &feats, &scratch);
+      cache_writer.Write(utt, feats);
+      total_frames += feats.NumRows();
+      num_done++;
+    }
+    cache_writer.Close();
+
+    KALDI_LOG << "Cached " << num_done << " utterances, " << total_frames
+              << " frames, " << num_no_cmvn << " without CMVN stats, in "
+              << cache_filename << " [" << time.Elapsed() / 60 << " min]";
+    return (num_done != 0 ? 0 : 1);
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
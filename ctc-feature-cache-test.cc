@@ -0,0 +1,154 @@
+// ctc/ctc-feature-cache-test.cc
+
+#include "ctc/ctc-feature-cache.h"
+#include "base/kaldi-types.h"
+
+#include <unistd.h>
+
+namespace kaldi {
+namespace nnet1 {
+
+  const char *kCacheFilename = "tmp-ctc-feature-cache.cache";
+
+  void UnitTestCTCFeatureCache() {
+    int32 num_utts = 20, dim = 5 + RandInt(0, 40);
+    std::vector<Matrix<BaseFloat> > feats(num_utts);
+    {
+      CTCFeatureCacheWriter writer;
+      writer.Open(kCacheFilename);
+      for (int32 n = 0; n < num_utts; n++) {
+        std::ostringstream key;
+        key << "utt" << n;
+        // utterance 3 is empty
+        feats[n].Resize(n == 3 ? 0 : 1 + RandInt(0, 300), dim);
+        feats[n].SetRandn();
+        writer.Write(key.str(), feats[n]);
+      }
+      writer.Close();
+    }
+
+    CTCFeatureCache cache;
+    cache.Open(kCacheFilename);
+    KALDI_ASSERT(cache.NumUtterances() == num_utts && cache.Dim() == dim);
+    for (int32 n = 0; n < num_utts; n++) {
+      std::ostringstream key;
+      key << "utt" << n;
+      KALDI_ASSERT(cache.Key(n) == key.str() && cache.Find(key.str()) == n);
+      KALDI_ASSERT(cache.NumFrames(n) == feats[n].NumRows());
+      cache.Prefetch(n);
+      SubMatrix<BaseFloat> cached(cache.Features(n));
+      KALDI_ASSERT(cached.NumRows() == feats[n].NumRows() &&
+                   cached.NumCols() == dim);
+      if (cached.NumRows() == 0) continue;
+      // in place: page-aligned, rows are contiguous
+      KALDI_ASSERT(reinterpret_cast<size_t>(cached.Data()) % 4096 == 0 &&
+                   cached.Stride() == dim);
+      for (int32 r = 0; r < cached.NumRows(); r++) {
+        for (int32 d = 0; d < dim; d++) {
+          KALDI_ASSERT(cached(r, d) == feats[n](r, d));
+        }
+      }
+    }
+    KALDI_ASSERT(cache.Find("utt-none") == -1);
+
+    // the order is the index unless shuffled, and a seed always gives the
+    // same permutation
+    std::vector<int32> order, order2;
+    cache.Order(-1, &order);
+    for (int32 n = 0; n < num_utts; n++) KALDI_ASSERT(order[n] == n);
+    cache.Order(7, &order);
+    cache.Order(7, &order2);
+    KALDI_ASSERT(order == order2);
+    std::vector<int32> sorted(order);
+    std::sort(sorted.begin(), sorted.end());
+    for (int32 n = 0; n < num_utts; n++) KALDI_ASSERT(sorted[n] == n);
+    cache.Order(8, &order2);
+    KALDI_ASSERT(order != order2);
+    cache.Close();
+    KALDI_ASSERT(!cache.IsOpen());
+  }
+
+  void UnitTestCTCFeatureCacheErrors() {
+    CTCFeatureCacheWriter writer;
+    writer.Open(kCacheFilename);
+    Matrix<BaseFloat> feats(4, 3);
+    writer.Write("utt0", feats);
+    bool threw = false;
+    try {
+      writer.Write("utt0", feats);  // duplicate key
+    } catch(const std::exception &e) {
+      threw = true;
+    }
+    KALDI_ASSERT(threw);
+    threw = false;
+    try {
+      writer.Write("utt1", Matrix<BaseFloat>(4, 2));  // dimension changes
+    } catch(const std::exception &e) {
+      threw = true;
+    }
+    KALDI_ASSERT(threw);
+    writer.Close();
+
+    // not a cache
+    {
+      std::ofstream os(kCacheFilename);
+      os << "not a feature cache, but long enough for the header";
+    }
+    CTCFeatureCache cache;
+    threw = false;
+    try {
+      cache.Open(kCacheFilename);
+    } catch(const std::exception &e) {
+      threw = true;
+    }
+    KALDI_ASSERT(threw && !cache.IsOpen());
+
+    // a cache whose header is corrupt: the alignment (zero would divide by
+    // zero), the number of utterances and the dimension, at their offsets
+    // after the 8 bytes of magic; or whose features are of another
+    // precision than the build's
+    const std::streamoff offsets[] = { 8, 24, 28, 32 };
+    const int64 values[] = { 0, -1, -1, (sizeof(BaseFloat) == 4 ? 8 : 4) };
+    for (int32 f = 0; f < 4; f++) {
+      {
+        CTCFeatureCacheWriter writer;
+        writer.Open(kCacheFilename);
+        writer.Write("utt0", feats);
+        writer.Close();
+      }
+      {
+        std::fstream fs(kCacheFilename,
+                        std::ios::in | std::ios::out | std::ios::binary);
+        fs.seekp(offsets[f]);
+        if (f == 0) {
+          fs.write(reinterpret_cast<const char*>(&values[f]), sizeof(int64));
+        } else {
+          int32 value = values[f];
+          fs.write(reinterpret_cast<const char*>(&value), sizeof(int32));
+        }
+      }
+      threw = false;
+      try {
+        cache.Open(kCacheFilename);
+      } catch(const std::exception &e) {
+        threw = true;
+      }
+      KALDI_ASSERT(threw && !cache.IsOpen());
+    }
+  }
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main()
+{
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  // unit-tests:
+  for (int32 i = 0; i < 5; i++) UnitTestCTCFeatureCache();
+  UnitTestCTCFeatureCacheErrors();
+  unlink(kCacheFilename);
+
+  KALDI_LOG << "Tests succeeded.";
+  return 0;
+}
@@ -0,0 +1,250 @@
+// ctc/ctc-feature-cache.cc
+
+#include "ctc/ctc-feature-cache.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kaldi {
+namespace nnet1 {
+
+namespace {
+
+// version 2 added the bytes per feature
+const char kCacheMagic[8] = { 'C', 'T', 'C', 'F', 'E', 'A', 'T', '2' };
+
+/// Bytes of the header before its padding
+const size_t kHeaderBytes = sizeof(kCacheMagic) + 2 * sizeof(int64) +
+    3 * sizeof(int32);
+
+template<class T>
+void WriteRaw(std::ostream &os, const T &t) {
+  os.write(reinterpret_cast<const char*>(&t), sizeof(t));
+}
+
+/// Reads a T at *pos of the mapping and advances *pos; false if the
+/// mapping ends first
+template<class T>
+bool ReadRaw(const char *data, size_t num_bytes, size_t *pos, T *t) {
+  if (*pos + sizeof(T) > num_bytes) return false;
+  std::memcpy(t, data + *pos, sizeof(T));
+  *pos += sizeof(T);
+  return true;
+}
+
+} // namespace
+
+CTCFeatureCacheWriter::~CTCFeatureCacheWriter()
+{
+  if (IsOpen()) Close();
+}
+
+void CTCFeatureCacheWriter::Open(const std::string &filename)
+{
+  KALDI_ASSERT(!IsOpen());
+  filename_ = filename;
+  stream_.open(filename.c_str(), std::ios::out | std::ios::binary |
+               std::ios::trunc);
+  if (!stream_.is_open()) {
+    KALDI_ERR << "Could not open feature cache " << filename
+              << " for writing";
+  }
+  entries_.clear();
+  keys_.clear();
+  dim_ = -1;
+  alignment_ = std::max<int64>(4096, sysconf(_SC_PAGESIZE));
+  // rewritten by Close(), once the index is known
+  write_header(0);
+  num_bytes_ = kHeaderBytes;
+  pad();
+}
+
+void CTCFeatureCacheWriter::write_header(int64 index_offset)
+{
+  int32 num_utterances = entries_.size(), dim = std::max(dim_, 0),
+      element_bytes = sizeof(BaseFloat);
+  stream_.write(kCacheMagic, sizeof(kCacheMagic));
+  WriteRaw(stream_, alignment_);
+  WriteRaw(stream_, index_offset);
+  WriteRaw(stream_, num_utterances);
+  WriteRaw(stream_, dim);
+  WriteRaw(stream_, element_bytes);
+}
+
+void CTCFeatureCacheWriter::pad()
+{
+  int64 padding = (alignment_ - num_bytes_ % alignment_) % alignment_;
+  std::vector<char> zeros(padding, 0);
+  if (padding > 0) stream_.write(&zeros[0], padding);
+  num_bytes_ += padding;
+}
+
+void CTCFeatureCacheWriter::Write(const std::string &key,
+                                  const MatrixBase<BaseFloat> &feats)
+{
+  KALDI_ASSERT(IsOpen());
+  if (dim_ < 0) dim_ = feats.NumCols();
+  if (feats.NumCols() != dim_) {
+    KALDI_ERR << "Features of " << key << " have dimension "
+              << feats.NumCols() << ", the cache " << dim_;
+  }
+  if (!keys_.insert(std::make_pair(key, entries_.size())).second) {
+    KALDI_ERR << "Duplicate key " << key << " in feature cache "
+              << filename_;
+  }
+  Entry entry;
+  entry.key = key;
+  entry.offset = num_bytes_;
+  entry.num_rows = feats.NumRows();
+  entries_.push_back(entry);
+  for (MatrixIndexT r = 0; r < feats.NumRows(); r++) {
+    stream_.write(reinterpret_cast<const char*>(feats.RowData(r)),
+                  sizeof(BaseFloat) * dim_);
+  }
+  num_bytes_ += static_cast<int64>(sizeof(BaseFloat)) * dim_ *
+      feats.NumRows();
+  pad();
+  if (!stream_.good()) {
+    KALDI_ERR << "Error writing feature cache " << filename_;
+  }
+}
+
+void CTCFeatureCacheWriter::Close()
+{
+  KALDI_ASSERT(IsOpen());
+  int64 index_offset = num_bytes_;
+  for (size_t i = 0; i < entries_.size(); i++) {
+    int32 key_length = entries_[i].key.size();
+    WriteRaw(stream_, key_length);
+    stream_.write(entries_[i].key.data(), key_length);
+    WriteRaw(stream_, entries_[i].offset);
+    WriteRaw(stream_, entries_[i].num_rows);
+  }
+  stream_.seekp(0);
+  write_header(index_offset);
+  stream_.close();
+  if (stream_.fail()) {
+    KALDI_ERR << "Error closing feature cache " << filename_;
+  }
+}
+
+void CTCFeatureCache::Open(const std::string &filename)
+{
+  Close();
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    KALDI_ERR << "Could not open feature cache " << filename;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderBytes) {
+    close(fd);
+    KALDI_ERR << "Feature cache " << filename << " is too small";
+  }
+  num_bytes_ = st.st_size;
+  void *data = mmap(NULL, num_bytes_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);  // the mapping keeps the file
+  if (data == MAP_FAILED) {
+    num_bytes_ = 0;
+    KALDI_ERR << "Could not map feature cache " << filename;
+  }
+  data_ = static_cast<char*>(data);
+
+  size_t pos = sizeof(kCacheMagic);
+  int64 alignment, index_offset;
+  int32 num_utterances, element_bytes;
+  if (std::memcmp(data_, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      !ReadRaw(data_, num_bytes_, &pos, &alignment) ||
+      !ReadRaw(data_, num_bytes_, &pos, &index_offset) ||
+      !ReadRaw(data_, num_bytes_, &pos, &num_utterances) ||
+      !ReadRaw(data_, num_bytes_, &pos, &dim_) ||
+      !ReadRaw(data_, num_bytes_, &pos, &element_bytes) ||
+      alignment <= 0 || num_utterances < 0 || dim_ < 0 ||
+      index_offset < 0 || static_cast<size_t>(index_offset) > num_bytes_) {
+    Close();
+    KALDI_ERR << "Bad header in feature cache " << filename;
+  }
+  if (element_bytes != static_cast<int32>(sizeof(BaseFloat))) {
+    Close();
+    KALDI_ERR << "Feature cache " << filename << " holds " << element_bytes
+              << "-byte features, this build reads " << sizeof(BaseFloat)
+              << "-byte ones";
+  }
+  pos = index_offset;
+  entries_.resize(num_utterances);
+  for (int32 i = 0; i < num_utterances; i++) {
+    Entry &entry = entries_[i];
+    int32 key_length;
+    int64 offset;
+    bool ok = ReadRaw(data_, num_bytes_, &pos, &key_length) &&
+        key_length >= 0 && pos + key_length <= num_bytes_;
+    if (ok) {
+      entry.key.assign(data_ + pos, key_length);
+      pos += key_length;
+      ok = ReadRaw(data_, num_bytes_, &pos, &offset) &&
+          ReadRaw(data_, num_bytes_, &pos, &entry.num_rows) &&
+          offset >= 0 && offset % alignment == 0 && entry.num_rows >= 0 &&
+          offset + static_cast<int64>(sizeof(BaseFloat)) * dim_ *
+          entry.num_rows <= index_offset;
+    }
+    if (!ok) {
+      Close();
+      KALDI_ERR << "Bad index entry " << i << " in feature cache "
+                << filename;
+    }
+    entry.data = reinterpret_cast<const BaseFloat*>(data_ + offset);
+    keys_[entry.key] = i;
+  }
+}
+
+void CTCFeatureCache::Close()
+{
+  if (data_ != NULL) munmap(data_, num_bytes_);
+  data_ = NULL;
+  num_bytes_ = 0;
+  dim_ = 0;
+  entries_.clear();
+  keys_.clear();
+}
+
+int32 CTCFeatureCache::Find(const std::string &key) const
+{
+  std::map<std::string, int32>::const_iterator it = keys_.find(key);
+  return it == keys_.end() ? -1 : it->second;
+}
+
+SubMatrix<BaseFloat> CTCFeatureCache::Features(int32 i) const
+{
+  KALDI_ASSERT(i >= 0 && i < NumUtterances());
+  const Entry &entry = entries_[i];
+  // the mapping is read-only, the SubMatrix is handed out as const
+  return SubMatrix<BaseFloat>(const_cast<BaseFloat*>(entry.data),
+                              entry.num_rows, dim_, dim_);
+}
+
+void CTCFeatureCache::Prefetch(int32 i) const
+{
+  KALDI_ASSERT(i >= 0 && i < NumUtterances());
+  const Entry &entry = entries_[i];
+  // the features start on a page boundary
+  size_t bytes = sizeof(BaseFloat) * dim_ * entry.num_rows;
+  if (bytes > 0) {
+    madvise(const_cast<BaseFloat*>(entry.data), bytes, MADV_WILLNEED);
+  }
+}
+
+void CTCFeatureCache::Order(int32 seed, std::vector<int32> *order) const
+{
+  order->resize(NumUtterances());
+  for (int32 i = 0; i < NumUtterances(); i++) (*order)[i] = i;
+  if (seed < 0) return;
+  RandomState state;
+  state.seed = seed;
+  for (int32 i = NumUtterances() - 1; i > 0; i--) {
+    std::swap((*order)[i], (*order)[RandInt(0, i, &state)]);
+  }
+}
+
+} // namespace nnet1
+} // namespace kaldi
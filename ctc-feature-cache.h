@@ -0,0 +1,116 @@
+// ctc/ctc-feature-cache.h
+
+#ifndef KALDI_CTC_CTC_FEATURE_CACHE_H_
+#define KALDI_CTC_CTC_FEATURE_CACHE_H_
+
+#include "base/kaldi-common.h"
+#include "matrix/kaldi-matrix.h"
+#include <fstream>
+#include <map>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// A feature cache is a single binary file holding the final features of
+/// a data set, written once by ctc-cache-feats and memory-mapped by every
+/// epoch of training. The layout, in native byte order:
+///
+///   header    magic "CTCFEAT2", int64 alignment, int64 index offset,
+///             int32 number of utterances, int32 feature dimension, int32
+///             bytes per feature (sizeof(BaseFloat) of the writer, which
+///             must be the reader's); padded to the alignment
+///   features  per utterance, rows * dim floats without padding between
+///             rows; every utterance starts at a multiple of the alignment
+///             (at least the page size), so it may be used in place
+///   index     per utterance, in the order written: int32 key length, the
+///             key, int64 offset of the features, int32 number of rows
+class CTCFeatureCacheWriter {
+ public:
+  CTCFeatureCacheWriter(): num_bytes_(0), dim_(-1), alignment_(0) { }
+  /// Closes the cache if it is still open
+  ~CTCFeatureCacheWriter();
+
+  void Open(const std::string &filename);
+  /// Appends the features of an utterance; keys must be unique and all
+  /// utterances have the same dimension
+  void Write(const std::string &key, const MatrixBase<BaseFloat> &feats);
+  /// Writes the index and the header
+  void Close();
+
+  bool IsOpen() const { return stream_.is_open(); }
+
+ private:
+  /// Writes the header at the current position
+  void write_header(int64 index_offset);
+  /// Zeros up to the next multiple of the alignment
+  void pad();
+
+  struct Entry {
+    std::string key;
+    int64 offset;
+    int32 num_rows;
+  };
+
+  std::string filename_;
+  std::ofstream stream_;
+  std::vector<Entry> entries_;
+  std::map<std::string, int32> keys_;
+  int64 num_bytes_;
+  int32 dim_;
+  int64 alignment_;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(CTCFeatureCacheWriter);
+};
+
+/// Read-only view of a feature cache. The file is mapped into memory, so
+/// the features of an utterance are a SubMatrix pointing into the mapping
+/// and nothing is copied or parsed per utterance. The view may be shared
+/// by several threads.
+class CTCFeatureCache {
+ public:
+  CTCFeatureCache(): data_(NULL), num_bytes_(0), dim_(0) { }
+  ~CTCFeatureCache() { Close(); }
+
+  /// Maps the cache; errors if it is missing or malformed
+  void Open(const std::string &filename);
+  void Close();
+  bool IsOpen() const { return data_ != NULL; }
+
+  int32 NumUtterances() const { return entries_.size(); }
+  int32 Dim() const { return dim_; }
+  const std::string &Key(int32 i) const { return entries_[i].key; }
+  int32 NumFrames(int32 i) const { return entries_[i].num_rows; }
+  /// Position of key in the index, -1 if it is not in the cache
+  int32 Find(const std::string &key) const;
+
+  /// The features of utterance i, in place; they must not be written to
+  SubMatrix<BaseFloat> Features(int32 i) const;
+
+  /// Asks the kernel to start reading the pages of utterance i, so a
+  /// later access does not wait for the disk
+  void Prefetch(int32 i) const;
+
+  /// The utterances in the order of the index, or shuffled with seed if it
+  /// is >= 0; the cache itself is never rewritten
+  void Order(int32 seed, std::vector<int32> *order) const;
+
+ private:
+  struct Entry {
+    std::string key;
+    const BaseFloat *data;
+    int32 num_rows;
+  };
+
+  char *data_;
+  size_t num_bytes_;
+  int32 dim_;
+  std::vector<Entry> entries_;
+  std::map<std::string, int32> keys_;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(CTCFeatureCache);
+};
+
+} // namespace nnet1
+} // namespace kaldi
+
+#endif // KALDI_CTC_CTC_FEATURE_CACHE_H_
@@ -0,0 +1,82 @@
+// ctc/ctc-index-lengths.cc
+
+#include "ctc/ctc-length-index.h"
+#include "ctc/ctc-feature-cache.h"
+#include "ctc/ctc-loss.h"
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+
+int main(int argc, char *argv[]) {
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  typedef kaldi::int32 int32;
+
+  try {
+    const char *usage =
+        "Write the lengths of the training utterances (frames, targets, frames\n"
+        "CTC requires for the targets) as an int32-vector table, for the\n"
+        "--length-index option of ctc-train-perutt. The features of a cache\n"
+        "(cache:<file>) are counted without reading them.\n"
+        "\n"
+        "Usage:  ctc-index-lengths [options] <feature-rspecifier> <targets-rspecifier> <index-wspecifier>\n"
+        "e.g.: \n"
+        " ctc-index-lengths scp:feats.scp ark:targets.ark ark,t:lengths.ark\n";
+
+    ParseOptions po(usage);
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 3) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string feature_rspecifier = po.GetArg(1),
+        targets_rspecifier = po.GetArg(2),
+        index_wspecifier = po.GetArg(3);
+
+    RandomAccessInt32VectorReader targets_reader(targets_rspecifier);
+    Int32VectorWriter index_writer(index_wspecifier);
+
+    int32 num_done = 0, num_no_targets = 0, num_infeasible = 0;
+    CTCFeatureCache cache;
+    SequentialBaseFloatMatrixReader feature_reader;
+    bool from_cache = (feature_rspecifier.compare(0, 6, "cache:") == 0);
+    if (from_cache) {
+      cache.Open(feature_rspecifier.substr(6));
+    } else {
+      feature_reader.Open(feature_rspecifier);
+    }
+    for (int32 i = 0; from_cache ? i < cache.NumUtterances() :
+             !feature_reader.Done(); i++) {
+      std::string utt = from_cache ? cache.Key(i) : feature_reader.Key();
+      if (!targets_reader.HasKey(utt)) {
+        KALDI_WARN << utt << ", missing targets";
+        num_no_targets++;
+      } else {
+        const std::vector<int32> &targets = targets_reader.Value(utt);
+        CTCUtteranceLength length;
+        length.num_frames = from_cache ? cache.NumFrames(i) :
+            feature_reader.Value().NumRows();
+        length.num_targets = targets.size();
+        length.required_time = CTCLoss::required_time(targets);
+        if (!length.Feasible()) {
+          KALDI_VLOG(1) << utt << ", required time " << length.required_time
+                        << " > total time " << length.num_frames;
+          num_infeasible++;
+        }
+        CTCLengthIndex::Write(utt, length, &index_writer);
+        num_done++;
+      }
+      if (!from_cache) feature_reader.Next();
+    }
+
+    KALDI_LOG << "Indexed " << num_done << " utterances, " << num_infeasible
+              << " of them too short for their targets; " << num_no_targets
+              << " with no targets.";
+    return (num_done != 0 ? 0 : 1);
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -0,0 +1,113 @@
+// ctc/ctc-length-index-test.cc
+
+#include "ctc/ctc-length-index.h"
+#include "base/kaldi-types.h"
+
+#include <algorithm>
+#include <set>
+#include <unistd.h>
+
+namespace kaldi {
+namespace nnet1 {
+
+  /// An index of num_utts utterances, every seventh one infeasible
+  void MakeLengthIndex(int32 num_utts, CTCLengthIndex *index) {
+    for (int32 n = 0; n < num_utts; n++) {
+      std::ostringstream key;
+      key << "utt" << n;
+      CTCUtteranceLength length;
+      length.num_targets = RandInt(1, 20);
+      length.required_time = length.num_targets + RandInt(0, 3);
+      length.num_frames = (n % 7 == 6 ?
+                           RandInt(0, length.required_time - 1) :
+                           length.required_time + RandInt(0, 500));
+      index->Add(key.str(), length);
+    }
+  }
+
+  void UnitTestCTCLengthIndex() {
+    const char *wspecifier = "ark:tmp-ctc-length-index.ark";
+    CTCLengthIndex index;
+    MakeLengthIndex(100, &index);
+    {
+      Int32VectorWriter writer(wspecifier);
+      for (int32 i = 0; i < index.NumUtterances(); i++) {
+        CTCLengthIndex::Write(index.Key(i), index.Length(i), &writer);
+      }
+    }
+    CTCLengthIndex read;
+    read.Read(wspecifier);
+    KALDI_ASSERT(read.NumUtterances() == index.NumUtterances());
+    int32 num_feasible = 0;
+    for (int32 i = 0; i < index.NumUtterances(); i++) {
+      const CTCUtteranceLength *length = read.Find(index.Key(i));
+      KALDI_ASSERT(length != NULL && read.Key(i) == index.Key(i));
+      KALDI_ASSERT(length->num_frames == index.Length(i).num_frames &&
+                   length->num_targets == index.Length(i).num_targets &&
+                   length->required_time == index.Length(i).required_time);
+      KALDI_ASSERT(length->Feasible() == (i % 7 != 6));
+      num_feasible += length->Feasible();
+    }
+    KALDI_ASSERT(read.Find("utt-none") == NULL);
+
+    // every order visits the feasible utterances once
+    const char *orders[] = { "index", "sorted", "bucketed" };
+    for (int32 o = 0; o < 3; o++) {
+      for (int32 seed = -1; seed <= 1; seed++) {
+        std::vector<std::string> keys;
+        read.Order(orders[o], 8, seed, &keys);
+        KALDI_ASSERT(keys.size() == num_feasible);
+        std::set<std::string> unique(keys.begin(), keys.end());
+        KALDI_ASSERT(unique.size() == keys.size());
+        for (size_t k = 0; k < keys.size(); k++) {
+          KALDI_ASSERT(read.Find(keys[k])->Feasible());
+        }
+        std::vector<std::string> again;
+        read.Order(orders[o], 8, seed, &again);
+        KALDI_ASSERT(again == keys);
+      }
+    }
+
+    std::vector<std::string> keys;
+    read.Order("index", 8, -1, &keys);
+    for (size_t k = 1; k < keys.size(); k++) {
+      KALDI_ASSERT(atoi(keys[k - 1].c_str() + 3) < atoi(keys[k].c_str() + 3));
+    }
+    std::vector<std::string> sorted;
+    read.Order("sorted", 8, 5, &sorted);
+    for (size_t k = 1; k < sorted.size(); k++) {
+      KALDI_ASSERT(read.Find(sorted[k - 1])->num_frames <=
+                   read.Find(sorted[k])->num_frames);
+    }
+    // the buckets are runs of 8 of the sorted order, the last one shorter,
+    // and each is visited whole
+    read.Order("bucketed", 8, 5, &keys);
+    KALDI_ASSERT(keys != sorted);
+    for (size_t begin = 0; begin < keys.size(); ) {
+      size_t bucket = (std::find(sorted.begin(), sorted.end(), keys[begin]) -
+                       sorted.begin()) / 8,
+          end = begin + std::min<size_t>(8, sorted.size() - bucket * 8);
+      KALDI_ASSERT(end <= keys.size());
+      for (size_t k = begin; k < end; k++) {
+        size_t pos = std::find(sorted.begin(), sorted.end(), keys[k]) -
+            sorted.begin();
+        KALDI_ASSERT(pos / 8 == bucket);
+      }
+      begin = end;
+    }
+    unlink("tmp-ctc-length-index.ark");
+  }
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main()
+{
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  // unit-tests:
+  for (int32 i = 0; i < 5; i++) UnitTestCTCLengthIndex();
+
+  KALDI_LOG << "Tests succeeded.";
+  return 0;
+}
@@ -0,0 +1,119 @@
+// ctc/ctc-length-index.cc
+
+#include "ctc/ctc-length-index.h"
+#include <algorithm>
+
+namespace kaldi {
+namespace nnet1 {
+
+namespace {
+
+/// Orders positions in an index by the number of frames, ties by position
+struct ByFrames {
+  explicit ByFrames(const std::vector<CTCUtteranceLength> &lengths):
+      lengths_(lengths) { }
+  bool operator() (int32 a, int32 b) const {
+    if (lengths_[a].num_frames != lengths_[b].num_frames) {
+      return lengths_[a].num_frames < lengths_[b].num_frames;
+    }
+    return a < b;
+  }
+  const std::vector<CTCUtteranceLength> &lengths_;
+};
+
+/// Fisher-Yates shuffle of [begin, end) with a seeded generator
+template<class T>
+void Shuffle(T *begin, T *end, RandomState *state) {
+  for (int32 i = static_cast<int32>(end - begin) - 1; i > 0; i--) {
+    std::swap(begin[i], begin[RandInt(0, i, state)]);
+  }
+}
+
+} // namespace
+
+void CTCLengthIndex::Read(const std::string &rspecifier)
+{
+  SequentialInt32VectorReader reader(rspecifier);
+  for (; !reader.Done(); reader.Next()) {
+    const std::vector<int32> &entry = reader.Value();
+    if (entry.size() != 3 || entry[0] < 0 || entry[1] < 0 || entry[2] < 0) {
+      KALDI_ERR << "Bad entry for " << reader.Key() << " in length index "
+                << rspecifier << ", expected [ frames targets required-time ]";
+    }
+    CTCUtteranceLength length;
+    length.num_frames = entry[0];
+    length.num_targets = entry[1];
+    length.required_time = entry[2];
+    Add(reader.Key(), length);
+  }
+}
+
+void CTCLengthIndex::Add(const std::string &key,
+                         const CTCUtteranceLength &length)
+{
+  if (!positions_.insert(std::make_pair(key, keys_.size())).second) {
+    KALDI_ERR << "Duplicate key " << key << " in length index";
+  }
+  keys_.push_back(key);
+  lengths_.push_back(length);
+}
+
+void CTCLengthIndex::Write(const std::string &key,
+                           const CTCUtteranceLength &length,
+                           Int32VectorWriter *writer)
+{
+  std::vector<int32> entry(3);
+  entry[0] = length.num_frames;
+  entry[1] = length.num_targets;
+  entry[2] = length.required_time;
+  writer->Write(key, entry);
+}
+
+const CTCUtteranceLength *CTCLengthIndex::Find(const std::string &key) const
+{
+  std::map<std::string, int32>::const_iterator it = positions_.find(key);
+  return it == positions_.end() ? NULL : &lengths_[it->second];
+}
+
+void CTCLengthIndex::Order(const std::string &order, int32 bucket_size,
+                           int32 seed, std::vector<std::string> *keys) const
+{
+  std::vector<int32> positions;
+  for (int32 i = 0; i < NumUtterances(); i++) {
+    if (lengths_[i].Feasible()) positions.push_back(i);
+  }
+  RandomState state;
+  state.seed = seed;
+  int32 num = positions.size();
+  if (order == "index") {
+    if (seed >= 0 && num > 0) Shuffle(&positions[0], &positions[0] + num,
+                                      &state);
+  } else if (order == "sorted" || order == "bucketed") {
+    std::sort(positions.begin(), positions.end(), ByFrames(lengths_));
+    if (order == "bucketed" && seed >= 0 && num > 0) {
+      KALDI_ASSERT(bucket_size > 0);
+      int32 num_buckets = (num + bucket_size - 1) / bucket_size;
+      std::vector<int32> buckets(num_buckets);
+      for (int32 b = 0; b < num_buckets; b++) buckets[b] = b;
+      Shuffle(&buckets[0], &buckets[0] + num_buckets, &state);
+      std::vector<int32> sorted;
+      sorted.swap(positions);
+      for (int32 b = 0; b < num_buckets; b++) {
+        int32 begin = buckets[b] * bucket_size,
+            end = std::min(begin + bucket_size, num);
+        size_t offset = positions.size();
+        positions.insert(positions.end(), sorted.begin() + begin,
+                         sorted.begin() + end);
+        Shuffle(&positions[offset], &positions[0] + positions.size(), &state);
+      }
+    }
+  } else {
+    KALDI_ERR << "Unknown utterance order " << order
+              << ", expected index, sorted or bucketed";
+  }
+  keys->resize(num);
+  for (int32 i = 0; i < num; i++) (*keys)[i] = keys_[positions[i]];
+}
+
+} // namespace nnet1
+} // namespace kaldi
@@ -0,0 +1,66 @@
+// ctc/ctc-length-index.h
+
+#ifndef KALDI_CTC_CTC_LENGTH_INDEX_H_
+#define KALDI_CTC_CTC_LENGTH_INDEX_H_
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include <map>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// The lengths of a training utterance that decide whether CTC can align
+/// it, known without reading its features
+struct CTCUtteranceLength {
+  int32 num_frames;
+  int32 num_targets;
+  int32 required_time;    // CTCLoss::required_time() of the targets
+
+  CTCUtteranceLength(): num_frames(0), num_targets(0), required_time(0) { }
+
+  bool Feasible() const { return num_frames >= required_time; }
+};
+
+/// Per-utterance lengths of a data set, written by ctc-index-lengths as an
+/// int32-vector table (key [ frames targets required-time ]). The trainer
+/// uses it to drop infeasible utterances before their features are read,
+/// and to visit the utterances ordered by length.
+class CTCLengthIndex {
+ public:
+  /// Reads a table of ctc-index-lengths; errors on malformed entries
+  void Read(const std::string &rspecifier);
+
+  /// Appends an utterance; keys must be unique
+  void Add(const std::string &key, const CTCUtteranceLength &length);
+
+  /// Writes the entry of an utterance to a table of ctc-index-lengths
+  static void Write(const std::string &key, const CTCUtteranceLength &length,
+                    Int32VectorWriter *writer);
+
+  int32 NumUtterances() const { return keys_.size(); }
+  const std::string &Key(int32 i) const { return keys_[i]; }
+  const CTCUtteranceLength &Length(int32 i) const { return lengths_[i]; }
+  /// The lengths of key, NULL if it is not in the index
+  const CTCUtteranceLength *Find(const std::string &key) const;
+
+  /// The keys in the order named by order:
+  ///   "index"     as read, shuffled if seed >= 0
+  ///   "sorted"    by increasing number of frames
+  ///   "bucketed"  sorted and cut into buckets of bucket_size utterances of
+  ///               similar length; with seed >= 0 the buckets, and the
+  ///               utterances in each, are shuffled
+  /// Infeasible utterances are left out.
+  void Order(const std::string &order, int32 bucket_size, int32 seed,
+             std::vector<std::string> *keys) const;
+
+ private:
+  std::vector<std::string> keys_;
+  std::vector<CTCUtteranceLength> lengths_;
+  std::map<std::string, int32> positions_;
+};
+
+} // namespace nnet1
+} // namespace kaldi
+
+#endif // KALDI_CTC_CTC_LENGTH_INDEX_H_
@@ -0,0 +1,213 @@
+// ctc/ctc-loss-bench.cc
+
+#include "ctc/ctc-loss.h"
+#include "ctc/ctc-test-utils.h"
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "base/timer.h"
+
+#include <iomanip>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// A random target of num_labels non-blank labels in which about
+/// repeat_fraction of the labels repeat their predecessor, the case that
+/// forces a blank between them. With a single non-blank output every
+/// label repeats.
+void RandTarget(int32 num_labels, int32 num_outputs, int32 blank,
+                BaseFloat repeat_fraction, std::vector<int32> *target) {
+  KALDI_ASSERT(num_outputs >= 2);
+  target->resize(num_labels);
+  for (int32 l = 0; l < num_labels; l++) {
+    if (l > 0 && (num_outputs == 2 || RandUniform() < repeat_fraction)) {
+      (*target)[l] = (*target)[l-1];
+      continue;
+    }
+    int32 label;
+    do {
+      label = RandInt(0, num_outputs - 1);
+    } while (label == blank || (l > 0 && label == (*target)[l-1]));
+    (*target)[l] = label;
+  }
+}
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  typedef kaldi::int32 int32;
+
+  try {
+    const char *usage =
+        "Time the CTC loss on synthetic network outputs over a grid of\n"
+        "sequence lengths, target lengths, output dimensions and engines.\n"
+        "The forward, backward and gradient phases and ErrorRate are timed\n"
+        "separately and reported per lattice cell (T * (2L+1)), per frame\n"
+        "and with the peak workspace of a sequence.\n"
+        "Usage:  ctc-loss-bench [options]\n"
+        "e.g.: \n"
+        " ctc-loss-bench --frames=200:800 --labels=20:100 --csv=bench.csv\n";
+
+    ParseOptions po(usage);
+
+    std::string frames_str = "100:400:1600",
+        labels_str = "10:50:200",
+        outputs_str = "60:4000",
+        engines_str = "log:scaled",
+        repeats_str = "0:0.3";
+    po.Register("frames", &frames_str, "Colon-separated sequence lengths T");
+    po.Register("labels", &labels_str, "Colon-separated target lengths L");
+    po.Register("num-outputs", &outputs_str,
+                "Colon-separated network output dimensions (blank included)");
+    po.Register("engines", &engines_str,
+                "Colon-separated CTC engines to compare (log, scaled)");
+    po.Register("repeat-fractions", &repeats_str,
+                "Colon-separated fractions of labels repeating the previous one");
+
+    int32 num_iters = 5;
+    po.Register("iterations", &num_iters, "Timed runs of every configuration");
+    BaseFloat logit_scale = 3.0;
+    po.Register("logit-scale", &logit_scale,
+                "Scale of the random logits; larger is peakier");
+    int32 seed = 777;
+    po.Register("seed", &seed, "Seed of the synthetic data");
+    std::string csv_wxfilename;
+    po.Register("csv", &csv_wxfilename,
+                "If set, also write the results as CSV to this file");
+
+    CTCLossOptions ctc_opts;
+    ctc_opts.Register(&po);
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 0) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::vector<int32> frames, labels, outputs;
+    std::vector<std::string> engines;
+    std::vector<BaseFloat> repeats;
+    if (!SplitStringToIntegers(frames_str, ":", false, &frames) ||
+        !SplitStringToIntegers(labels_str, ":", false, &labels) ||
+        !SplitStringToIntegers(outputs_str, ":", false, &outputs) ||
+        !SplitStringToFloats(repeats_str, ":", false, &repeats)) {
+      KALDI_ERR << "Bad grid of frames, labels, outputs or repeat fractions";
+    }
+    SplitStringToVector(engines_str, ":", true, &engines);
+    for (size_t k = 0; k < outputs.size(); k++) {
+      if (outputs[k] < 2) {
+        KALDI_ERR << "--num-outputs needs the blank and at least one label, "
+                  << "got " << outputs[k];
+      }
+    }
+    KALDI_ASSERT(num_iters > 0);
+    srand(seed);
+
+    const int32 blank = 0;
+    Output csv;
+    if (csv_wxfilename != "") {
+      csv.Open(csv_wxfilename, false, false);
+      csv.Stream() << "engine,frames,labels,repeat_fraction,num_outputs,"
+                   << "cells,forward_ms,backward_ms,gradient_ms,"
+                   << "error_rate_ms,total_ms,ns_per_cell,frames_per_sec,"
+                   << "peak_workspace_bytes\n";
+    }
+    std::cout << std::setw(11) << "engine" << std::setw(7) << "T"
+              << std::setw(6) << "L" << std::setw(6) << "rep"
+              << std::setw(6) << "V" << std::setw(10) << "fwd-ms"
+              << std::setw(10) << "bwd-ms" << std::setw(10) << "grad-ms"
+              << std::setw(10) << "err-ms" << std::setw(10) << "ns/cell"
+              << std::setw(12) << "frames/s" << std::setw(12) << "peak-KB"
+              << std::endl;
+
+    for (size_t e = 0; e < engines.size(); e++) {
+      CTCLossOptions opts = ctc_opts;
+      opts.engine = engines[e];
+      for (size_t i = 0; i < frames.size(); i++) {
+        for (size_t j = 0; j < labels.size(); j++) {
+          for (size_t r = 0; r < repeats.size(); r++) {
+            for (size_t k = 0; k < outputs.size(); k++) {
+              const int32 total_time = frames[i], num_labels = labels[j],
+                  num_outputs = outputs[k];
+              std::vector<int32> target, hyp;
+              RandTarget(num_labels, num_outputs, blank, repeats[r],
+                         &target);
+              if (CTCLoss::required_time(target) > total_time) {
+                KALDI_VLOG(1) << "Skipping " << num_labels << " labels in "
+                              << total_time << " frames";
+                continue;
+              }
+              Matrix<BaseFloat> log_net_out(total_time, num_outputs),
+                  diff(total_time, num_outputs);
+              RandCTCLogSoftmax(logit_scale, &log_net_out);
+              CuMatrix<BaseFloat> net_out(log_net_out);
+
+              // a fresh loss per configuration so the peak is its own
+              CTCLoss ctc(blank, std::numeric_limits<int32>::max());
+              ctc.SetOptions(opts);
+              ctc.eval_on_host(log_net_out, target, &diff);  // warm up
+              CTCWorkspace &work = ctc.workspace_;
+              work.forward_seconds = work.backward_seconds =
+                  work.gradient_seconds = 0.0;
+              double total_seconds = 0.0, error_seconds = 0.0, error_rate;
+              for (int32 n = 0; n < num_iters; n++) {
+                Timer timer;
+                ctc.eval_on_host(log_net_out, target, &diff);
+                total_seconds += timer.Elapsed();
+                timer.Reset();
+                ctc.ErrorRate(net_out, target, &error_rate, &hyp);
+                error_seconds += timer.Elapsed();
+              }
+
+              const double ms = 1000.0 / num_iters,
+                  cells = static_cast<double>(total_time) *
+                  (2 * num_labels + 1),
+                  ns_per_cell = 1.0e9 * total_seconds / num_iters / cells,
+                  frames_per_sec = total_time * num_iters / total_seconds;
+              std::cout << std::setw(11) << engines[e]
+                        << std::setw(7) << total_time
+                        << std::setw(6) << num_labels
+                        << std::setw(6) << repeats[r]
+                        << std::setw(6) << num_outputs
+                        << std::fixed << std::setprecision(3)
+                        << std::setw(10) << work.forward_seconds * ms
+                        << std::setw(10) << work.backward_seconds * ms
+                        << std::setw(10) << work.gradient_seconds * ms
+                        << std::setw(10) << error_seconds * ms
+                        << std::setprecision(2)
+                        << std::setw(10) << ns_per_cell
+                        << std::setprecision(0)
+                        << std::setw(12) << frames_per_sec
+                        << std::setprecision(1)
+                        << std::setw(12) << work.peak_bytes / 1024.0
+                        << std::endl;
+              std::cout.unsetf(std::ios::floatfield);
+              std::cout << std::setprecision(6);
+              if (csv_wxfilename != "") {
+                csv.Stream() << engines[e] << ',' << total_time << ','
+                             << num_labels << ',' << repeats[r] << ','
+                             << num_outputs << ',' << cells << ','
+                             << work.forward_seconds * ms << ','
+                             << work.backward_seconds * ms << ','
+                             << work.gradient_seconds * ms << ','
+                             << error_seconds * ms << ','
+                             << total_seconds * ms << ',' << ns_per_cell
+                             << ',' << frames_per_sec << ','
+                             << work.peak_bytes << '\n';
+              }
+            }
+          }
+        }
+      }
+    }
+    if (csv_wxfilename != "") csv.Close();
+    return 0;
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
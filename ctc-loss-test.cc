@@ -3,6 +3,8 @@
 // hcq
 
 #include "ctc/ctc-loss.h"
+#include "ctc/Log.hpp"
+#include "ctc/ctc-test-utils.h"
 #include "base/kaldi-types.h"
 #include "util/common-utils.h"
 
@@ -23,7 +25,8 @@ namespace nnet1 {
   void UnitTestCTCLossUnity_test_error(
         const std::string &nnet_out_str, 
         const std::vector<int> &targets, 
-        const std::string &obj_diff_truth_str) {
+        const std::string &obj_diff_truth_str,
+        const CTCLossOptions &opts) {
     // prepare input
     CuMatrix<BaseFloat> nnet_out;
     ReadCuMatrixFromString(nnet_out_str, &nnet_out);
@@ -38,20 +41,44 @@ namespace nnet1 {
 
     // calculate ctc errors
     CTCLoss ctc(0);  // 0 for blank
+    ctc.SetOptions(opts);
     ctc.Eval(nnet_out, targets, &obj_diff);
     // prepare thruth errors
     CuMatrix<BaseFloat> obj_diff_truth;
     ReadCuMatrixFromString(obj_diff_truth_str, &obj_diff_truth);
   
-    KALDI_LOG << "log forward variables:\n" << ctc.forward_variables_;
-    KALDI_LOG << "log backward variables:\n" << ctc.backward_variables_;
+    const CTCBandedMatrix<BaseFloat> &fvars =
+        ctc.workspace_.log_lattice.forward_variables;
+    if (fvars.NumRows() == nnet_out.NumRows()) {
+      Matrix<BaseFloat> dense(fvars.NumRows(), targets.size() * 2 + 1);
+      for (int32 t = 0; t < dense.NumRows(); t++) {
+        SubVector<BaseFloat> row(dense, t);
+        fvars.CopyRowToVec(t, t, Log<BaseFloat>::logZero, &row);
+      }
+      KALDI_LOG << "log forward variables:\n" << dense;
+    }
     KALDI_LOG << "calculate  errors:\n" << obj_diff << std::endl;    
     KALDI_LOG << "truth      errors:\n" << obj_diff_truth << std::endl;    
     KALDI_LOG << ctc.Report();
     AssertEqual(obj_diff, obj_diff_truth);
+
+    // sparse posteriors, combined with the softmax output
+    CTCLoss ctc_post(0);
+    ctc_post.SetOptions(opts);
+    CTCPosteriors post;
+    ctc_post.EvalPosteriors(nnet_out, targets, &post);
+    KALDI_ASSERT(post.posteriors.NumCols() == targets.size() + 1);
+    CuMatrix<BaseFloat> post_diff(nnet_out);
+    post_diff.ApplyExp();
+    ctc_post.CombinePosteriors(post, &post_diff);
+    AssertEqual(post_diff, obj_diff_truth);
+    KALDI_ASSERT(ctc_post.obj_progress_ == ctc.obj_progress_);
   }
   
-  void UnitTestCTCLossUnity() {
+  void UnitTestCTCLossUnity(const CTCLossOptions &opts) {
+    // every test seeds its draws, so they do not depend on the tests run
+    // before it
+    srand(0);
     // 1
     {
       std::string nnet_out_str = "[ 0.1 0.7 0.1 0.1;\
@@ -63,7 +90,8 @@ namespace nnet1 {
                              "[ 0.1 -0.3 0.1 0.1;\
                                 0.1 0.1 -0.3 0.1;\
                                 0.1 0.1 0.1 -0.3 ] ";
-      UnitTestCTCLossUnity_test_error(nnet_out_str, targets, obj_diff_truth_str);
+      UnitTestCTCLossUnity_test_error(nnet_out_str, targets, obj_diff_truth_str,
+                                      opts);
     }
     // 2
     {
@@ -92,7 +120,8 @@ namespace nnet1 {
                    0.0695175 0.0999975 0.0851201 -0.254635;\
                    0.0766188 0.1 0.0984968 -0.275116;\
                    -0.0406171 0.1 0.1 -0.159383 ] ";
-      UnitTestCTCLossUnity_test_error(nnet_out_str, targets, obj_diff_truth_str);
+      UnitTestCTCLossUnity_test_error(nnet_out_str, targets, obj_diff_truth_str,
+                                      opts);
     }
     // 3
     {
@@ -121,9 +150,552 @@ namespace nnet1 {
                       -0.124942 0.181352 -0.0871795 0.2 -0.169231;\
                       -0.14359 0.2 0.076923 0.2 -0.333333;\
                       -0.266666 0.2 0.2 0.2 -0.333334 ]";
-      UnitTestCTCLossUnity_test_error(nnet_out_str, targets, obj_diff_truth_str);
+      UnitTestCTCLossUnity_test_error(nnet_out_str, targets, obj_diff_truth_str,
+                                      opts);
+    }
+
+  }
+
+  void UnitTestCTCLossApprox() {
+    srand(0);
+    // a long peaky sequence, so the per-cell errors can accumulate
+    const int32 total_time = 300, num_outputs = 20, num_labels = 60;
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(total_time, num_outputs, num_labels, 4.0, &log_net_out,
+                    &target);
+    Matrix<BaseFloat> diff_exact(total_time, num_outputs),
+        diff_approx(total_time, num_outputs);
+    CTCLossOptions opts;
+    CTCLoss ctc_exact(0), ctc_approx(0);
+    ctc_exact.SetOptions(opts);
+    ctc_exact.eval_on_host(log_net_out, target, &diff_exact);
+    for (int fused = 0; fused < 2; fused++) {
+      opts.engine = "log-approx";
+      opts.fused_backward = (fused == 1);
+      ctc_approx.SetOptions(opts);
+      double obj_before = ctc_approx.obj_progress_;
+      ctc_approx.eval_on_host(log_net_out, target, &diff_approx);
+      double obj_approx = ctc_approx.obj_progress_ - obj_before;
+      // the table interpolation is within 2e-5 per cell
+      KALDI_LOG << "log-approx objective " << obj_approx << " vs "
+                << ctc_exact.obj_progress_;
+      KALDI_ASSERT(std::abs(obj_approx - ctc_exact.obj_progress_) <
+                   1e-4 * std::abs(ctc_exact.obj_progress_));
+      BaseFloat max_error = 0.0;
+      for (int32 t = 0; t < total_time; t++) {
+        for (int32 v = 0; v < num_outputs; v++) {
+          max_error = std::max(max_error, std::abs(diff_approx(t, v) -
+                                                   diff_exact(t, v)));
+        }
+      }
+      KALDI_LOG << "log-approx max gradient error " << max_error;
+      KALDI_ASSERT(max_error < 5e-4);
+    }
+  }
+
+  void UnitTestCTCLossScore() {
+    srand(0);
+    const int32 total_time = 120, num_outputs = 12, num_labels = 30;
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(total_time, num_outputs, num_labels, 4.0, &log_net_out,
+                    &target);
+    CuMatrix<BaseFloat> log_net_out_dev(log_net_out), diff;
+    std::string engines[] = { "log", "scaled", "log-approx" };
+    for (int e = 0; e < 3; e++) {
+      CTCLossOptions opts;
+      opts.engine = engines[e];
+      opts.checkpoint_interval = (e == 1 ? -1 : 0);
+      CTCLoss ctc(0);
+      ctc.SetOptions(opts);
+      ctc.Eval(log_net_out_dev, target, &diff);
+      double log_prob = ctc.obj_progress_;
+      BaseFloat score = ctc.Score(log_net_out_dev, target);
+      KALDI_LOG << opts.engine << " score " << score << " vs " << log_prob;
+      AssertEqual(score, log_prob, 1e-5);
+      KALDI_ASSERT(ctc.sequences_num_ == 2);
+      // two rows of forward variables, no backward pass, no posteriors
+      const CTCWorkspace &work = ctc.workspace_;
+      KALDI_ASSERT(work.forward_only &&
+                   work.log_lattice.forward_variables.NumRows() == 2 &&
+                   work.log_lattice.backward_variables.NumRows() == 0);
+      KALDI_ASSERT(CTCWorkspace::RequiredBytes(total_time, num_labels, opts,
+                                               true) <
+                   CTCWorkspace::RequiredBytes(total_time, num_labels, opts));
+    }
+
+    // a frame too unlikely for the scaled lattice is recomputed in log
+    // space, counted once per sequence and reported
+    log_net_out.Row(total_time / 2).Set(-800.0);
+    CuMatrix<BaseFloat> unlikely_dev(log_net_out);
+    CTCLossOptions opts;
+    CTCLoss ctc_log(0), ctc_scaled(0);
+    opts.engine = "scaled";
+    ctc_scaled.SetOptions(opts);
+    ctc_log.Eval(unlikely_dev, target, &diff);
+    ctc_scaled.Eval(unlikely_dev, target, &diff);
+    KALDI_ASSERT(ctc_scaled.NumLogSpaceFallbacks() == 1);
+    ctc_scaled.Score(unlikely_dev, target);
+    KALDI_ASSERT(ctc_scaled.NumLogSpaceFallbacks() == 2 &&
+                 ctc_log.NumLogSpaceFallbacks() == 0);
+    AssertEqual(ctc_scaled.obj_progress_, 2 * ctc_log.obj_progress_, 1e-5);
+    KALDI_ASSERT(ctc_scaled.Report().find("underflowed in 2 sequences") !=
+                 std::string::npos);
+  }
+
+  void UnitTestCTCLossLogits() {
+    srand(0);
+    const int32 total_time = 100, num_outputs = 15, num_labels = 25;
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(total_time, num_outputs, num_labels, 4.0, &log_net_out,
+                    &target);
+    // logits differ from the log-softmax by a per-row shift
+    Matrix<BaseFloat> logits(log_net_out);
+    for (int32 t = 0; t < total_time; t++) {
+      logits.Row(t).Add(10.0 * RandGauss());
+    }
+    CuMatrix<BaseFloat> log_net_out_dev(log_net_out), logits_dev(logits),
+        diff, logits_diff;
+    std::string engines[] = { "log", "scaled", "log-approx" };
+    for (int e = 0; e < 3; e++) {
+      CTCLossOptions opts;
+      opts.engine = engines[e];
+      CTCLoss ctc(0), logits_ctc(0);
+      ctc.SetOptions(opts);
+      logits_ctc.SetOptions(opts);
+      ctc.Eval(log_net_out_dev, target, &diff);
+      logits_ctc.EvalLogits(logits_dev, target, &logits_diff);
+      AssertEqual(logits_ctc.obj_progress_, ctc.obj_progress_, 1e-4);
+      KALDI_ASSERT(logits_ctc.sequences_num_ == 1);
+      Matrix<BaseFloat> diff_host(total_time, num_outputs),
+          logits_diff_host(total_time, num_outputs);
+      diff.CopyToMat(&diff_host);
+      logits_diff.CopyToMat(&logits_diff_host);
+      for (int32 t = 0; t < total_time; t++) {
+        for (int32 v = 0; v < num_outputs; v++) {
+          KALDI_ASSERT(std::abs(logits_diff_host(t, v) - diff_host(t, v)) <
+                       1e-4);
+        }
+        // softmax and posteriors both sum to one
+        KALDI_ASSERT(std::abs(logits_diff_host.Row(t).Sum()) < 1e-3);
+      }
+    }
+    // the log-softmax of the host helper normalizes every row
+    Matrix<BaseFloat> probs(total_time, num_outputs);
+    CTCLoss::log_softmax_on_host(&logits, &probs);
+    for (int32 t = 0; t < total_time; t++) {
+      AssertEqual(probs.Row(t).Sum(), 1.0, 1e-5);
+      for (int32 v = 0; v < num_outputs; v++) {
+        KALDI_ASSERT(std::abs(logits(t, v) - log_net_out(t, v)) < 1e-4);
+      }
+    }
+  }
+
+  void UnitTestCTCLossDecode() {
+    srand(0);
+    const int32 total_time = 90, num_outputs = 10, num_labels = 20;
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(total_time, num_outputs, num_labels, 4.0, &log_net_out,
+                    &target);
+    CuMatrix<BaseFloat> log_net_out_dev(log_net_out), diff, diff_ref;
+    CTCLoss ctc(0), ctc_ref(0), ctc_logits(0);
+    ctc_ref.Eval(log_net_out_dev, target, &diff_ref);
+    double error_rate;
+    std::vector<int32> hyp;
+    ctc_ref.ErrorRate(log_net_out_dev, target, &error_rate, &hyp);
+
+    CTCUtteranceResult result, logits_result;
+    ctc.Eval(log_net_out_dev, target, &diff, &result);
+    AssertEqual(result.log_prob, ctc_ref.obj_progress_, 1e-6);
+    KALDI_ASSERT(result.hyp == hyp && result.error_rate == error_rate);
+    KALDI_ASSERT(result.num_errors == result.num_insertions +
+                 result.num_deletions + result.num_substitutions);
+    KALDI_ASSERT(ctc.error_num_ == ctc_ref.error_num_ &&
+                 ctc.ref_num_ == ctc_ref.ref_num_ &&
+                 ctc.sequences_num_ == 1);
+    AssertEqual(diff, diff_ref);
+    // the log-softmax of logits shifted per row decodes the same
+    Matrix<BaseFloat> logits(log_net_out);
+    for (int32 t = 0; t < total_time; t++) logits.Row(t).Add(RandGauss());
+    CuMatrix<BaseFloat> logits_dev(logits);
+    ctc_logits.EvalLogits(logits_dev, target, &diff, &logits_result);
+    KALDI_ASSERT(logits_result.hyp == hyp &&
+                 logits_result.num_errors == result.num_errors);
+    AssertEqual(logits_result.log_prob, result.log_prob, 1e-4);
+    // and the forward recursion alone scores the logits the same
+    CTCLoss ctc_score(0);
+    CTCUtteranceResult score_result;
+    BaseFloat score = ctc_score.ScoreLogits(logits_dev, target, &score_result);
+    AssertEqual(score, logits_result.log_prob, 1e-5);
+    KALDI_ASSERT(score_result.log_prob == score &&
+                 score_result.hyp == hyp &&
+                 score_result.num_errors == result.num_errors &&
+                 ctc_score.error_num_ == ctc_logits.error_num_ &&
+                 ctc_score.sequences_num_ == 1 &&
+                 ctc_score.workspace_.forward_only);
+  }
+
+  void UnitTestCTCLossStreams() {
+    srand(0);
+    // streams of different lengths, interleaved frame by frame and padded
+    // to the longest; each must come out as if evaluated alone
+    const int32 num_streams = 4, num_outputs = 8;
+    int32 lengths[] = { 40, 25, 40, 7 };
+    std::vector<Matrix<BaseFloat> > seqs(num_streams);
+    std::vector<std::vector<int32> > targets(num_streams);
+    std::vector<int32> seq_lengths(lengths, lengths + num_streams);
+    for (int32 s = 0; s < num_streams; s++) {
+      RandCTCSequence(lengths[s], num_outputs, lengths[s] / 4, 4.0, &seqs[s],
+                      &targets[s]);
+    }
+    Matrix<BaseFloat> streams(40 * num_streams, num_outputs);
+    streams.Set(-3.0);  // padding, must not matter
+    for (int32 s = 0; s < num_streams; s++) {
+      for (int32 t = 0; t < lengths[s]; t++) {
+        streams.Row(t * num_streams + s).CopyFromVec(seqs[s].Row(t));
+      }
+    }
+    CuMatrix<BaseFloat> streams_dev(streams), diff_dev;
+    CTCLossOptions opts;
+    opts.num_threads = 2;
+    CTCLoss ctc(0);
+    ctc.SetOptions(opts);
+    std::vector<CTCUtteranceResult> results;
+    std::vector<std::string> keys(num_streams);
+    for (int32 s = 0; s < num_streams; s++) {
+      std::ostringstream key;
+      key << "stream" << s;
+      keys[s] = key.str();
+    }
+    ctc.SetUtteranceKeys(keys);
+    ctc.EvalStreams(streams_dev, seq_lengths, targets, &diff_dev, &results);
+    Matrix<BaseFloat> diff(diff_dev.NumRows(), diff_dev.NumCols());
+    diff_dev.CopyToMat(&diff);
+
+    CTCLoss ctc_ref(0);
+    for (int32 s = 0; s < num_streams; s++) {
+      CuMatrix<BaseFloat> seq_dev(seqs[s]), diff_ref_dev;
+      CTCUtteranceResult result;
+      ctc_ref.Eval(seq_dev, targets[s], &diff_ref_dev, &result);
+      Matrix<BaseFloat> diff_ref(lengths[s], num_outputs);
+      diff_ref_dev.CopyToMat(&diff_ref);
+      for (int32 t = 0; t < 40; t++) {
+        for (int32 k = 0; k < num_outputs; k++) {
+          BaseFloat ref = (t < lengths[s] ? diff_ref(t, k) : 0.0);
+          KALDI_ASSERT(std::abs(diff(t * num_streams + s, k) - ref) < 1e-5);
+        }
+      }
+      AssertEqual(results[s].log_prob, result.log_prob, 1e-5);
+      KALDI_ASSERT(results[s].hyp == result.hyp &&
+                   results[s].num_errors == result.num_errors);
+    }
+    KALDI_ASSERT(ctc.sequences_num_ == num_streams &&
+                 ctc.error_num_ == ctc_ref.error_num_ &&
+                 ctc.ref_num_ == ctc_ref.ref_num_);
+
+    // the forward recursion alone scores and decodes them the same, and
+    // both file the timings of every stream under its own key
+    CTCLoss ctc_score(0);
+    std::vector<CTCUtteranceResult> score_results;
+    ctc_score.SetUtteranceKeys(keys);
+    ctc_score.ScoreStreams(streams_dev, seq_lengths, targets, &score_results);
+    for (int32 s = 0; s < num_streams; s++) {
+      AssertEqual(score_results[s].log_prob, results[s].log_prob, 1e-5);
+      KALDI_ASSERT(score_results[s].hyp == results[s].hyp &&
+                   score_results[s].num_errors == results[s].num_errors);
+    }
+    AssertCTCStatisticsEqual(ctc_score, ctc, 1e-5);
+    std::string report = ctc.Report(), score_report = ctc_score.Report();
+    for (int32 s = 0; s < num_streams; s++) {
+      KALDI_ASSERT(report.find(" " + keys[s] + " (") != std::string::npos &&
+                   score_report.find(" " + keys[s] + " (") !=
+                   std::string::npos);
     }
+  }
+
+  void UnitTestCTCStreamingScorer() {
+    srand(0);
+    const int32 total_time = 150, num_outputs = 12, num_labels = 40;
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(total_time, num_outputs, num_labels, 4.0, &log_net_out,
+                    &target);
+    CuMatrix<BaseFloat> log_net_out_dev(log_net_out);
+    std::string engines[] = { "log", "log-approx" };
+    for (int e = 0; e < 2; e++) {
+      CTCLossOptions opts;
+      opts.engine = engines[e];
+      CTCLoss ctc(0);
+      ctc.SetOptions(opts);
+      BaseFloat score = ctc.Score(log_net_out_dev, target);
+      CTCStreamingScorer scorer(0, opts);
+      int32 chunk_sizes[] = { 1, 7, 64, total_time };
+      for (int c = 0; c < 4; c++) {
+        scorer.Reset(target);
+        for (int32 t = 0, n = 0; t < total_time; t += n) {
+          // vary the chunk size within the stream, host and device input
+          n = std::min(chunk_sizes[c] + (t % 3), total_time - t);
+          if (t % 2 == 0) {
+            scorer.AcceptChunk(log_net_out.RowRange(t, n));
+          } else {
+            scorer.AcceptChunk(log_net_out_dev.RowRange(t, n));
+          }
+        }
+        KALDI_ASSERT(scorer.NumFramesDone() == total_time);
+        AssertEqual(scorer.Finish(), score, 1e-5);
+      }
+    }
+    // before any chunk: the empty target is certain, any other one is
+    // out of reach
+    CTCStreamingScorer scorer(0, CTCLossOptions());
+    scorer.Reset(std::vector<int32>());
+    KALDI_ASSERT(scorer.Finish() == 0.0);
+    scorer.Reset(target);
+    bool threw = false;
+    try {
+      scorer.Finish();
+    } catch(const std::exception &e) {
+      threw = true;
+    }
+    KALDI_ASSERT(threw);
+    // the band of a known length only leaves out segments that cannot
+    // finish in time
+    std::pair<int, int> known = CTCWorkspace::SegmentRange(60, 100, 81),
+        unknown = CTCWorkspace::SegmentRange(60, -1, 81);
+    KALDI_ASSERT(known.first == 1 && unknown.first == 0 &&
+                 known.second == unknown.second);
+  }
+
+  void UnitTestCTCLossBatch() {
+    std::string nnet_out_strs[] = {
+      "[ 0.1 0.7 0.1 0.1; 0.1 0.1 0.7 0.1; 0.1 0.1 0.1 0.7 ]",
+      "[ 0.1 0.7 0.1 0.1; 0.1 0.7 0.1 0.1; 0.1 0.7 0.1 0.1;\
+         0.1 0.7 0.1 0.1; 0.1 0.1 0.7 0.1; 0.1 0.1 0.7 0.1;\
+         0.1 0.1 0.7 0.1; 0.1 0.1 0.1 0.7; 0.1 0.1 0.1 0.7 ]",
+      "[ 0.4 0.3 0.2 0.1; 0.4 0.3 0.2 0.1; 0.1 0.2 0.3 0.4;\
+         0.1 0.2 0.3 0.4; 0.1 0.2 0.3 0.4 ]"
+    };
+    int tgts[][3] = { { 1, 2, 3 }, { 1, 1, 3 }, { 2, 2, 2 } };
+    int num_tgts[] = { 3, 3, 1 };
+    int num_seqs = 3;
+
+    // evaluate one by one
+    CTCLoss ctc_ref(0);
+    std::vector<Matrix<BaseFloat> > nnet_outs(num_seqs), diffs_ref(num_seqs);
+    std::vector<std::vector<int32> > targets(num_seqs);
+    std::vector<int32> seq_lengths(num_seqs);
+    std::vector<BaseFloat> log_probs_ref(num_seqs);
+    int32 total_frames = 0;
+    for (int n = 0; n < num_seqs; n++) {
+      CuMatrix<BaseFloat> nnet_out, obj_diff;
+      ReadCuMatrixFromString(nnet_out_strs[n], &nnet_out);
+      nnet_out.ApplyLog();
+      targets[n].assign(tgts[n], tgts[n] + num_tgts[n]);
+      double obj_before = ctc_ref.obj_progress_;
+      ctc_ref.Eval(nnet_out, targets[n], &obj_diff);
+      log_probs_ref[n] = ctc_ref.obj_progress_ - obj_before;
+      // sparse posteriors sum the columns of repeated labels
+      CTCLoss ctc_post(0);
+      CTCPosteriors post;
+      ctc_post.EvalPosteriors(nnet_out, targets[n], &post);
+      CuMatrix<BaseFloat> post_diff(nnet_out);
+      post_diff.ApplyExp();
+      ctc_post.CombinePosteriors(post, &post_diff);
+      AssertEqual(post_diff, obj_diff);
+      nnet_outs[n].Resize(nnet_out.NumRows(), nnet_out.NumCols());
+      nnet_out.CopyToMat(&nnet_outs[n]);
+      diffs_ref[n].Resize(obj_diff.NumRows(), obj_diff.NumCols());
+      obj_diff.CopyToMat(&diffs_ref[n]);
+      seq_lengths[n] = nnet_out.NumRows();
+      total_frames += seq_lengths[n];
+    }
+
+    // pack and evaluate as a batch
+    Matrix<BaseFloat> packed(total_frames, 4);
+    for (int n = 0, offset = 0; n < num_seqs; offset += seq_lengths[n++]) {
+      packed.RowRange(offset, seq_lengths[n]).CopyFromMat(nnet_outs[n]);
+    }
+    for (int num_threads = 1; num_threads <= 4; num_threads++) {
+      CTCLossOptions opts;
+      opts.num_threads = num_threads;
+      CTCLoss ctc(0);
+      ctc.SetOptions(opts);
+      CuMatrix<BaseFloat> obj_diff;
+      std::vector<BaseFloat> log_probs;
+      ctc.EvalBatch(CuMatrix<BaseFloat>(packed), seq_lengths, targets,
+                    &obj_diff, &log_probs);
+      Matrix<BaseFloat> diff_host(obj_diff.NumRows(), obj_diff.NumCols());
+      obj_diff.CopyToMat(&diff_host);
+      for (int n = 0, offset = 0; n < num_seqs; offset += seq_lengths[n++]) {
+        AssertEqual(diff_host.RowRange(offset, seq_lengths[n]), diffs_ref[n]);
+        AssertEqual(log_probs[n], log_probs_ref[n]);
+      }
+      KALDI_ASSERT(ctc.obj_progress_ == ctc_ref.obj_progress_);
+      KALDI_ASSERT(ctc.frames_ == ctc_ref.frames_);
+      KALDI_ASSERT(ctc.sequences_num_ == ctc_ref.sequences_num_);
+    }
+
+    // raw buffers and a caller-owned workspace, gradient rows padded
+    std::vector<int32> labels, label_lengths(num_seqs);
+    for (int n = 0; n < num_seqs; n++) {
+      labels.insert(labels.end(), targets[n].begin(), targets[n].end());
+      label_lengths[n] = targets[n].size();
+    }
+    for (int num_threads = 1; num_threads <= 2; num_threads++) {
+      CTCLossOptions opts;
+      opts.num_threads = num_threads;
+      opts.checkpoint_interval = -1;
+      CTCLoss ctc(0);
+      ctc.SetOptions(opts);
+      size_t bytes = ctc.GetWorkspaceSize(9, 3, 4, num_seqs);
+      std::vector<char> workspace(bytes);
+      Matrix<BaseFloat> grads(total_frames, 7);
+      std::vector<BaseFloat> log_probs(num_seqs);
+      ctc.ComputeRaw(packed.Data(), packed.Stride(), 4, &seq_lengths[0],
+                     &labels[0], &label_lengths[0], num_seqs, grads.Data(),
+                     grads.Stride(), &log_probs[0], &workspace[0], bytes);
+      for (int n = 0, offset = 0; n < num_seqs; offset += seq_lengths[n++]) {
+        AssertEqual(grads.Range(offset, seq_lengths[n], 0, 4), diffs_ref[n]);
+        AssertEqual(log_probs[n], log_probs_ref[n]);
+      }
+      KALDI_ASSERT(grads.ColRange(4, 3).IsZero());
+    }
+  }
+
+  void UnitTestCTCWorkspaceSize() {
+    // the bound is the largest scratch of any utterance it admits, found
+    // by trying every length and label count
+    std::string engines[] = { "log", "scaled" };
+    int32 intervals[] = { 0, 3, -1 };
+    for (int e = 0; e < 2; e++) {
+      for (int k = 0; k < 3; k++) {
+        CTCLossOptions opts;
+        opts.engine = engines[e];
+        opts.checkpoint_interval = intervals[k];
+        CTCLoss ctc(0);
+        ctc.SetOptions(opts);
+        for (int32 max_time = 1; max_time <= 60; max_time++) {
+          int32 max_labels = max_time / 3;
+          size_t bytes = 0;
+          int32 min_time = (intervals[k] < 0 ? 1 : max_time);
+          for (int32 t = min_time; t <= max_time; t++) {
+            for (int32 l = 0; l <= std::min(max_labels, t); l++) {
+              bytes = std::max(bytes, CTCWorkspace::RequiredBytes(t, l, opts));
+            }
+          }
+          KALDI_ASSERT(ctc.GetWorkspaceSize(max_time, max_labels, 4, 1) ==
+                       bytes);
+        }
+      }
+    }
+  }
+
+  void UnitTestCTCBandedMatrix() {
+    // a tight sequence only reaches a narrow band of segments per frame
+    CTCWorkspace work;
+    work.total_time = 20;
+    work.total_segments = 2 * 18 + 1;
+    std::vector<BaseFloat> data(CTCBandedMatrix<BaseFloat>::NumElements(
+        work.total_time, work.total_time, work.total_segments), 0.0);
+    CTCBandedMatrix<BaseFloat> band;
+    band.Init(work.total_time, work.total_time, work.total_segments,
+              &data[0]);
+    KALDI_ASSERT(band.Stride() < work.total_segments / 2);
+    for (int32 t = 0; t < work.total_time; t++) {
+      std::pair<int, int> range = work.segment_range(t);
+      KALDI_ASSERT(band.BandStart(t) == std::max(range.first - 2, 0));
+      KALDI_ASSERT(band.BandEnd(t) >= std::min(range.second + 2,
+                                               work.total_segments));
+      KALDI_ASSERT(band.BandEnd(t) - band.BandStart(t) <= band.Stride());
+      // neighbouring rows must not overlap
+      band.RowData(t, t)[band.BandStart(t)] = t;
+      if (t > 0) {
+        KALDI_ASSERT(band.RowData(t-1, t-1)[band.BandEnd(t-1) - 1] != t);
+      }
+    }
+  }
+
+  void UnitTestCTCLossArena() {
+    // once reserved, utterances up to the reserved size allocate nothing
+    CTCLoss ctc(0);
+    ctc.Reserve(11, 4, 5);
+    int64 host_allocations = ctc.NumHostAllocations();
+    int tgts[] = { 3, 1, 2, 4 };
+    std::vector<int32> targets(tgts, tgts + 4);
+    for (int32 num_frames = 11; num_frames >= 4; num_frames--) {
+      Matrix<BaseFloat> net_out(num_frames, 5);
+      net_out.Set(0.2);
+      CuMatrix<BaseFloat> log_net_out(net_out), obj_diff;
+      log_net_out.ApplyLog();
+      ctc.Eval(log_net_out, targets, &obj_diff);
+      double err;
+      std::vector<int32> hyp;
+      ctc.ErrorRate(log_net_out, targets, &err, &hyp);
+      CTCPosteriors post;
+      ctc.EvalPosteriors(log_net_out, targets, &post);
+      // from the softmax output itself, combined in place into the errors
+      CuMatrix<BaseFloat> probs(net_out);
+      CTCPosteriors post_probs;
+      ctc.EvalPosteriors(probs, targets, &post_probs, false);
+      AssertEqual(post_probs.posteriors, post.posteriors);
+      int64 device_allocations = ctc.NumDeviceAllocations();
+      ctc.CombinePosteriors(post_probs, &probs);
+      KALDI_ASSERT(ctc.NumDeviceAllocations() == device_allocations);
+      AssertEqual(probs, obj_diff);
+    }
+    KALDI_ASSERT(ctc.NumHostAllocations() == host_allocations);
+    KALDI_LOG << ctc.Report();
+  }
+
+  void UnitTestCTCTimingStats() {
+    CTCTimingStats timing;
+    timing.SetNumSlowest(2);
+    const char *keys[] = { "a", "b", "c" };
+    double seconds[] = { 1.0, 3.0, 2.0 };
+    for (int32 i = 0; i < 3; i++) {
+      timing.Begin(keys[i], 10, 2 * i + 1);
+      timing.Add(kForwardPhase, seconds[i] / 2);
+      timing.Add(kEditDistancePhase, seconds[i] / 2);
+    }
+    timing.Add(kDecodePhase, 1.5);  // still counted for c
+    timing.Close();
+    timing.Add(kDecodePhase, 10.0);  // no open utterance
+    std::string report = timing.Report();
+    KALDI_LOG << report;
+    // b and c are the slowest, c with its decoding; a is dropped
+    size_t b = report.find(" b (3000.000 ms"), c = report.find(" c (3500.000 ms");
+    KALDI_ASSERT(c != std::string::npos && b != std::string::npos && c < b);
+    KALDI_ASSERT(report.find(" a (") == std::string::npos);
+
+    // reporting leaves the open utterance open and changes nothing
+    CTCTimingStats open_timing;
+    open_timing.Begin("d", 10, 3);
+    open_timing.Add(kForwardPhase, 1.0);
+    std::string first = open_timing.Report();
+    KALDI_ASSERT(first == open_timing.Report() &&
+                 first.find(" d (1000.000 ms") != std::string::npos);
+    open_timing.Add(kDecodePhase, 1.0);
+    KALDI_ASSERT(open_timing.Report().find(" d (2000.000 ms") !=
+                 std::string::npos);
+    open_timing.Reset();
+    KALDI_ASSERT(open_timing.Report().find(" d (") == std::string::npos);
 
+    // nor does the report of the loss; ResetTiming() starts over
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(20, 5, 4, 4.0, &log_net_out, &target);
+    CuMatrix<BaseFloat> log_net_out_dev(log_net_out), diff;
+    CTCLoss ctc(0);
+    ctc.SetUtteranceKey("e");
+    ctc.Eval(log_net_out_dev, target, &diff);
+    std::string loss_report = ctc.Report();
+    KALDI_ASSERT(loss_report == ctc.Report() &&
+                 loss_report.find(" e (") != std::string::npos);
+    ctc.ResetTiming();
+    KALDI_ASSERT(ctc.Report().find(" e (") == std::string::npos);
   }
 
 } // namespace nnet1
@@ -143,7 +715,34 @@ int main()
         CuDevice::Instantiate().SelectGpuId("yes");
 #endif
 
-      UnitTestCTCLossUnity();
+      std::string engines[] = { "log", "scaled", "log-approx" };
+      for (int e = 0; e < 3; e++) {
+        for (int fused = 0; fused < 2; fused++) {
+          CTCLossOptions opts;
+          opts.engine = engines[e];
+          opts.fused_backward = (fused == 1);
+          UnitTestCTCLossUnity(opts);
+        }
+        // checkpointed forward variables, -1 picks sqrt(T)
+        int32 intervals[] = { 2, 3, -1 };
+        for (int k = 0; k < 3; k++) {
+          CTCLossOptions opts;
+          opts.engine = engines[e];
+          opts.checkpoint_interval = intervals[k];
+          UnitTestCTCLossUnity(opts);
+        }
+      }
+      UnitTestCTCLossBatch();
+      UnitTestCTCLossApprox();
+      UnitTestCTCLossScore();
+      UnitTestCTCLossLogits();
+      UnitTestCTCLossDecode();
+      UnitTestCTCLossStreams();
+      UnitTestCTCStreamingScorer();
+      UnitTestCTCWorkspaceSize();
+      UnitTestCTCBandedMatrix();
+      UnitTestCTCLossArena();
+      UnitTestCTCTimingStats();
       
       if (loop == 0)
         KALDI_LOG << "Tests without GPU use succeeded.";
@@ -8,171 +8,1444 @@
 #include "cudamatrix/cu-math.h"
 #include "base/kaldi-types.h"
 #include "ctc/Log.hpp"
+#include "base/timer.h"
+#include "thread/kaldi-thread.h"
+#include "thread/kaldi-mutex.h"
 #include <algorithm> 
+#include <deque>
+#include <iomanip>
 
 namespace kaldi {
 namespace nnet1 {
 
+void CTCLoss::SetOptions(const CTCLossOptions &opts)
+{
+  KALDI_ASSERT(opts.num_threads > 0);
+  if (opts.engine == "log") {
+    engine_ = kLogSpaceEngine;
+  } else if (opts.engine == "scaled") {
+    engine_ = kScaledEngine;
+  } else if (opts.engine == "log-approx") {
+    engine_ = kApproxLogSpaceEngine;
+  } else {
+    KALDI_ERR << "Unknown CTC engine " << opts.engine
+              << ", expected log, scaled or log-approx";
+  }
+  opts_ = opts;
+  timing_.SetNumSlowest(opts.report_slowest);
+}
+
 void CTCLoss::Eval(const CuMatrixBase<BaseFloat> &log_net_out,
                    const std::vector<int32> &target,
-                   CuMatrix<BaseFloat> *diff)
+                   CuMatrix<BaseFloat> *diff,
+                   CTCUtteranceResult *result)
 {
+  const int32 num_rows = log_net_out.NumRows(), num_cols = log_net_out.NumCols();
   // download from GPU
-  log_net_out_host_.Resize(log_net_out.NumRows(), log_net_out.NumCols());
-  log_net_out.CopyToMat(&log_net_out_host_);
+  Timer timer;
+  SubMatrix<BaseFloat> log_net_out_host(
+      arena_.MatrixView(CTCArena::kNetOut, num_rows, num_cols));
+  log_net_out.CopyToMat(&log_net_out_host);
+  double copy_seconds = timer.Elapsed();
 
   // calculate CTC errors
-  eval_on_host(log_net_out_host_, target, &diff_host_);
+  SubMatrix<BaseFloat> diff_host(
+      arena_.MatrixView(CTCArena::kDiff, num_rows, num_cols));
+  eval_on_host(log_net_out_host, target, &diff_host, result);
 
-  diff->Resize(log_net_out.NumRows(), log_net_out.NumCols());
+  timer.Reset();
+  if (diff->NumRows() != num_rows || diff->NumCols() != num_cols) {
+    diff->Resize(num_rows, num_cols, kUndefined);
+    num_device_allocations_++;
+  }
   // -> GPU
-  *diff = diff_host_;
+  diff->CopyFromMat(diff_host);
+  timing_.Add(kCopyPhase, copy_seconds + timer.Elapsed());
 }
 
 void CTCLoss::eval_on_host(const MatrixBase<BaseFloat> &log_net_out,
                   const std::vector<int32> &target,
-                  Matrix<BaseFloat> *diff)
+                  MatrixBase<BaseFloat> *diff,
+                  CTCUtteranceResult *result)
+{
+  if (log_net_out.NumRows() < required_time(target)) {
+    KALDI_ERR << "required time > total time; this should not happen because"
+      " this should have been checked before calling this function";
+  }
+  KALDI_ASSERT(diff->NumRows() == log_net_out.NumRows() &&
+               diff->NumCols() == log_net_out.NumCols());
+  int32 total_time = log_net_out.NumRows(), num_labels = target.size();
+  size_t bytes = CTCWorkspace::RequiredBytes(total_time, num_labels, opts_);
+  char *workspace = arena_.Get(CTCArena::kWorkspace, bytes);
+  if (result != NULL) {
+    // one sequence, so the workspace is used directly and the best path is
+    // taken while every row is in cache for the errors
+    workspace_.Bind(workspace, bytes);
+    double forward = workspace_.forward_seconds,
+        backward = workspace_.backward_seconds,
+        gradient = workspace_.gradient_seconds;
+    maxid_host_.resize(total_time);
+    result->log_prob = compute_on_host(
+        log_net_out, (num_labels > 0 ? &target[0] : NULL), num_labels,
+        &workspace_, diff, &maxid_host_[0]);
+    timing_.Begin(utterance_key_, total_time, 2 * num_labels + 1);
+    utterance_key_.clear();
+    timing_.Add(kForwardPhase, workspace_.forward_seconds - forward);
+    timing_.Add(kBackwardPhase, workspace_.backward_seconds - backward);
+    timing_.Add(kGradientPhase, workspace_.gradient_seconds - gradient);
+    record_progress(result->log_prob, total_time);
+    record_errors(target, result);
+    return;
+  }
+  BaseFloat log_prob;
+  ComputeRaw(log_net_out.Data(), log_net_out.Stride(), log_net_out.NumCols(),
+             &total_time, (num_labels > 0 ? &target[0] : NULL), &num_labels,
+             1, diff->Data(), diff->Stride(), &log_prob, workspace, bytes);
+}
+
+void CTCLoss::EvalLogits(const CuMatrixBase<BaseFloat> &logits,
+                         const std::vector<int32> &target,
+                         CuMatrix<BaseFloat> *diff,
+                         CTCUtteranceResult *result)
+{
+  const int32 num_rows = logits.NumRows(), num_cols = logits.NumCols();
+  // download from GPU; the host copy becomes the log-softmax
+  Timer timer;
+  SubMatrix<BaseFloat> logits_host(
+      arena_.MatrixView(CTCArena::kNetOut, num_rows, num_cols));
+  logits.CopyToMat(&logits_host);
+  double copy_seconds = timer.Elapsed();
+
+  SubMatrix<BaseFloat> diff_host(
+      arena_.MatrixView(CTCArena::kDiff, num_rows, num_cols));
+  eval_logits_on_host(&logits_host, target, &diff_host, result);
+
+  timer.Reset();
+  if (diff->NumRows() != num_rows || diff->NumCols() != num_cols) {
+    diff->Resize(num_rows, num_cols, kUndefined);
+    num_device_allocations_++;
+  }
+  // -> GPU
+  diff->CopyFromMat(diff_host);
+  timing_.Add(kCopyPhase, copy_seconds + timer.Elapsed());
+}
+
+void CTCLoss::eval_logits_on_host(MatrixBase<BaseFloat> *logits,
+                                  const std::vector<int32> &target,
+                                  MatrixBase<BaseFloat> *diff,
+                                  CTCUtteranceResult *result)
 {
+  if (logits->NumRows() < required_time(target)) {
+    KALDI_ERR << "required time > total time; this should not happen because"
+      " this should have been checked before calling this function";
+  }
   KALDI_ASSERT(blank_ >= 0);
-  diff->Resize(log_net_out.NumRows(), log_net_out.NumCols());
+  KALDI_ASSERT(diff->NumRows() == logits->NumRows() &&
+               diff->NumCols() == logits->NumCols());
+  const int32 total_time = logits->NumRows(), num_labels = target.size();
+  size_t bytes = CTCWorkspace::RequiredBytes(total_time, num_labels, opts_);
+  workspace_.Bind(arena_.Get(CTCArena::kWorkspace, bytes), bytes);
+  double forward = workspace_.forward_seconds,
+      backward = workspace_.backward_seconds,
+      gradient = workspace_.gradient_seconds;
 
-  total_time_ = log_net_out.NumRows();
-  // check required time > total time
-  {
-    int required_time = target.size();
-    int32 old_label = -1;
-    for (size_t i = 0; i != target.size(); i++) {
-      if (old_label == target[i]) {
-        required_time++;
-      }
-      old_label = target[i];
+  // the softmax goes straight into diff, so the errors need no further exp
+  Timer timer;
+  if (result != NULL) maxid_host_.resize(total_time);
+  log_softmax_on_host(logits, diff,
+                      (result != NULL ? &maxid_host_[0] : NULL));
+  workspace_.gradient_seconds += timer.Elapsed();
+
+  workspace_.Prepare(total_time, num_labels, opts_);
+  workspace_.columns[0] = blank_;
+  std::copy(target.begin(), target.end(), workspace_.columns + 1);
+  SubMatrix<BaseFloat> posteriors(workspace_.posteriors, total_time,
+                                  num_labels + 1, num_labels + 1);
+  BaseFloat log_prob = posteriors_on_host(
+      *logits, workspace_.columns, (num_labels > 0 ? &target[0] : NULL),
+      num_labels, &workspace_, &posteriors);
+  timer.Reset();
+  CombinePosteriors(posteriors, workspace_.columns, diff);
+  workspace_.gradient_seconds += timer.Elapsed();
+
+  timing_.Begin(utterance_key_, total_time, 2 * num_labels + 1);
+  utterance_key_.clear();
+  timing_.Add(kForwardPhase, workspace_.forward_seconds - forward);
+  timing_.Add(kBackwardPhase, workspace_.backward_seconds - backward);
+  timing_.Add(kGradientPhase, workspace_.gradient_seconds - gradient);
+  record_progress(log_prob, total_time);
+  if (result != NULL) {
+    result->log_prob = log_prob;
+    record_errors(target, result);
+  }
+}
+
+void CTCLoss::log_softmax_on_host(MatrixBase<BaseFloat> *logits,
+                                  MatrixBase<BaseFloat> *probs,
+                                  int32 *best_ids)
+{
+  KALDI_ASSERT(probs->NumRows() == logits->NumRows() &&
+               probs->NumCols() == logits->NumCols());
+  const int32 dim = logits->NumCols();
+  for (int32 t = 0; t < logits->NumRows(); t++) {
+    BaseFloat *row = logits->RowData(t), *prob = probs->RowData(t);
+    int32 best = 0;
+    for (int32 v = 1; v < dim; v++) {
+      if (row[v] > row[best]) best = v;
     }
-    if (total_time_ < required_time) {
-      KALDI_ERR << "required time > total time; this should not happen because"
-        " this should have been checked before calling this function";
+    const BaseFloat max = row[best];
+    if (best_ids != NULL) best_ids[t] = best;
+    // shifted by the maximum, exp stays in range and the sum is >= 1
+    for (int32 v = 0; v < dim; v++) row[v] -= max;
+    Log<BaseFloat>::safe_exp(row, prob, dim);
+    double sum = 0.0;
+    for (int32 v = 0; v < dim; v++) sum += prob[v];
+    const BaseFloat log_sum = std::log(sum), scale = 1.0 / sum;
+    for (int32 v = 0; v < dim; v++) {
+      row[v] -= log_sum;
+      prob[v] *= scale;
     }
   }
-  
-  total_segments_ = target.size() * 2 + 1;
-  
-  // calculate the forward variables
-  forward_variables_.Resize(total_time_, total_segments_, kUndefined);
-  forward_variables_.Set(Log<BaseFloat>::logZero);
-  forward_variables_(0, 0) = log_net_out(0, blank_);
-  if (total_segments_ > 1) {
-    forward_variables_(0, 1) = log_net_out(0, target[0]);
-  }
-  for (int t = 1; t < total_time_; t++) {
-    SubVector<BaseFloat> log_acts(log_net_out, t);
-    SubVector<BaseFloat> old_fvars(forward_variables_, t-1);
-    SubVector<BaseFloat> fvars(forward_variables_, t);
-    std::pair<int, int> this_range = segment_range(t);
-    for (int s = this_range.first; s != this_range.second; s++) {
-      BaseFloat fv = Log<BaseFloat>::logZero;
-      // s odd (label output)
-      if (s & 1) {
-        int label_index = s / 2;
-        int label_num = target[label_index];
-        fv = Log<BaseFloat>::log_add(old_fvars(s), old_fvars(s-1));
-        if (s > 1 && (label_num != target[label_index-1])) {
-          fv = Log<BaseFloat>::log_add(fv, old_fvars(s-2));
-        }
-        fv = Log<BaseFloat>::log_multiply(fv, log_acts(label_num));
-      } else { // s even (blank output)
-        fv = old_fvars(s);
-        if (s) {
-          fv = Log<BaseFloat>::log_add(fv, old_fvars(s-1));
+}
+
+namespace {
+
+/// Work-stealing scheduler for EvalBatch. Jobs are dealt round-robin
+/// in the given order (longest first), each worker takes the front of
+/// its own deque and steals from the back of the others when it runs dry.
+class WorkStealingQueue {
+public:
+  WorkStealingQueue(const std::vector<int32> &jobs, int32 num_workers)
+    : queues_(num_workers), locks_(new Mutex[num_workers]) {
+    for (size_t i = 0; i < jobs.size(); i++) {
+      queues_[i % num_workers].push_back(jobs[i]);
+    }
+  }
+  ~WorkStealingQueue() { delete [] locks_; }
+
+  bool Pop(int32 worker, int32 *job) {
+    int32 num_workers = queues_.size();
+    for (int32 n = 0; n < num_workers; n++) {
+      int32 victim = (worker + n) % num_workers;
+      locks_[victim].Lock();
+      std::deque<int32> &queue = queues_[victim];
+      bool found = !queue.empty();
+      if (found) {
+        if (victim == worker) {
+          *job = queue.front();
+          queue.pop_front();
+        } else {
+          *job = queue.back();
+          queue.pop_back();
         }
-        fv = Log<BaseFloat>::log_multiply(fv, log_acts(blank_));
       }
-      fvars(s) = fv;
-    } // for (int s)
+      locks_[victim].Unlock();
+      if (found) return true;
+    }
+    return false;
+  }
+
+private:
+  std::vector<std::deque<int32> > queues_;
+  Mutex *locks_;
+  KALDI_DISALLOW_COPY_AND_ASSIGN(WorkStealingQueue);
+};
+
+/// Sequences of a ComputeRaw call; offsets locate every sequence
+struct RawBatch {
+  const BaseFloat *log_acts;
+  int32 act_stride;
+  int32 num_outputs;
+  const int32 *lengths;
+  const int32 *frame_offsets;
+  const int32 *labels;
+  const int32 *label_lengths;
+  const int32 *label_offsets;
+  BaseFloat *grads;
+  int32 grad_stride;
+  BaseFloat *log_probs;
+  double *phase_seconds;      // forward, backward and gradient per sequence
+};
+
+class CTCBatchTask: public MultiThreadable {
+public:
+  CTCBatchTask(const CTCLoss *ctc, const RawBatch *batch,
+               WorkStealingQueue *queue,
+               std::vector<CTCWorkspace*> *workspaces)
+    : ctc_(ctc), batch_(batch), queue_(queue), workspaces_(workspaces) { }
+
+  void operator() () {
+    CTCWorkspace *work = (*workspaces_)[thread_id_];
+    int32 seq;
+    while (queue_->Pop(thread_id_, &seq)) {
+      Compute(seq, work);
+    }
+  }
+
+  /// Evaluates one sequence, viewing the raw buffers as matrices
+  void Compute(int32 seq, CTCWorkspace *work) const {
+    const RawBatch &b = *batch_;
+    int32 offset = b.frame_offsets[seq], length = b.lengths[seq];
+    SubMatrix<BaseFloat> seq_out(
+        const_cast<BaseFloat*>(b.log_acts) +
+        static_cast<size_t>(offset) * b.act_stride,
+        length, b.num_outputs, b.act_stride);
+    const int32 *target = b.labels + b.label_offsets[seq];
+    double forward = work->forward_seconds, backward = work->backward_seconds,
+        gradient = work->gradient_seconds;
+    if (b.grads != NULL) {
+      SubMatrix<BaseFloat> seq_diff(
+          b.grads + static_cast<size_t>(offset) * b.grad_stride,
+          length, b.num_outputs, b.grad_stride);
+      b.log_probs[seq] = ctc_->compute_on_host(seq_out, target,
+                                               b.label_lengths[seq], work,
+                                               &seq_diff);
+    } else {
+      b.log_probs[seq] = ctc_->compute_on_host(seq_out, target,
+                                               b.label_lengths[seq], work,
+                                               NULL);
+    }
+    b.phase_seconds[3 * seq] = work->forward_seconds - forward;
+    b.phase_seconds[3 * seq + 1] = work->backward_seconds - backward;
+    b.phase_seconds[3 * seq + 2] = work->gradient_seconds - gradient;
+  }
+
+private:
+  const CTCLoss *ctc_;
+  const RawBatch *batch_;
+  WorkStealingQueue *queue_;
+  std::vector<CTCWorkspace*> *workspaces_;
+};
+
+/// Longest first; ties keep the order of the batch
+struct LongerSequence {
+  explicit LongerSequence(const int32 *lengths): lengths_(lengths) { }
+  bool operator() (int32 a, int32 b) const {
+    return lengths_[a] > lengths_[b] || (lengths_[a] == lengths_[b] && a < b);
+  }
+  const int32 *lengths_;
+};
+
+} // namespace
+
+void CTCLoss::EvalBatch(const CuMatrixBase<BaseFloat> &log_net_out,
+                        const std::vector<int32> &seq_lengths,
+                        const std::vector<std::vector<int32> > &targets,
+                        CuMatrix<BaseFloat> *diff,
+                        std::vector<BaseFloat> *log_probs)
+{
+  const int32 num_rows = log_net_out.NumRows(), num_cols = log_net_out.NumCols();
+  // download from GPU; the transfers of a batch are not split between its
+  // utterances
+  Timer timer;
+  SubMatrix<BaseFloat> log_net_out_host(
+      arena_.MatrixView(CTCArena::kNetOut, num_rows, num_cols));
+  log_net_out.CopyToMat(&log_net_out_host);
+  batch_copy_seconds_ += timer.Elapsed();
+
+  SubMatrix<BaseFloat> diff_host(
+      arena_.MatrixView(CTCArena::kDiff, num_rows, num_cols));
+  eval_batch_on_host(log_net_out_host, seq_lengths, targets, &diff_host,
+                     (log_probs != NULL ? log_probs : &batch_log_probs_));
+
+  timer.Reset();
+  if (diff->NumRows() != num_rows || diff->NumCols() != num_cols) {
+    diff->Resize(num_rows, num_cols, kUndefined);
+    num_device_allocations_++;
+  }
+  // -> GPU
+  diff->CopyFromMat(diff_host);
+  batch_copy_seconds_ += timer.Elapsed();
+}
+
+void CTCLoss::eval_batch_on_host(const MatrixBase<BaseFloat> &log_net_out,
+                                 const std::vector<int32> &seq_lengths,
+                                 const std::vector<std::vector<int32> > &targets,
+                                 MatrixBase<BaseFloat> *diff,
+                                 std::vector<BaseFloat> *log_probs)
+{
+  KALDI_ASSERT(seq_lengths.size() == targets.size());
+  int32 num_seqs = seq_lengths.size(), max_length = 0, max_labels = 0;
+  // the raw interface takes the targets back to back
+  batch_labels_.clear();
+  batch_label_lengths_.resize(num_seqs);
+  for (int32 n = 0; n < num_seqs; n++) {
+    batch_labels_.insert(batch_labels_.end(), targets[n].begin(),
+                         targets[n].end());
+    batch_label_lengths_[n] = targets[n].size();
+    max_length = std::max(max_length, seq_lengths[n]);
+    max_labels = std::max(max_labels, batch_label_lengths_[n]);
+  }
+
+  KALDI_ASSERT(diff->NumRows() == log_net_out.NumRows() &&
+               diff->NumCols() == log_net_out.NumCols());
+  log_probs->resize(num_seqs);
+  if (num_seqs == 0) return;
+
+  size_t bytes = 0;
+  for (int32 n = 0; n < num_seqs; n++) {
+    bytes = std::max(bytes, CTCWorkspace::RequiredBytes(
+        seq_lengths[n], batch_label_lengths_[n], opts_));
+  }
+  bytes *= std::min(opts_.num_threads, num_seqs);
+  char *workspace = arena_.Get(CTCArena::kWorkspace, bytes);
+  ComputeRaw(log_net_out.Data(), log_net_out.Stride(), log_net_out.NumCols(),
+             &seq_lengths[0],
+             (batch_labels_.empty() ? NULL : &batch_labels_[0]),
+             &batch_label_lengths_[0], num_seqs, diff->Data(),
+             diff->Stride(), &(*log_probs)[0], workspace, bytes);
+}
+
+void CTCLoss::EvalStreams(const CuMatrixBase<BaseFloat> &log_net_out,
+                          const std::vector<int32> &seq_lengths,
+                          const std::vector<std::vector<int32> > &targets,
+                          CuMatrix<BaseFloat> *diff,
+                          std::vector<CTCUtteranceResult> *results)
+{
+  const int32 num_rows = log_net_out.NumRows(), num_cols = log_net_out.NumCols();
+  // download from GPU, the streams are separated on the host
+  Timer timer;
+  SubMatrix<BaseFloat> log_net_out_host(
+      arena_.MatrixView(CTCArena::kNetOut, num_rows, num_cols));
+  log_net_out.CopyToMat(&log_net_out_host);
+  batch_copy_seconds_ += timer.Elapsed();
+
+  SubMatrix<BaseFloat> diff_host(
+      arena_.MatrixView(CTCArena::kDiff, num_rows, num_cols));
+  eval_streams_on_host(log_net_out_host, seq_lengths, targets, &diff_host,
+                       results);
+
+  timer.Reset();
+  if (diff->NumRows() != num_rows || diff->NumCols() != num_cols) {
+    diff->Resize(num_rows, num_cols, kUndefined);
+    num_device_allocations_++;
+  }
+  // -> GPU
+  diff->CopyFromMat(diff_host);
+  batch_copy_seconds_ += timer.Elapsed();
+}
+
+void CTCLoss::ScoreStreams(const CuMatrixBase<BaseFloat> &log_net_out,
+                           const std::vector<int32> &seq_lengths,
+                           const std::vector<std::vector<int32> > &targets,
+                           std::vector<CTCUtteranceResult> *results)
+{
+  const int32 num_streams = seq_lengths.size(),
+      num_rows = log_net_out.NumRows(), num_cols = log_net_out.NumCols();
+  KALDI_ASSERT(num_streams > 0 && targets.size() == seq_lengths.size());
+  int32 max_length = *std::max_element(seq_lengths.begin(),
+                                       seq_lengths.end());
+  KALDI_ASSERT(num_rows == max_length * num_streams);
+  // download from GPU, the streams are separated on the host
+  Timer timer;
+  SubMatrix<BaseFloat> log_net_out_host(
+      arena_.MatrixView(CTCArena::kNetOut, num_rows, num_cols));
+  log_net_out.CopyToMat(&log_net_out_host);
+  batch_copy_seconds_ += timer.Elapsed();
+
+  std::vector<std::string> keys;
+  keys.swap(utterance_keys_);
+  if (keys.size() != static_cast<size_t>(num_streams)) keys.clear();
+  if (results != NULL) results->resize(num_streams);
+  for (int32 s = 0; s < num_streams; s++) {
+    SubMatrix<BaseFloat> stream(
+        arena_.MatrixView(CTCArena::kStreamNetOut, seq_lengths[s], num_cols));
+    for (int32 t = 0; t < seq_lengths[s]; t++) {
+      const BaseFloat *row = log_net_out_host.RowData(t * num_streams + s);
+      std::copy(row, row + num_cols, stream.RowData(t));
+    }
+    if (!keys.empty()) utterance_key_ = keys[s];
+    ScoreOnHost(stream, targets[s], (results != NULL ? &(*results)[s] : NULL));
+  }
+  utterance_key_.clear();
+}
+
+void CTCLoss::eval_streams_on_host(const MatrixBase<BaseFloat> &log_net_out,
+                                   const std::vector<int32> &seq_lengths,
+                                   const std::vector<std::vector<int32> > &targets,
+                                   MatrixBase<BaseFloat> *diff,
+                                   std::vector<CTCUtteranceResult> *results)
+{
+  int32 num_streams = seq_lengths.size(), num_cols = log_net_out.NumCols(),
+      max_length = 0, total_length = 0;
+  for (int32 s = 0; s < num_streams; s++) {
+    max_length = std::max(max_length, seq_lengths[s]);
+    total_length += seq_lengths[s];
+  }
+  KALDI_ASSERT(log_net_out.NumRows() == max_length * num_streams &&
+               diff->NumRows() == log_net_out.NumRows() &&
+               diff->NumCols() == num_cols);
+
+  // the streams one after another, as the raw interface takes them; the
+  // best output of a row is taken while it is copied
+  SubMatrix<BaseFloat> packed(
+      arena_.MatrixView(CTCArena::kStreamNetOut, total_length, num_cols));
+  SubMatrix<BaseFloat> packed_diff(
+      arena_.MatrixView(CTCArena::kStreamDiff, total_length, num_cols));
+  stream_best_ids_.resize(total_length);
+  for (int32 s = 0, offset = 0; s < num_streams; offset += seq_lengths[s++]) {
+    for (int32 t = 0; t < seq_lengths[s]; t++) {
+      const BaseFloat *row = log_net_out.RowData(t * num_streams + s);
+      std::copy(row, row + num_cols, packed.RowData(offset + t));
+      stream_best_ids_[offset + t] = std::max_element(row, row + num_cols) -
+          row;
+    }
+  }
+
+  eval_batch_on_host(packed, seq_lengths, targets, &packed_diff,
+                     &batch_log_probs_);
+
+  // back into the streams; the padding gets no errors
+  diff->SetZero();
+  for (int32 s = 0, offset = 0; s < num_streams; offset += seq_lengths[s++]) {
+    for (int32 t = 0; t < seq_lengths[s]; t++) {
+      const BaseFloat *row = packed_diff.RowData(offset + t);
+      std::copy(row, row + num_cols, diff->RowData(t * num_streams + s));
+    }
+  }
+
+  if (results == NULL) return;
+  results->resize(num_streams);
+  for (int32 s = 0, offset = 0; s < num_streams; offset += seq_lengths[s++]) {
+    maxid_host_.assign(stream_best_ids_.begin() + offset,
+                       stream_best_ids_.begin() + offset + seq_lengths[s]);
+    (*results)[s].log_prob = batch_log_probs_[s];
+    record_errors(targets[s], &(*results)[s]);
+  }
+}
+
+size_t CTCLoss::GetWorkspaceSize(int32 max_time, int32 max_labels,
+                                 int32 num_outputs, int32 batch) const
+{
+  KALDI_ASSERT(max_time > 0 && max_labels >= 0 && batch > 0);
+  // the host pass needs no scratch per network output; num_outputs is
+  // part of the query so that a device implementation can use it
+  // the scratch grows with the labels, and with the length as long as
+  // the checkpoint interval stays the same. An automatic interval
+  // round(sqrt(t)) is k up to t = k * (k + 1), so only those lengths and
+  // max_time can need the most
+  size_t bytes = CTCWorkspace::RequiredBytes(
+      max_time, std::min(max_labels, max_time), opts_);
+  if (opts_.checkpoint_interval < 0) {
+    for (int32 k = 1; k * (k + 1) < max_time; k++) {
+      int32 t = k * (k + 1);
+      bytes = std::max(bytes, CTCWorkspace::RequiredBytes(
+          t, std::min(max_labels, t), opts_));
+    }
+  }
+  return bytes * std::min(opts_.num_threads, batch);
+}
+
+void CTCLoss::ComputeRaw(const BaseFloat *log_acts, int32 act_stride,
+                         int32 num_outputs, const int32 *lengths,
+                         const int32 *labels, const int32 *label_lengths,
+                         int32 batch, BaseFloat *grads, int32 grad_stride,
+                         BaseFloat *log_probs, void *workspace,
+                         size_t workspace_bytes)
+{
+  KALDI_ASSERT(batch > 0 && act_stride >= num_outputs);
+  KALDI_ASSERT(grads == NULL || grad_stride >= num_outputs);
+  raw_frame_offsets_.resize(batch);
+  raw_label_offsets_.resize(batch);
+  size_t slice = 0;
+  for (int32 n = 0, frames = 0, num_labels = 0; n < batch; n++) {
+    if (lengths[n] < required_time(labels + num_labels, label_lengths[n])) {
+      KALDI_ERR << "required time > total time for sequence " << n
+                << " of the batch";
+    }
+    raw_frame_offsets_[n] = frames;
+    raw_label_offsets_[n] = num_labels;
+    frames += lengths[n];
+    num_labels += label_lengths[n];
+    slice = std::max(slice, CTCWorkspace::RequiredBytes(
+        lengths[n], label_lengths[n], opts_));
+  }
+  // every worker gets a slice that fits the largest sequence
+  int32 num_threads = std::max(1, std::min(opts_.num_threads, batch));
+  if (workspace_bytes < slice * num_threads) {
+    KALDI_ERR << "CTC workspace of " << workspace_bytes << " bytes is too "
+              << "small, need " << slice * num_threads;
+  }
+  if (batch_workspaces_.size() < static_cast<size_t>(num_threads - 1)) {
+    batch_workspaces_.resize(num_threads - 1);
+  }
+  raw_workers_.resize(num_threads);
+  raw_workers_[0] = &workspace_;
+  for (int32 w = 1; w < num_threads; w++) {
+    raw_workers_[w] = &batch_workspaces_[w - 1];
+  }
+  for (int32 w = 0; w < num_threads; w++) {
+    raw_workers_[w]->Bind(static_cast<char*>(workspace) + w * slice, slice);
+  }
+
+  raw_phase_seconds_.resize(3 * batch);
+  RawBatch raw = { log_acts, act_stride, num_outputs, lengths,
+                   &raw_frame_offsets_[0], labels, label_lengths,
+                   &raw_label_offsets_[0], grads, grad_stride, log_probs,
+                   &raw_phase_seconds_[0] };
+  if (num_threads == 1) {
+    CTCBatchTask task(this, &raw, NULL, &raw_workers_);
+    for (int32 n = 0; n < batch; n++) {
+      task.Compute(n, &workspace_);
+    }
+  } else {
+    // longest sequences go first, so the short ones fill up the gaps
+    raw_order_.resize(batch);
+    for (int32 n = 0; n < batch; n++) raw_order_[n] = n;
+    std::sort(raw_order_.begin(), raw_order_.end(), LongerSequence(lengths));
+    WorkStealingQueue queue(raw_order_, num_threads);
+    CTCBatchTask task(this, &raw, &queue, &raw_workers_);
+    // the destructor waits for all the threads to finish
+    MultiThreader<CTCBatchTask> threader(num_threads, task);
+  }
+
+  // record progress in sequence order, so the statistics do not depend
+  // on the scheduling
+  for (int32 n = 0; n < batch; n++) {
+    std::string key = utterance_key_;
+    if (utterance_keys_.size() == static_cast<size_t>(batch)) {
+      key = utterance_keys_[n];
+    } else if (batch > 1 && !key.empty()) {
+      std::ostringstream oss;
+      oss << key << '[' << n << ']';
+      key = oss.str();
+    }
+    timing_.Begin(key, lengths[n], 2 * label_lengths[n] + 1);
+    timing_.Add(kForwardPhase, raw_phase_seconds_[3 * n]);
+    timing_.Add(kBackwardPhase, raw_phase_seconds_[3 * n + 1]);
+    timing_.Add(kGradientPhase, raw_phase_seconds_[3 * n + 2]);
+    record_progress(log_probs[n], lengths[n]);
+  }
+  utterance_key_.clear();
+  utterance_keys_.clear();
+}
+
+namespace {
+
+/// Log-space engine: the lattices hold log probabilities, combined with
+/// the span kernels of Log<BaseFloat> one row at a time. With approx the
+/// log_add of both recursions and of the posteriors is interpolated from
+/// a table (Log<BaseFloat>::log_add_approx).
+template<bool approx>
+struct LogSpaceEngineT {
+  typedef BaseFloat Real;
+  static CTCLattice<Real> &Lattice(CTCWorkspace *w) { return w->log_lattice; }
+  static Real Zero() { return Log<Real>::logZero; }
+  static Real One() { return 0; }
+  static Real FromLog(BaseFloat x) { return x; }
+  static Real Add(Real x, Real y) {
+    return approx ? Log<Real>::log_add_approx(x, y) :
+        Log<Real>::log_add(x, y);
+  }
+  static void AddRow(const Real *x, const Real *y, Real *out, int n) {
+    if (approx) {
+      Log<Real>::log_add_approx(x, y, out, n);
+    } else {
+      Log<Real>::log_add(x, y, out, n);
+    }
+  }
+  static Real Mul(Real x, Real y) { return Log<Real>::log_multiply(x, y); }
+  static bool Rescale(Real *row, int start, int end, double *log_scale) {
+    *log_scale = 0;
+    return true;
+  }
+  static double LogProb(Real prob, double log_scale) { return prob; }
+  static Real FrameNorm(const Real *fvars, const Real *bvars,
+                        int start, int end, BaseFloat log_prob) {
+    return log_prob;
+  }
+  static BaseFloat Posterior(Real sum, Real norm) {
+    return Log<Real>::safe_exp(Log<Real>::log_divide(sum, norm));
+  }
+  /// cur[s] for s in [start, end), start >= 2
+  static void ForwardRow(const Real *old, const Real *acts, const Real *skip,
+                         Real *tmp, Real *cur, int start, int end) {
+    int n = end - start;
+    AddRow(old + start, old + start - 1, cur + start, n);
+    Log<Real>::log_multiply(old + start - 2, skip + start, tmp + start, n);
+    AddRow(cur + start, tmp + start, cur + start, n);
+    Log<Real>::log_multiply(cur + start, acts + start, cur + start, n);
+  }
+  /// cur[s] for s in [start, end), end + 2 <= total segments
+  static void BackwardRow(const Real *old, const Real *acts, const Real *skip,
+                          Real *tmp, Real *cur, int start, int end) {
+    int n = end - start;
+    Log<Real>::log_multiply(old + start, acts + start, tmp + start, n + 2);
+    AddRow(tmp + start, tmp + start + 1, cur + start, n);
+    Log<Real>::log_multiply(tmp + start + 2, skip + start + 2,
+                            tmp + start + 2, n);
+    AddRow(cur + start, tmp + start + 2, cur + start, n);
+  }
+};
+typedef LogSpaceEngineT<false> LogSpaceEngine;
+typedef LogSpaceEngineT<true> ApproxLogSpaceEngine;
+
+/// Scaled engine (Graves 2012, section 7.3.1): the lattices hold plain
+/// probabilities and each row is rescaled to sum to one, so no cell needs
+/// a log or an exp. log[P(z|x)] is rebuilt from the forward scales, and
+/// the posteriors are normalised per frame, which cancels both scales.
+/// The lattices are double: within one row the cells still span many
+/// orders of magnitude, more than a float can hold.
+struct ScaledEngine {
+  typedef double Real;
+  static CTCLattice<Real> &Lattice(CTCWorkspace *w) {
+    return w->scaled_lattice;
+  }
+  static Real Zero() { return 0; }
+  static Real One() { return 1; }
+  static Real FromLog(BaseFloat x) { return std::exp(static_cast<Real>(x)); }
+  static Real Add(Real x, Real y) { return x + y; }
+  static Real Mul(Real x, Real y) { return x * y; }
+  /// Returns false if the row underflowed to zero.
+  static bool Rescale(Real *row, int start, int end, double *log_scale) {
+    double sum = 0.0;
+    for (int s = start; s < end; s++) sum += row[s];
+    if (!(sum > 0.0) || sum - sum != 0.0) return false;
+    Real scale = 1.0 / sum;
+    for (int s = start; s < end; s++) row[s] *= scale;
+    *log_scale = std::log(sum);
+    return true;
+  }
+  static double LogProb(Real prob, double log_scale) {
+    // the scales are at most one up to rounding
+    return std::min(0.0, log_scale + std::log(prob));
+  }
+  static Real FrameNorm(const Real *fvars, const Real *bvars,
+                        int start, int end, BaseFloat log_prob) {
+    double sum = 0.0;
+    for (int s = start; s < end; s++) sum += fvars[s] * bvars[s];
+    return sum;
+  }
+  static BaseFloat Posterior(Real sum, Real norm) {
+    return sum / norm;
+  }
+  static void ForwardRow(const Real *old, const Real *acts, const Real *skip,
+                         Real *tmp, Real *cur, int start, int end) {
+    for (int s = start; s < end; s++) {
+      cur[s] = (old[s] + old[s-1] + old[s-2] * skip[s]) * acts[s];
+    }
+  }
+  static void BackwardRow(const Real *old, const Real *acts, const Real *skip,
+                          Real *tmp, Real *cur, int start, int end) {
+    for (int s = start; s < end; s++) {
+      cur[s] = old[s] * acts[s] + old[s+1] * acts[s+1] +
+               old[s+2] * acts[s+2] * skip[s+2];
+    }
+  }
+};
+
+/// Gathers the given columns of log_acts (the blank, then one per target
+/// label) into a contiguous (T, L+1) matrix in the engine domain. Also
+/// builds the per-segment skip mask, One() where a label can follow the
+/// previous label directly (the labels differ). The recursions read only
+/// this compact data, never the vocabulary-wide rows.
+template<class Engine>
+void GatherLabelActivations(const MatrixBase<BaseFloat> &log_acts,
+                            const int32 *columns, const int32 *target,
+                            int32 num_labels,
+                            CTCLattice<typename Engine::Real> *lattice) {
+  typedef typename Engine::Real Real;
+  const int32 total_segments = 2 * num_labels + 1;
+  for (int32 t = 0; t < log_acts.NumRows(); t++) {
+    const BaseFloat *log_row = log_acts.RowData(t);
+    Real *row = lattice->label_acts + static_cast<size_t>(t) *
+        (num_labels + 1);
+    for (int32 j = 0; j <= num_labels; j++) {
+      row[j] = Engine::FromLog(log_row[columns[j]]);
+    }
+  }
+  for (int32 s = 0; s < total_segments; s++) {
+    lattice->skip[s] = ((s & 1) && s > 1 && target[s/2] != target[s/2 - 1]) ?
+        Engine::One() : Engine::Zero();
+  }
+}
+
+/// Activations of the segments [start, end) at one frame: the blank
+/// column for even s, label (s+1)/2 for odd s.
+template<typename Real>
+inline void ExpandActivations(const Real *label_row, int start, int end,
+                              Real *acts) {
+  for (int s = start; s < end; s++) {
+    acts[s] = label_row[(s & 1) * ((s + 1) >> 1)];
+  }
+}
+
+/// The forward and backward recursions of a single cell; the row
+/// functions of the engines do the same for whole ranges of s.
+template<class Engine>
+inline typename Engine::Real ForwardCell(const typename Engine::Real *old,
+                                         const typename Engine::Real *acts,
+                                         const typename Engine::Real *skip,
+                                         int s) {
+  typename Engine::Real fv = old[s];
+  if (s > 0) fv = Engine::Add(fv, old[s-1]);
+  if (s > 1) fv = Engine::Add(fv, Engine::Mul(old[s-2], skip[s]));
+  return Engine::Mul(fv, acts[s]);
+}
+
+template<class Engine>
+inline typename Engine::Real BackwardCell(const typename Engine::Real *old,
+                                          const typename Engine::Real *acts,
+                                          const typename Engine::Real *skip,
+                                          int s, int total_segments) {
+  typename Engine::Real bv = Engine::Mul(old[s], acts[s]);
+  if (s + 1 < total_segments) {
+    bv = Engine::Add(bv, Engine::Mul(old[s+1], acts[s+1]));
+  }
+  if (s + 2 < total_segments) {
+    bv = Engine::Add(bv, Engine::Mul(Engine::Mul(old[s+2], acts[s+2]),
+                                     skip[s+2]));
+  }
+  return bv;
+}
+
+/// Writes the label posteriors of one frame from the lattice cells in
+/// range: column 0 sums the blank cells (even s), column i+1 holds the
+/// cell of label i (s = 2i+1), zero outside range.
+template<class Engine>
+void InjectPosteriors(int time, const typename Engine::Real *fvars,
+                      const typename Engine::Real *bvars,
+                      std::pair<int, int> range, BaseFloat log_prob,
+                      MatrixBase<BaseFloat> *posteriors) {
+  typename Engine::Real norm = Engine::FrameNorm(fvars, bvars, range.first,
+                                                 range.second, log_prob);
+  BaseFloat *post = posteriors->RowData(time);
+  std::fill(post, post + posteriors->NumCols(), 0.0);
+  typename Engine::Real blank_sum = Engine::Zero();
+  for (int s = range.first + (range.first & 1); s < range.second; s += 2) {
+    blank_sum = Engine::Add(blank_sum, Engine::Mul(fvars[s], bvars[s]));
+  }
+  post[0] = Engine::Posterior(blank_sum, norm);
+  for (int s = range.first | 1; s < range.second; s += 2) {
+    post[(s + 1) / 2] = Engine::Posterior(Engine::Mul(fvars[s], bvars[s]),
+                                          norm);
+  }
+}
+
+/// Computes row t of the forward variables from row t-1 (unused for t = 0)
+/// and rescales it. The two cells on either side of the range, which the
+/// neighbouring rows read, are cleared so that rows may live in reused
+/// buffers.
+template<class Engine>
+bool ForwardFrame(int t, int total_time, int total_segments,
+                  const typename Engine::Real *label_row,
+                  CTCLattice<typename Engine::Real> *lattice,
+                  const typename Engine::Real *old_fvars,
+                  typename Engine::Real *fvars, double *row_log_scale) {
+  typedef typename Engine::Real Real;
+  Real *acts = lattice->segment_acts, *tmp = lattice->row_tmp;
+  const Real *skip = lattice->skip;
+  std::pair<int, int> this_range;
+  if (t == 0) {
+    // a path starts with the first blank or the first label
+    this_range = std::make_pair(0, std::min(total_segments, 2));
+    ExpandActivations(label_row, 0, this_range.second, acts);
+    for (int s = 0; s < this_range.second; s++) {
+      fvars[s] = acts[s];
+    }
+  } else {
+    this_range = CTCWorkspace::SegmentRange(t, total_time, total_segments);
+    ExpandActivations(label_row, this_range.first, this_range.second, acts);
+    // s < 2 has no s-2 (nor s-1) to read
+    int split = std::min(std::max(this_range.first, 2), this_range.second);
+    for (int s = this_range.first; s < split; s++) {
+      fvars[s] = ForwardCell<Engine>(old_fvars, acts, skip, s);
+    }
+    if (split < this_range.second) {
+      Engine::ForwardRow(old_fvars, acts, skip, tmp, fvars,
+                         split, this_range.second);
+    }
+  }
+  for (int s = std::max(this_range.first - 2, 0); s < this_range.first; s++) {
+    fvars[s] = Engine::Zero();
+  }
+  for (int s = this_range.second;
+       s < std::min(this_range.second + 2, total_segments); s++) {
+    fvars[s] = Engine::Zero();
+  }
+  return Engine::Rescale(fvars, this_range.first, this_range.second,
+                         row_log_scale);
+}
+
+/// Forward variables of frame t of the sequence prepared in work
+template<class Engine>
+bool ForwardStep(int t, const CTCWorkspace &work,
+                 CTCLattice<typename Engine::Real> *lattice,
+                 const typename Engine::Real *old_fvars,
+                 typename Engine::Real *fvars, double *row_log_scale) {
+  const int total_segments = work.total_segments;
+  return ForwardFrame<Engine>(t, work.total_time, total_segments,
+                              lattice->label_acts + static_cast<size_t>(t) *
+                              ((total_segments + 1) / 2),
+                              lattice, old_fvars, fvars, row_log_scale);
+}
+
+/// Forward-backward pass over one sequence in the semiring of Engine,
+/// reading the columns of log_acts listed in columns and writing the
+/// (T, L+1) label posteriors; work has been prepared for the sequence.
+/// With a checkpoint interval k > 1 only every k-th row of forward
+/// variables is kept; the backward pass walks the sequence block by block and
+/// recomputes the k-1 rows of each block from its checkpoint, which takes
+/// (T/k + k) rows instead of T at the price of a second forward pass.
+/// Returns false if the engine cannot represent the lattice.
+template<class Engine>
+bool ForwardBackward(const MatrixBase<BaseFloat> &log_acts,
+                     const int32 *columns, const int32 *target,
+                     int32 num_labels, CTCWorkspace *work,
+                     MatrixBase<BaseFloat> *posteriors,
+                     BaseFloat *log_prob_out) {
+  typedef typename Engine::Real Real;
+  const int total_time = work->total_time;
+  const int total_segments = work->total_segments;
+  CTCLattice<Real> &lattice = Engine::Lattice(work);
+  CTCBandedMatrix<Real> &forward_variables = lattice.forward_variables;
+  CTCBandedMatrix<Real> &forward_block = lattice.forward_block;
+  CTCBandedMatrix<Real> &backward_variables = lattice.backward_variables;
+  Timer timer;
+  GatherLabelActivations<Engine>(log_acts, columns, target, num_labels,
+                                 &lattice);
+  const Real *label_acts = lattice.label_acts;
+  Real *acts = lattice.segment_acts, *skip = lattice.skip,
+       *tmp = lattice.row_tmp;
+  const int interval = work->checkpoint_interval;
+  const bool fused = work->fused;
+  const int beta_rows = backward_variables.NumRows();
+  double log_scale = 0.0, row_log_scale;
+
+  // frame t of the forward variables is either a checkpoint or lives in
+  // the block buffer until the next block is recomputed. Every step writes
+  // its whole band, so the lattices need no initialization.
+#define FVARS_ROW(t) ((t) % interval == 0 ?                             \
+    forward_variables.RowData((t) / interval, (t)) :                  \
+    forward_block.RowData((t) % interval - 1, (t)))
+
+  // calculate the forward variables
+  for (int t = 0; t < total_time; t++) {
+    if (!ForwardStep<Engine>(t, *work, &lattice,
+                             t > 0 ? FVARS_ROW(t-1) : NULL, FVARS_ROW(t),
+                             &row_log_scale)) {
+      return false;
+    }
+    log_scale += row_log_scale;
   } // for (int t)
-  
-  SubVector<BaseFloat> last_fvars(forward_variables_, total_time_-1);
-  BaseFloat log_prob = last_fvars(last_fvars.Dim() - 1);
-  if (total_segments_ > 1) {
-    log_prob = Log<BaseFloat>::log_add(log_prob, 
-                                       last_fvars(last_fvars.Dim() - 2));
-  }
-  
+
+  const Real *last_fvars = FVARS_ROW(total_time-1);
+  Real prob = last_fvars[total_segments - 1];
+  if (total_segments > 1) {
+    prob = Engine::Add(prob, last_fvars[total_segments - 2]);
+  }
+  BaseFloat log_prob = Engine::LogProb(prob, log_scale);
+  work->forward_seconds += timer.Elapsed();
+  timer.Reset();
+
   // std::cout << "log prob " << log_prob << std::endl;
   KALDI_ASSERT(log_prob <= 0);
 
-  // calculate the backward variables
-  backward_variables_.Resize(total_time_, total_segments_, kUndefined);
-  backward_variables_.Set(Log<BaseFloat>::logZero);
-  SubVector<BaseFloat> last_bvars(backward_variables_, total_time_-1);
-  last_bvars(last_bvars.Dim() - 1) = Log<BaseFloat>::safe_log(1);
-  if (total_segments_ > 1) {
-    last_bvars(last_bvars.Dim() - 2) = Log<BaseFloat>::safe_log(1);
+  // calculate the backward variables; the fused pass keeps only rows t
+  // and t+1 and injects the errors of frame t as soon as its row is done
+  Real *last_bvars = backward_variables.RowData((total_time-1) % beta_rows,
+                                                total_time-1);
+  for (int s = backward_variables.BandStart(total_time-1);
+       s < total_segments; s++) {
+    last_bvars[s] = (s >= total_segments - 2) ? Engine::One() : Engine::Zero();
   }
   // loop over time, calculating back ward variables recursively
-  for (int t = total_time_ - 2; t >= 0; t--) {
-    SubVector<BaseFloat> old_log_acts(log_net_out, t+1);
-    SubVector<BaseFloat> old_bvars(backward_variables_, t+1);
-    SubVector<BaseFloat> bvars(backward_variables_, t);
-    std::pair<int, int> this_range = segment_range(t);
-    for (int s = this_range.first; s != this_range.second; s++) {
-      BaseFloat bv;
-      // s odd (label output)
-      if (s & 1) {
-        int label_index = s / 2;
-        int label_num = target[label_index];
-        bv = Log<BaseFloat>::log_add(
-            Log<BaseFloat>::log_multiply(old_bvars(s), old_log_acts(label_num)),
-            Log<BaseFloat>::log_multiply(old_bvars(s+1), old_log_acts(blank_)));
-        if (s < total_segments_ - 2) {
-          int next_label_num = target[label_index + 1];
-          if (label_num != next_label_num) {
-            bv = Log<BaseFloat>::log_add(bv,
-                Log<BaseFloat>::log_multiply(old_bvars(s+2),
-                                             old_log_acts(next_label_num)));
-          }
-        }
-      } else { // s even (blank output)
-        bv = Log<BaseFloat>::log_multiply(old_bvars(s), old_log_acts(blank_));
-        if (s < total_segments_ - 1) {
-          bv = Log<BaseFloat>::log_add(bv,
-              Log<BaseFloat>::log_multiply(old_bvars(s+1),
-                                           old_log_acts(target[s/2])));
-        }
+  for (int t = total_time - 1; t >= 0; t--) {
+    if (interval > 1 && (t == total_time - 1 || (t + 1) % interval == 0)) {
+      // entering a new block from its end: recompute its forward rows
+      for (int u = t - t % interval + 1; u <= t; u++) {
+        ForwardStep<Engine>(u, *work, &lattice, FVARS_ROW(u-1), FVARS_ROW(u),
+                            &row_log_scale);
+      }
+    }
+    Real *bvars = backward_variables.RowData(t % beta_rows, t);
+    std::pair<int, int> this_range = work->segment_range(t);
+    if (t < total_time - 1) {
+      // the band of frame t+1 covers the cells s..s+2 read below
+      ExpandActivations(label_acts + static_cast<size_t>(t+1) *
+                        (num_labels + 1), this_range.first,
+                        std::min(this_range.second + 2, total_segments),
+                        acts);
+      const Real *old_bvars = backward_variables.RowData((t+1) % beta_rows,
+                                                         t+1);
+      // the last two segments have no s+2 (nor s+1) to read
+      int split = std::max(std::min(this_range.second, total_segments - 2),
+                           this_range.first);
+      if (this_range.first < split) {
+        Engine::BackwardRow(old_bvars, acts, skip, tmp, bvars,
+                            this_range.first, split);
+      }
+      for (int s = split; s < this_range.second; s++) {
+        bvars[s] = BackwardCell<Engine>(old_bvars, acts, skip, s,
+                                        total_segments);
       }
-      bvars(s) = bv;
-    } // for (int s)
+      // frame t-1 reads up to two cells on either side of this range
+      for (int s = std::max(this_range.first - 2, 0); s < this_range.first;
+           s++) {
+        bvars[s] = Engine::Zero();
+      }
+      for (int s = this_range.second;
+           s < std::min(this_range.second + 2, total_segments); s++) {
+        bvars[s] = Engine::Zero();
+      }
+      if (!Engine::Rescale(bvars, this_range.first, this_range.second,
+                           &row_log_scale)) {
+        return false;
+      }
+    }
+    if (fused) {
+      InjectPosteriors<Engine>(t, FVARS_ROW(t), bvars, this_range, log_prob,
+                               posteriors);
+    }
   } // for (int t)
+  work->backward_seconds += timer.Elapsed();
+
+  if (!fused) {
+    timer.Reset();
+    for (int time = 0; time < total_time; time++) {
+      InjectPosteriors<Engine>(time, forward_variables.RowData(time, time),
+                               backward_variables.RowData(time, time),
+                               work->segment_range(time), log_prob,
+                               posteriors);
+    }
+    work->gradient_seconds += timer.Elapsed();
+  }
+#undef FVARS_ROW
+  *log_prob_out = log_prob;
+  return true;
+}
+
+/// Forward recursion alone in the semiring of Engine, alternating between
+/// the two rows of forward variables of a forward-only workspace.
+/// Returns false if the engine cannot represent the lattice.
+template<class Engine>
+bool ForwardScore(const MatrixBase<BaseFloat> &log_acts,
+                  const int32 *columns, const int32 *target,
+                  int32 num_labels, CTCWorkspace *work,
+                  BaseFloat *log_prob_out) {
+  typedef typename Engine::Real Real;
+  const int total_time = work->total_time;
+  const int total_segments = work->total_segments;
+  CTCLattice<Real> &lattice = Engine::Lattice(work);
+  CTCBandedMatrix<Real> &forward_variables = lattice.forward_variables;
+  KALDI_ASSERT(work->forward_only);
+  Timer timer;
+  GatherLabelActivations<Engine>(log_acts, columns, target, num_labels,
+                                 &lattice);
+  double log_scale = 0.0, row_log_scale;
+  for (int t = 0; t < total_time; t++) {
+    if (!ForwardStep<Engine>(t, *work, &lattice,
+                             t > 0 ? forward_variables.RowData((t-1) % 2, t-1)
+                             : NULL, forward_variables.RowData(t % 2, t),
+                             &row_log_scale)) {
+      return false;
+    }
+    log_scale += row_log_scale;
+  }
+  const Real *last_fvars = forward_variables.RowData((total_time-1) % 2,
+                                                     total_time-1);
+  Real prob = last_fvars[total_segments - 1];
+  if (total_segments > 1) {
+    prob = Engine::Add(prob, last_fvars[total_segments - 2]);
+  }
+  *log_prob_out = Engine::LogProb(prob, log_scale);
+  work->forward_seconds += timer.Elapsed();
+  return true;
+}
+
+} // namespace
+
+BaseFloat CTCLoss::compute_on_host(const MatrixBase<BaseFloat> &log_net_out,
+                                   const int32 *target, int32 num_labels,
+                                   CTCWorkspace *work,
+                                   MatrixBase<BaseFloat> *diff,
+                                   int32 *best_ids) const
+{
+  KALDI_ASSERT(blank_ >= 0);
+  KALDI_ASSERT(diff == NULL || (diff->NumRows() == log_net_out.NumRows() &&
+                                diff->NumCols() == log_net_out.NumCols()));
+  const int32 total_time = log_net_out.NumRows();
+  work->Prepare(total_time, num_labels, opts_);
+  work->columns[0] = blank_;
+  std::copy(target, target + num_labels, work->columns + 1);
+  SubMatrix<BaseFloat> posteriors(work->posteriors, total_time,
+                                  num_labels + 1, num_labels + 1);
+  BaseFloat log_prob = posteriors_on_host(log_net_out, work->columns, target,
+                                          num_labels, work, &posteriors);
+  if (diff == NULL && best_ids == NULL) return log_prob;
+  Timer timer;
+  const int32 dim = log_net_out.NumCols();
+  for (int32 t = 0; t < total_time; t++) {
+    const BaseFloat *row = log_net_out.RowData(t);
+    if (diff != NULL) Log<BaseFloat>::safe_exp(row, diff->RowData(t), dim);
+    if (best_ids != NULL) {
+      best_ids[t] = std::max_element(row, row + dim) - row;
+    }
+  }
+  if (diff != NULL) CombinePosteriors(posteriors, work->columns, diff);
+  work->gradient_seconds += timer.Elapsed();
+  return log_prob;
+}
+
+BaseFloat CTCLoss::posteriors_on_host(const MatrixBase<BaseFloat> &log_acts,
+                                      const int32 *columns,
+                                      const int32 *target, int32 num_labels,
+                                      CTCWorkspace *work,
+                                      MatrixBase<BaseFloat> *posteriors) const
+{
+  KALDI_ASSERT(work->total_time == log_acts.NumRows() &&
+               work->total_segments == 2 * num_labels + 1);
+  KALDI_ASSERT(posteriors->NumRows() == log_acts.NumRows() &&
+               posteriors->NumCols() == num_labels + 1);
+  BaseFloat log_prob = 0.0;
+  if (engine_ == kScaledEngine) {
+    if (ForwardBackward<ScaledEngine>(log_acts, columns, target, num_labels,
+                                      work, posteriors, &log_prob)) {
+      return log_prob;
+    }
+    // counted rather than logged: long, peaky utterances do this often
+    work->log_space_fallbacks++;
+  }
+  // the log-space engines represent any lattice
+  bool ok;
+  if (engine_ == kApproxLogSpaceEngine) {
+    ok = ForwardBackward<ApproxLogSpaceEngine>(log_acts, columns, target,
+                                               num_labels, work, posteriors,
+                                               &log_prob);
+  } else {
+    ok = ForwardBackward<LogSpaceEngine>(log_acts, columns, target,
+                                         num_labels, work, posteriors,
+                                         &log_prob);
+  }
+  if (!ok) {
+    KALDI_ERR << "Log-space CTC forward-backward failed";
+  }
+  return log_prob;
+}
+
+BaseFloat CTCLoss::score_on_host(const MatrixBase<BaseFloat> &log_acts,
+                                 const int32 *columns, const int32 *target,
+                                 int32 num_labels, CTCWorkspace *work) const
+{
+  KALDI_ASSERT(work->total_time == log_acts.NumRows() &&
+               work->total_segments == 2 * num_labels + 1);
+  BaseFloat log_prob = 0.0;
+  if (engine_ == kScaledEngine) {
+    if (ForwardScore<ScaledEngine>(log_acts, columns, target, num_labels,
+                                   work, &log_prob)) {
+      return log_prob;
+    }
+    work->log_space_fallbacks++;
+  }
+  bool ok;
+  if (engine_ == kApproxLogSpaceEngine) {
+    ok = ForwardScore<ApproxLogSpaceEngine>(log_acts, columns, target,
+                                            num_labels, work, &log_prob);
+  } else {
+    ok = ForwardScore<LogSpaceEngine>(log_acts, columns, target, num_labels,
+                                      work, &log_prob);
+  }
+  if (!ok) {
+    KALDI_ERR << "Log-space CTC forward pass failed";
+  }
+  return log_prob;
+}
+
+void CTCLoss::EvalPosteriors(const CuMatrixBase<BaseFloat> &net_out,
+                             const std::vector<int32> &target,
+                             CTCPosteriors *post, bool is_log)
+{
+  if (net_out.NumRows() < required_time(target)) {
+    KALDI_ERR << "required time > total time; this should not happen because"
+      " this should have been checked before calling this function";
+  }
+  const int32 total_time = net_out.NumRows(), num_cols = target.size() + 1;
+  post->labels.resize(num_cols);
+  post->labels[0] = blank_;
+  std::copy(target.begin(), target.end(), post->labels.begin() + 1);
+
+  // gather the blank and target columns on the GPU, download only those
+  Timer timer;
+  SubMatrix<BaseFloat> label_net_out_host(
+      download_columns(net_out, post->labels));
+  if (!is_log) label_net_out_host.ApplyLog();
+  double copy_seconds = timer.Elapsed();
+
+  size_t bytes = CTCWorkspace::RequiredBytes(total_time, num_cols - 1, opts_);
+  workspace_.Bind(arena_.Get(CTCArena::kWorkspace, bytes), bytes);
+  workspace_.Prepare(total_time, num_cols - 1, opts_);
+  for (int32 j = 0; j < num_cols; j++) workspace_.columns[j] = j;
+  post->posteriors.Resize(total_time, num_cols, kUndefined);
+  double forward = workspace_.forward_seconds,
+      backward = workspace_.backward_seconds,
+      gradient = workspace_.gradient_seconds;
+  BaseFloat log_prob = posteriors_on_host(
+      label_net_out_host, workspace_.columns, &post->labels[0] + 1,
+      num_cols - 1, &workspace_, &post->posteriors);
+  timing_.Begin(utterance_key_, total_time, 2 * num_cols - 1);
+  utterance_key_.clear();
+  timing_.Add(kCopyPhase, copy_seconds);
+  timing_.Add(kForwardPhase, workspace_.forward_seconds - forward);
+  timing_.Add(kBackwardPhase, workspace_.backward_seconds - backward);
+  timing_.Add(kGradientPhase, workspace_.gradient_seconds - gradient);
+  record_progress(log_prob, total_time);
+}
+
+BaseFloat CTCLoss::Score(const CuMatrixBase<BaseFloat> &log_net_out,
+                         const std::vector<int32> &target)
+{
+  if (log_net_out.NumRows() < required_time(target)) {
+    KALDI_ERR << "required time > total time; this should not happen because"
+      " this should have been checked before calling this function";
+  }
+  const int32 total_time = log_net_out.NumRows(), num_cols = target.size() + 1;
+  score_columns_.resize(num_cols);
+  score_columns_[0] = blank_;
+  std::copy(target.begin(), target.end(), score_columns_.begin() + 1);
+
+  Timer timer;
+  SubMatrix<BaseFloat> label_net_out_host(
+      download_columns(log_net_out, score_columns_));
+  double copy_seconds = timer.Elapsed();
+
+  size_t bytes = CTCWorkspace::RequiredBytes(total_time, num_cols - 1, opts_,
+                                             true);
+  workspace_.Bind(arena_.Get(CTCArena::kWorkspace, bytes), bytes);
+  workspace_.Prepare(total_time, num_cols - 1, opts_, true);
+  for (int32 j = 0; j < num_cols; j++) workspace_.columns[j] = j;
+  double forward = workspace_.forward_seconds;
+  BaseFloat log_prob = score_on_host(label_net_out_host, workspace_.columns,
+                                     &score_columns_[0] + 1, num_cols - 1,
+                                     &workspace_);
+  timing_.Begin(utterance_key_, total_time, 2 * num_cols - 1);
+  utterance_key_.clear();
+  timing_.Add(kCopyPhase, copy_seconds);
+  timing_.Add(kForwardPhase, workspace_.forward_seconds - forward);
+  record_progress(log_prob, total_time);
+  return log_prob;
+}
+
+BaseFloat CTCLoss::ScoreOnHost(const MatrixBase<BaseFloat> &log_net_out,
+                               const std::vector<int32> &target,
+                               CTCUtteranceResult *result)
+{
+  if (log_net_out.NumRows() < required_time(target)) {
+    KALDI_ERR << "required time > total time; this should not happen because"
+      " this should have been checked before calling this function";
+  }
+  const int32 total_time = log_net_out.NumRows(), num_cols = target.size() + 1;
+  score_columns_.resize(num_cols);
+  score_columns_[0] = blank_;
+  std::copy(target.begin(), target.end(), score_columns_.begin() + 1);
+
+  // the recursion reads the blank and target columns in place
+  size_t bytes = CTCWorkspace::RequiredBytes(total_time, num_cols - 1, opts_,
+                                             true);
+  workspace_.Bind(arena_.Get(CTCArena::kWorkspace, bytes), bytes);
+  workspace_.Prepare(total_time, num_cols - 1, opts_, true);
+  std::copy(score_columns_.begin(), score_columns_.end(), workspace_.columns);
+  double forward = workspace_.forward_seconds;
+  BaseFloat log_prob = score_on_host(log_net_out, workspace_.columns,
+                                     &score_columns_[0] + 1, num_cols - 1,
+                                     &workspace_);
+  timing_.Begin(utterance_key_, total_time, 2 * num_cols - 1);
+  utterance_key_.clear();
+  timing_.Add(kForwardPhase, workspace_.forward_seconds - forward);
+  record_progress(log_prob, total_time);
+  if (result == NULL) return log_prob;
+
+  Timer timer;
+  maxid_host_.resize(total_time);
+  for (int32 t = 0; t < total_time; t++) {
+    const BaseFloat *row = log_net_out.RowData(t);
+    maxid_host_[t] = std::max_element(row, row + log_net_out.NumCols()) - row;
+  }
+  timing_.Add(kDecodePhase, timer.Elapsed());
+  result->log_prob = log_prob;
+  record_errors(target, result);
+  return log_prob;
+}
+
+BaseFloat CTCLoss::ScoreLogits(const CuMatrixBase<BaseFloat> &logits,
+                               const std::vector<int32> &target,
+                               CTCUtteranceResult *result)
+{
+  const int32 num_rows = logits.NumRows(), num_cols = logits.NumCols();
+  // download from GPU; the host copy becomes the log-softmax
+  Timer timer;
+  SubMatrix<BaseFloat> logits_host(
+      arena_.MatrixView(CTCArena::kNetOut, num_rows, num_cols));
+  logits.CopyToMat(&logits_host);
+  double copy_seconds = timer.Elapsed();
+
+  timer.Reset();
+  SubMatrix<BaseFloat> probs(
+      arena_.MatrixView(CTCArena::kDiff, num_rows, num_cols));
+  log_softmax_on_host(&logits_host, &probs);
+  double softmax_seconds = timer.Elapsed();
+
+  BaseFloat log_prob = ScoreOnHost(logits_host, target, result);
+  timing_.Add(kCopyPhase, copy_seconds);
+  timing_.Add(kGradientPhase, softmax_seconds);
+  return log_prob;
+}
+
+void CTCLoss::AddResult(const CTCUtteranceResult &result, int32 num_frames,
+                        int32 num_labels)
+{
+  // in the order of a serial evaluation, so the sums come out the same
+  record_progress(result.log_prob, num_frames);
+  record_error_counts(result.num_errors, num_labels);
+}
+
+void CTCLoss::MergeTiming(CTCLoss *other)
+{
+  other->timing_.Close();
+  timing_.Close();
+  timing_.Merge(other->timing_);
+  merged_fallbacks_ += other->NumLogSpaceFallbacks();
+}
+
+void CTCLoss::ResetTiming()
+{
+  timing_.Reset();
+  batch_copy_seconds_ = 0.0;
+}
+
+int64 CTCLoss::NumLogSpaceFallbacks() const
+{
+  int64 fallbacks = merged_fallbacks_ + workspace_.log_space_fallbacks;
+  for (size_t i = 0; i < batch_workspaces_.size(); i++) {
+    fallbacks += batch_workspaces_[i].log_space_fallbacks;
+  }
+  return fallbacks;
+}
+
+SubMatrix<BaseFloat> CTCLoss::download_columns(
+    const CuMatrixBase<BaseFloat> &log_net_out,
+    const std::vector<int32> &columns)
+{
+  const int32 total_time = log_net_out.NumRows(), num_cols = columns.size();
+  if (label_net_out_.NumRows() < total_time ||
+      label_net_out_.NumCols() < num_cols) {
+    label_net_out_.Resize(std::max(label_net_out_.NumRows(), total_time),
+                          std::max(label_net_out_.NumCols(), num_cols),
+                          kUndefined);
+    num_device_allocations_++;
+  }
+  if (label_columns_.Dim() != num_cols) num_device_allocations_++;
+  label_columns_.CopyFromVec(columns);
+  CuSubMatrix<BaseFloat> label_net_out(
+      label_net_out_.Range(0, total_time, 0, num_cols));
+  label_net_out.CopyCols(log_net_out, label_columns_);
+  SubMatrix<BaseFloat> label_net_out_host(
+      arena_.MatrixView(CTCArena::kLabelNetOut, total_time, num_cols));
+  label_net_out.CopyToMat(&label_net_out_host);
+  return label_net_out_host;
+}
 
-  // inject the training errors
-  de_dy_terms_.resize(log_net_out.NumCols());
-  for (int time = 0; time < total_time_; time++) {
-    std::fill(de_dy_terms_.begin(), de_dy_terms_.end(),
-        Log<BaseFloat>::logZero);
-    SubVector<BaseFloat> fvars(forward_variables_, time);
-    SubVector<BaseFloat> bvars(backward_variables_, time);
-    for (int s = 0; s < total_segments_; s++) {
-      // k = blank_ for even s, target label for odd s
-      int k = (s&1) ? target[s/2] : blank_;
-      de_dy_terms_[k] = Log<BaseFloat>::log_add(de_dy_terms_[k],
-          Log<BaseFloat>::log_multiply(fvars(s), bvars(s)));
-      //std::cout << "dedy" << k << " " << Log<BaseFloat>::safe_exp(de_dy_terms_[k]) << std::endl;
-    }
-    for (size_t i = 0; i < de_dy_terms_.size(); i++) {
-      (*diff)(time, i) = 
-          Log<BaseFloat>::safe_exp(log_net_out(time, i)) -
-          Log<BaseFloat>::safe_exp(
-              Log<BaseFloat>::log_divide(de_dy_terms_[i], log_prob));
-      //std::cout << "net_out " << Log<BaseFloat>::safe_exp(log_net_out(time, i)) << " ";
-      //std::cout << "dedy/logprob " << Log<BaseFloat>::safe_exp(Log<BaseFloat>::log_divide(de_dy_terms_[i], log_prob)) << " ";
-      //std::cout << "diff" << time << i << " " << (*diff)(time, i) << std::endl;
-    }
-  }
-
-  // record progress
+void CTCLoss::CombinePosteriors(const MatrixBase<BaseFloat> &posteriors,
+                                const int32 *labels,
+                                MatrixBase<BaseFloat> *diff)
+{
+  KALDI_ASSERT(posteriors.NumRows() == diff->NumRows());
+  for (int32 t = 0; t < posteriors.NumRows(); t++) {
+    const BaseFloat *post = posteriors.RowData(t);
+    BaseFloat *diff_row = diff->RowData(t);
+    for (int32 j = 0; j < posteriors.NumCols(); j++) {
+      diff_row[labels[j]] -= post[j];
+    }
+  }
+}
+
+void CTCLoss::CombinePosteriors(const CTCPosteriors &post,
+                                CuMatrixBase<BaseFloat> *diff)
+{
+  const Matrix<BaseFloat> &posteriors = post.posteriors;
+  const int32 total_time = posteriors.NumRows(),
+      num_labels = post.labels.size();
+  KALDI_ASSERT(total_time == diff->NumRows() &&
+               posteriors.NumCols() == num_labels);
+  // AddCols adds one source column per output, so the columns of repeated
+  // labels are summed (and negated) on the host first
+  merged_columns_.assign(diff->NumCols(), -1);
+  merged_index_.resize(num_labels);
+  int32 num_merged = 0;
+  for (int32 j = 0; j < num_labels; j++) {
+    int32 k = post.labels[j];
+    KALDI_ASSERT(k >= 0 && k < diff->NumCols());
+    if (merged_columns_[k] < 0) merged_columns_[k] = num_merged++;
+    merged_index_[j] = merged_columns_[k];
+  }
+  SubMatrix<BaseFloat> merged_host(
+      arena_.MatrixView(CTCArena::kMergedPosteriors, total_time, num_merged));
+  merged_host.SetZero();
+  for (int32 t = 0; t < total_time; t++) {
+    const BaseFloat *post_row = posteriors.RowData(t);
+    BaseFloat *merged_row = merged_host.RowData(t);
+    for (int32 j = 0; j < num_labels; j++) {
+      merged_row[merged_index_[j]] -= post_row[j];
+    }
+  }
+
+  // the device copies are views of grow-only buffers; AddCols reads the
+  // columns of merged_ that merged_columns_ names, all of them in range
+  if (merged_.NumRows() < total_time || merged_.NumCols() < num_merged) {
+    merged_.Resize(std::max(merged_.NumRows(), total_time),
+                   std::max(merged_.NumCols(), num_merged), kUndefined);
+    num_device_allocations_++;
+  }
+  CuSubMatrix<BaseFloat> merged(merged_.Range(0, total_time, 0,
+                                              num_merged));
+  merged.CopyFromMat(merged_host);
+  if (merged_columns_dev_.Dim() != diff->NumCols()) {
+    num_device_allocations_++;
+  }
+  merged_columns_dev_.CopyFromVec(merged_columns_);
+  diff->AddCols(merged, merged_columns_dev_);
+}
+
+void CTCLoss::Reserve(int32 max_time, int32 max_labels, int32 num_outputs)
+{
+  size_t matrix_bytes = static_cast<size_t>(max_time) * num_outputs *
+      sizeof(BaseFloat);
+  arena_.Get(CTCArena::kNetOut, matrix_bytes);
+  arena_.Get(CTCArena::kDiff, matrix_bytes);
+  arena_.Get(CTCArena::kLabelNetOut, static_cast<size_t>(max_time) *
+             (max_labels + 1) * sizeof(BaseFloat));
+  arena_.Get(CTCArena::kWorkspace,
+             GetWorkspaceSize(max_time, max_labels, num_outputs,
+                              opts_.num_threads));
+  arena_.Get(CTCArena::kMergedPosteriors, static_cast<size_t>(max_time) *
+             (max_labels + 1) * sizeof(BaseFloat));
+  maxid_host_.reserve(max_time);
+  merged_columns_.reserve(num_outputs);
+  merged_index_.reserve(max_labels + 1);
+  if (label_net_out_.NumRows() < max_time ||
+      label_net_out_.NumCols() < max_labels + 1) {
+    label_net_out_.Resize(std::max(label_net_out_.NumRows(), max_time),
+                          std::max(label_net_out_.NumCols(), max_labels + 1),
+                          kUndefined);
+    num_device_allocations_++;
+  }
+  if (merged_.NumRows() < max_time || merged_.NumCols() < max_labels + 1) {
+    merged_.Resize(std::max(merged_.NumRows(), max_time),
+                   std::max(merged_.NumCols(), max_labels + 1), kUndefined);
+    num_device_allocations_++;
+  }
+  if (merged_columns_dev_.Dim() != num_outputs) {
+    merged_columns_dev_.Resize(num_outputs);
+    num_device_allocations_++;
+  }
+}
+
+void CTCLoss::record_progress(BaseFloat log_prob, int32 num_frames)
+{
   obj_progress_ += log_prob;
   sequences_progress_ += 1;
   sequences_num_ += 1;
-  frames_progress_ += total_time_;
-  frames_ += total_time_;
+  frames_progress_ += num_frames;
+  frames_ += num_frames;
 
   // progress reporting
   {
@@ -183,6 +1456,7 @@ void CTCLoss::eval_on_host(const MatrixBase<BaseFloat> &log_net_out,
                     << "   TokenAcc = "
                     << 100.0*(1.0-error_num_progress_/ref_num_progress_)
                     << "%";
+      KALDI_VLOG(1) << timing_.Report();
       sequences_progress_ = 0;
       frames_progress_ = 0;
       obj_progress_ = 0;
@@ -192,56 +1466,478 @@ void CTCLoss::eval_on_host(const MatrixBase<BaseFloat> &log_net_out,
   }
 }
 
-std::pair<int, int> CTCLoss::segment_range(int time) const
+int32 CTCLoss::required_time(const std::vector<int32> &target)
+{
+  return required_time(target.empty() ? NULL : &target[0], target.size());
+}
+
+int32 CTCLoss::required_time(const int32 *target, int32 num_labels)
 {
-  int start = std::max(0, total_segments_ - (2 * (total_time_ - time)));
-  int end = std::min(total_segments_, 2 * (time + 1));
+  int32 required_time = num_labels;
+  int32 old_label = -1;
+  for (int32 i = 0; i != num_labels; i++) {
+    if (old_label == target[i]) {
+      required_time++;
+    }
+    old_label = target[i];
+  }
+  return required_time;
+}
+
+std::pair<int, int> CTCWorkspace::segment_range(int time) const
+{
+  return SegmentRange(time, total_time, total_segments);
+}
+
+std::pair<int, int> CTCWorkspace::SegmentRange(int time, int total_time,
+                                               int total_segments)
+{
+  // with the length unknown every segment may still reach the end
+  int start = (total_time < 0 ? 0 :
+               std::max(0, total_segments - (2 * (total_time - time))));
+  int end = std::min(total_segments, 2 * (time + 1));
   end = (start > end ? start : end);
   KALDI_ASSERT(start <= end);
   return std::make_pair(start, end);
   //return std::make_pair(0, total_segments_);
 }
 
+CTCStreamingScorer::CTCStreamingScorer(int32 blank,
+                                       const CTCLossOptions &opts)
+  : blank_(blank), approx_(opts.engine == "log-approx"), num_frames_(0)
+{
+  KALDI_ASSERT(blank >= 0);
+  if (opts.engine != "log" && !approx_) {
+    KALDI_VLOG(1) << "Streaming CTC scoring runs in log space, not "
+                  << opts.engine;
+  }
+}
+
+void CTCStreamingScorer::Reset(const std::vector<int32> &target)
+{
+  const int32 num_labels = target.size(), total_segments = 2 * num_labels + 1;
+  target_ = target;
+  columns_.resize(num_labels + 1);
+  columns_[0] = blank_;
+  std::copy(target.begin(), target.end(), columns_.begin() + 1);
+  identity_.resize(num_labels + 1);
+  for (int32 j = 0; j <= num_labels; j++) identity_[j] = j;
+  num_frames_ = 0;
+  rows_.resize(2 * total_segments);
+  scratch_.resize(3 * total_segments);
+}
+
+void CTCStreamingScorer::AcceptChunk(const MatrixBase<BaseFloat> &log_net_out)
+{
+  accept_columns(log_net_out, &columns_[0]);
+}
+
+void CTCStreamingScorer::AcceptChunk(
+    const CuMatrixBase<BaseFloat> &log_net_out)
+{
+  const int32 num_rows = log_net_out.NumRows(), num_cols = columns_.size();
+  if (num_rows == 0) return;
+  if (label_chunk_.NumRows() < num_rows || label_chunk_.NumCols() != num_cols) {
+    label_chunk_.Resize(std::max(label_chunk_.NumRows(), num_rows), num_cols,
+                        kUndefined);
+    label_chunk_host_.Resize(label_chunk_.NumRows(), num_cols, kUndefined);
+  }
+  label_columns_.CopyFromVec(columns_);
+  CuSubMatrix<BaseFloat> label_chunk(label_chunk_.RowRange(0, num_rows));
+  label_chunk.CopyCols(log_net_out, label_columns_);
+  SubMatrix<BaseFloat> label_chunk_host(label_chunk_host_.RowRange(0,
+                                                                   num_rows));
+  label_chunk.CopyToMat(&label_chunk_host);
+  accept_columns(label_chunk_host, &identity_[0]);
+}
+
+void CTCStreamingScorer::accept_columns(const MatrixBase<BaseFloat> &chunk,
+                                        const int32 *columns)
+{
+  KALDI_ASSERT(!columns_.empty() && "Reset() the scorer first");
+  const int32 num_labels = target_.size(), total_segments = 2 * num_labels + 1;
+  const int32 num_rows = chunk.NumRows();
+  if (num_rows == 0) return;
+  // grows to the largest chunk
+  label_acts_.resize(std::max(label_acts_.size(),
+      static_cast<size_t>(num_rows) * (num_labels + 1)));
+  CTCLattice<BaseFloat> lattice;
+  lattice.label_acts = &label_acts_[0];
+  lattice.segment_acts = &scratch_[0];
+  lattice.skip = &scratch_[total_segments];
+  lattice.row_tmp = &scratch_[2 * total_segments];
+  const int32 *target = target_.empty() ? NULL : &target_[0];
+  if (approx_) {
+    GatherLabelActivations<ApproxLogSpaceEngine>(chunk, columns, target,
+                                                 num_labels, &lattice);
+  } else {
+    GatherLabelActivations<LogSpaceEngine>(chunk, columns, target,
+                                           num_labels, &lattice);
+  }
+  double row_log_scale;
+  for (int32 r = 0; r < num_rows; r++) {
+    // the rows alternate, frame t-1 is in the other one
+    const int32 t = num_frames_ + r;
+    BaseFloat *fvars = &rows_[(t % 2) * total_segments],
+        *old_fvars = &rows_[((t + 1) % 2) * total_segments];
+    const BaseFloat *label_row = lattice.label_acts +
+        static_cast<size_t>(r) * (num_labels + 1);
+    if (approx_) {
+      ForwardFrame<ApproxLogSpaceEngine>(t, -1, total_segments, label_row,
+                                         &lattice, old_fvars, fvars,
+                                         &row_log_scale);
+    } else {
+      ForwardFrame<LogSpaceEngine>(t, -1, total_segments, label_row, &lattice,
+                                   old_fvars, fvars, &row_log_scale);
+    }
+  }
+  num_frames_ += num_rows;
+}
+
+BaseFloat CTCStreamingScorer::Finish() const
+{
+  if (num_frames_ < CTCLoss::required_time(target_)) {
+    KALDI_ERR << "Streaming CTC scorer got " << num_frames_ << " frames, "
+              << "the target needs " << CTCLoss::required_time(target_);
+  }
+  // no frames emit the empty target for sure; there is no row to read
+  if (num_frames_ == 0) return 0.0;
+  const int32 total_segments = 2 * target_.size() + 1;
+  const BaseFloat *last_fvars = &rows_[((num_frames_ - 1) % 2) *
+                                       total_segments];
+  BaseFloat log_prob = last_fvars[total_segments - 1];
+  if (total_segments > 1) {
+    log_prob = approx_ ?
+        Log<BaseFloat>::log_add_approx(log_prob,
+                                       last_fvars[total_segments - 2]) :
+        Log<BaseFloat>::log_add(log_prob, last_fvars[total_segments - 2]);
+  }
+  return log_prob;
+}
+
+namespace {
+
+/// Takes count objects of type T, 64-byte aligned, from the block at base
+/// after *offset bytes; with base NULL the block is only measured.
+template<typename T>
+T *Carve(char *base, size_t *offset, size_t count) {
+  *offset = (*offset + 63) & ~static_cast<size_t>(63);
+  T *ptr = (base != NULL ? reinterpret_cast<T*>(base + *offset) : NULL);
+  *offset += count * sizeof(T);
+  return ptr;
+}
+
+template<typename Real>
+void LayOutLattice(const CTCWorkspace &work, char *base, size_t *offset,
+                   CTCLattice<Real> *lattice) {
+  const int32 total_time = work.total_time, total_segments = work.total_segments;
+  const int32 interval = work.checkpoint_interval;
+  const int32 beta_rows = work.fused ? std::min(total_time, 2) : total_time;
+  const int32 two_rows = std::min(total_time, 2);
+  lattice->label_acts = Carve<Real>(base, offset,
+      static_cast<size_t>(total_time) * ((total_segments + 1) / 2));
+  lattice->segment_acts = Carve<Real>(base, offset, total_segments);
+  lattice->skip = Carve<Real>(base, offset, total_segments);
+  lattice->row_tmp = Carve<Real>(base, offset, total_segments);
+  int32 rows[] = { (total_time + interval - 1) / interval, interval - 1,
+                   beta_rows };
+  if (work.forward_only) {
+    rows[0] = two_rows;
+    rows[1] = rows[2] = 0;
+  }
+  CTCBandedMatrix<Real> *bands[] = { &lattice->forward_variables,
+                                     &lattice->forward_block,
+                                     &lattice->backward_variables };
+  for (int32 i = 0; i < 3; i++) {
+    Real *data = Carve<Real>(base, offset,
+        CTCBandedMatrix<Real>::NumElements(rows[i], total_time,
+                                           total_segments));
+    bands[i]->Init(rows[i], total_time, total_segments, data);
+  }
+}
+
+/// Lays the scratch of a sequence out from base (or measures it when base
+/// is NULL) and returns its size in bytes. Both lattices start at the same
+/// place: the log-space one is only used when the scaled one has failed.
+size_t LayOutWorkspace(int32 total_time, int32 num_labels,
+                       const CTCLossOptions &opts, bool forward_only,
+                       char *base, CTCWorkspace *work) {
+  work->total_time = total_time;
+  work->total_segments = 2 * num_labels + 1;
+  work->forward_only = forward_only;
+  int32 interval = opts.checkpoint_interval;
+  if (interval < 0) {
+    interval = static_cast<int32>(sqrt(static_cast<double>(total_time)) + 0.5);
+  }
+  work->checkpoint_interval = std::min(std::max(interval, 1), total_time);
+  work->fused = opts.fused_backward || work->checkpoint_interval > 1;
+
+  size_t offset = 0;
+  work->columns = Carve<int32>(base, &offset, num_labels + 1);
+  work->posteriors = Carve<BaseFloat>(base, &offset, forward_only ? 0 :
+      static_cast<size_t>(total_time) * (num_labels + 1));
+  size_t lattice_offset = offset;
+  LayOutLattice(*work, base, &offset, &work->log_lattice);
+  if (opts.engine == "scaled") {
+    size_t log_end = offset;
+    offset = lattice_offset;
+    LayOutLattice(*work, base, &offset, &work->scaled_lattice);
+    offset = std::max(offset, log_end);
+  }
+  return offset;
+}
+
+} // namespace
+
+size_t CTCWorkspace::RequiredBytes(int32 total_time, int32 num_labels,
+                                   const CTCLossOptions &opts,
+                                   bool forward_only)
+{
+  CTCWorkspace work;
+  // room to align the start of the memory
+  return LayOutWorkspace(total_time, num_labels, opts, forward_only, NULL,
+                         &work) + 64;
+}
+
+void CTCWorkspace::Prepare(int32 total_time, int32 num_labels,
+                           const CTCLossOptions &opts, bool forward_only)
+{
+  char *base = reinterpret_cast<char*>(
+      (reinterpret_cast<size_t>(data_) + 63) & ~static_cast<size_t>(63));
+  size_t bytes = LayOutWorkspace(total_time, num_labels, opts, forward_only,
+                                 base, this);
+  if (data_ == NULL || base + bytes > data_ + data_bytes_) {
+    KALDI_ERR << "CTC workspace of " << data_bytes_ << " bytes is too small "
+              << "for " << total_time << " frames and " << num_labels
+              << " labels";
+  }
+  peak_bytes = std::max(peak_bytes, bytes);
+}
+
 void CTCLoss::ErrorRate(const CuMatrixBase<BaseFloat> &net_out,
                const std::vector<int32> &label,
                double *error_rate,
                std::vector<int32> *hyp)
 {
-  CuArray<int32> maxid(net_out.NumRows());
-  net_out.FindRowMaxId(&maxid);
+  // FindRowMaxId sizes maxid_ to the utterance
+  Timer timer;
+  if (maxid_.Dim() != net_out.NumRows()) num_device_allocations_++;
+  net_out.FindRowMaxId(&maxid_);
 
-  std::vector<int32> maxid_host(net_out.NumRows());
-  maxid.CopyToVec(&maxid_host);
+  maxid_.CopyToVec(&maxid_host_);
+  timing_.Add(kDecodePhase, timer.Elapsed());
 
+  CTCUtteranceResult result;
+  record_errors(label, &result);
+  *error_rate = result.error_rate;
+  hyp->swap(result.hyp);
+}
+
+void CTCLoss::collapse_best_path(const std::vector<int32> &best_ids,
+                                 std::vector<int32> *hyp) const
+{
   // remove repetitions and blanks
-  int32 i = 1, j = 1;
-  int32 dim = maxid_host.size();
-  for (; j < dim; j++) {
-    if (maxid_host[j] != maxid_host[j-1]) {
-      maxid_host[i++] = maxid_host[j];
-    }
-  }
   hyp->resize(0);
-  for (int32 n = 0; n < i; n++) {
-    if (maxid_host[n] != blank_) {
-      hyp->push_back(maxid_host[n]);
+  for (size_t t = 0; t < best_ids.size(); t++) {
+    if (best_ids[t] != blank_ && (t == 0 || best_ids[t] != best_ids[t-1])) {
+      hyp->push_back(best_ids[t]);
     }
   }
-  
-  int32 err, ins, del, sub;
-  err = LevenshteinEditDistance(label, *hyp, &ins, &del, &sub);
-  *error_rate = (100.0 * err) / label.size();
-  error_num_ += err;
-  ref_num_ += label.size();
-  error_num_progress_ += err;
-  ref_num_progress_ += label.size();
 }
 
-std::string CTCLoss::Report()
+void CTCLoss::record_errors(const std::vector<int32> &label,
+                            CTCUtteranceResult *result)
+{
+  Timer timer;
+  collapse_best_path(maxid_host_, &result->hyp);
+  timing_.Add(kDecodePhase, timer.Elapsed());
+
+  timer.Reset();
+  int32 err = LevenshteinEditDistance(label, result->hyp,
+                                      &result->num_insertions,
+                                      &result->num_deletions,
+                                      &result->num_substitutions);
+  timing_.Add(kEditDistancePhase, timer.Elapsed());
+  result->num_errors = err;
+  result->error_rate = (100.0 * err) / label.size();
+  record_error_counts(err, label.size());
+}
+
+void CTCLoss::record_error_counts(int32 num_errors, int32 num_labels)
+{
+  error_num_ += num_errors;
+  ref_num_ += num_labels;
+  error_num_progress_ += num_errors;
+  ref_num_progress_ += num_labels;
+}
+
+std::string CTCLoss::Report() const
 {
   std::ostringstream oss;
   oss << "\nTOKEN_ACCURACY >> " << 100.0 * (1.0 - error_num_ / ref_num_)
       << "% <<";
+  size_t peak_bytes = workspace_.peak_bytes;
+  for (size_t i = 0; i < batch_workspaces_.size(); i++) {
+    peak_bytes = std::max(peak_bytes, batch_workspaces_[i].peak_bytes);
+  }
+  oss << "\nCTC workspace peak per sequence: "
+      << peak_bytes / (1024.0 * 1024.0) << " MB, host buffers "
+      << arena_.SizeInBytes() / (1024.0 * 1024.0) << " MB in "
+      << arena_.NumAllocations() << " allocations, "
+      << num_device_allocations_ << " device buffer resizes";
+  int64 fallbacks = NumLogSpaceFallbacks();
+  if (fallbacks > 0) {
+    oss << "\nScaled CTC lattice underflowed in " << fallbacks
+        << " sequences, recomputed in log space";
+  }
+  oss << "\n" << timing_.Report();
+  if (batch_copy_seconds_ > 0.0) {
+    oss << "\nEvalBatch device transfers: " << batch_copy_seconds_ << " s";
+  }
+  return oss.str();
+}
+
+void CTCTimingStats::Begin(const std::string &key, int32 total_time,
+                           int32 total_segments)
+{
+  Close();
+  open_ = true;
+  if (key.empty()) {
+    std::ostringstream oss;
+    oss << "#" << num_utterances_;
+    open_key_ = oss.str();
+  } else {
+    open_key_ = key;
+  }
+  open_cells_ = static_cast<int64>(total_time) * total_segments;
+  std::fill(open_seconds_, open_seconds_ + kNumPhases, 0.0);
+}
+
+void CTCTimingStats::Add(CTCPhase phase, double seconds)
+{
+  if (open_) open_seconds_[phase] += seconds;
+}
+
+void CTCTimingStats::Close()
+{
+  if (!open_) return;
+  open_ = false;
+  num_utterances_++;
+  int32 b = 0;
+  for (int64 cells = open_cells_; cells >= 4; cells /= 4) b++;
+  if (buckets_.size() <= static_cast<size_t>(b)) {
+    Bucket empty;
+    empty.num_utterances = 0;
+    std::fill(empty.seconds, empty.seconds + kNumPhases, 0.0);
+    std::fill(empty.max_seconds, empty.max_seconds + kNumPhases, 0.0);
+    buckets_.resize(b + 1, empty);
+  }
+  Bucket &bucket = buckets_[b];
+  bucket.num_utterances++;
+  double total = 0.0;
+  for (int32 p = 0; p < kNumPhases; p++) {
+    bucket.seconds[p] += open_seconds_[p];
+    bucket.max_seconds[p] = std::max(bucket.max_seconds[p], open_seconds_[p]);
+    total += open_seconds_[p];
+  }
+
+  // keep the slowest utterances sorted, slowest first
+  if (num_slowest_ <= 0) return;
+  if (slowest_.size() == static_cast<size_t>(num_slowest_)) {
+    if (slowest_.back().seconds >= total) return;
+    slowest_.pop_back();
+  }
+  Utterance utt;
+  utt.seconds = total;
+  utt.cells = open_cells_;
+  utt.key = open_key_;
+  std::vector<Utterance>::iterator it = slowest_.begin();
+  while (it != slowest_.end() && it->seconds >= total) ++it;
+  slowest_.insert(it, utt);
+}
+
+void CTCTimingStats::Merge(const CTCTimingStats &other)
+{
+  KALDI_ASSERT(!other.open_);
+  num_utterances_ += other.num_utterances_;
+  if (buckets_.size() < other.buckets_.size()) {
+    Bucket empty;
+    empty.num_utterances = 0;
+    std::fill(empty.seconds, empty.seconds + kNumPhases, 0.0);
+    std::fill(empty.max_seconds, empty.max_seconds + kNumPhases, 0.0);
+    buckets_.resize(other.buckets_.size(), empty);
+  }
+  for (size_t b = 0; b < other.buckets_.size(); b++) {
+    Bucket &bucket = buckets_[b];
+    const Bucket &add = other.buckets_[b];
+    bucket.num_utterances += add.num_utterances;
+    for (int32 p = 0; p < kNumPhases; p++) {
+      bucket.seconds[p] += add.seconds[p];
+      bucket.max_seconds[p] = std::max(bucket.max_seconds[p],
+                                       add.max_seconds[p]);
+    }
+  }
+
+  // both lists are sorted slowest first
+  std::vector<Utterance> slowest;
+  size_t i = 0, j = 0;
+  while (slowest.size() < static_cast<size_t>(std::max(num_slowest_, 0)) &&
+         (i < slowest_.size() || j < other.slowest_.size())) {
+    if (j == other.slowest_.size() ||
+        (i < slowest_.size() &&
+         slowest_[i].seconds >= other.slowest_[j].seconds)) {
+      slowest.push_back(slowest_[i++]);
+    } else {
+      slowest.push_back(other.slowest_[j++]);
+    }
+  }
+  slowest_.swap(slowest);
+}
+
+void CTCTimingStats::Reset()
+{
+  num_utterances_ = 0;
+  buckets_.clear();
+  slowest_.clear();
+  open_ = false;
+}
+
+std::string CTCTimingStats::Report() const
+{
+  if (open_) {
+    // the open utterance is reported as if closed now, on a copy
+    CTCTimingStats closed(*this);
+    closed.Close();
+    return closed.Report();
+  }
+  static const char *names[kNumPhases] = { "copy", "forward", "backward",
+                                           "gradient", "decode", "edit-dist" };
+  std::ostringstream oss;
+  oss << "CTC phase latency per utterance in ms (mean/max), by lattice size "
+      << "T*S:\n" << std::setw(12) << "T*S <" << std::setw(8) << "utts";
+  for (int32 p = 0; p < kNumPhases; p++) oss << std::setw(20) << names[p];
+  oss << std::fixed << std::setprecision(3);
+  int64 limit = 4;
+  for (size_t b = 0; b < buckets_.size(); b++, limit *= 4) {
+    const Bucket &bucket = buckets_[b];
+    if (bucket.num_utterances == 0) continue;
+    oss << "\n" << std::setw(12) << limit << std::setw(8)
+        << bucket.num_utterances;
+    for (int32 p = 0; p < kNumPhases; p++) {
+      std::ostringstream cell;
+      cell << std::fixed << std::setprecision(3)
+           << 1000.0 * bucket.seconds[p] / bucket.num_utterances << "/"
+           << 1000.0 * bucket.max_seconds[p];
+      oss << std::setw(20) << cell.str();
+    }
+  }
+  if (!slowest_.empty()) {
+    oss << "\nSlowest utterances:";
+    for (size_t i = 0; i < slowest_.size(); i++) {
+      oss << " " << slowest_[i].key << " (" << 1000.0 * slowest_[i].seconds
+          << " ms, T*S " << slowest_[i].cells << ")";
+    }
+  }
   return oss.str();
 }
 
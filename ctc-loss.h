@@ -10,52 +10,629 @@
 #include "cudamatrix/cu-matrix.h"
 #include "cudamatrix/cu-vector.h"
 #include "cudamatrix/cu-array.h"
+#include "itf/options-itf.h"
+#include <algorithm>
 #include <utility>
 
 namespace kaldi {
 namespace nnet1 {
 
+enum CTCEngineType {
+  kLogSpaceEngine,            // log probabilities, log_add in every cell
+  kScaledEngine,              // probabilities rescaled at every frame
+  kApproxLogSpaceEngine       // log probabilities, table-based log_add
+};
+
+struct CTCLossOptions {
+  int32 num_threads;          // worker threads used by EvalBatch
+  std::string engine;         // "log", "scaled" or "log-approx"
+  bool fused_backward;        // inject errors during the backward pass
+  int32 checkpoint_interval;  // keep every k-th forward row, 0 keeps all
+  int32 report_slowest;       // slowest utterances listed by Report()
+
+  CTCLossOptions(): num_threads(1), engine("log"), fused_backward(false),
+                    checkpoint_interval(0), report_slowest(5) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("ctc-num-threads", &num_threads,
+                   "Number of threads evaluating the CTC loss of a batch");
+    opts->Register("ctc-engine", &engine,
+                   "Forward-backward engine of the CTC loss: log (log-space "
+                   "recursion), scaled (probabilities rescaled per frame, "
+                   "falls back to log on underflow) or log-approx (log-space "
+                   "with an interpolated log_add, ~1e-5 error per cell)");
+    opts->Register("ctc-fused-backward", &fused_backward,
+                   "Compute the errors of each frame during the backward "
+                   "pass, keeping two rows of backward variables instead "
+                   "of all of them");
+    opts->Register("ctc-checkpoint-interval", &checkpoint_interval,
+                   "Keep only every k-th row of forward variables and "
+                   "recompute the rows in between during the backward pass "
+                   "(implies --ctc-fused-backward). 0 keeps all rows, a "
+                   "negative value picks k = sqrt(T) per sequence");
+    opts->Register("ctc-report-slowest", &report_slowest,
+                   "Number of slowest utterances whose keys the CTC report "
+                   "lists");
+  }
+};
+
+/// Lattice rows that keep only the band of segments a frame can reach:
+/// segment_range(t) widened by the two cells on either side that the
+/// neighbouring frames read. A row may hold any frame; RowData(r, t)
+/// returns a pointer indexed by segment that is valid inside the band of t.
+/// The matrix is a view, the memory belongs to the CTCWorkspace.
+template<typename Real>
+class CTCBandedMatrix {
+ public:
+  CTCBandedMatrix(): data_(NULL), num_rows_(0), stride_(0), total_time_(0),
+                     total_segments_(0) { }
+
+  /// Width of a row: no band of a sequence that fits into total_time
+  /// frames is wider
+  static int32 BandStride(int32 total_time, int32 total_segments) {
+    return std::min(total_segments,
+                    std::max(2 * total_time + 6 - total_segments, 4));
+  }
+  /// Elements taken by num_rows rows; the leading total_segments keep
+  /// every row pointer inside the memory
+  static size_t NumElements(int32 num_rows, int32 total_time,
+                            int32 total_segments) {
+    return total_segments + static_cast<size_t>(num_rows) *
+        BandStride(total_time, total_segments);
+  }
+
+  /// Lays num_rows rows for a lattice of total_time frames and
+  /// total_segments segments out in data, which holds NumElements()
+  /// elements. The contents are undefined.
+  void Init(int32 num_rows, int32 total_time, int32 total_segments,
+            Real *data) {
+    data_ = data;
+    num_rows_ = num_rows;
+    total_time_ = total_time;
+    total_segments_ = total_segments;
+    stride_ = BandStride(total_time, total_segments);
+  }
+
+  /// First segment stored for frame t
+  int32 BandStart(int32 t) const {
+    return std::max(0, total_segments_ - 2 * (total_time_ - t) - 2);
+  }
+  /// One past the last segment stored for frame t
+  int32 BandEnd(int32 t) const {
+    return std::min(total_segments_,
+                    std::max(2 * (t + 1), BandStart(t) + 2) + 2);
+  }
+
+  Real *RowData(int32 r, int32 t) {
+    KALDI_PARANOID_ASSERT(r >= 0 && r < num_rows_);
+    return data_ + total_segments_ + static_cast<size_t>(r) * stride_
+        - BandStart(t);
+  }
+  const Real *RowData(int32 r, int32 t) const {
+    return const_cast<CTCBandedMatrix<Real>*>(this)->RowData(r, t);
+  }
+
+  int32 NumRows() const { return num_rows_; }
+  int32 Stride() const { return stride_; }
+
+  /// Writes the band of frame t of row r into a dense row of
+  /// total_segments cells, zero elsewhere
+  void CopyRowToVec(int32 r, int32 t, Real zero, VectorBase<Real> *v) const {
+    KALDI_ASSERT(v->Dim() == total_segments_);
+    v->Set(zero);
+    const Real *row = RowData(r, t);
+    for (int32 s = BandStart(t); s < BandEnd(t); s++) {
+      (*v)(s) = row[s];
+    }
+  }
+
+ private:
+  Real *data_;
+  int32 num_rows_;
+  int32 stride_;
+  int32 total_time_;
+  int32 total_segments_;
+};
+
+/// Lattices and row buffers of one engine, in the engine's precision;
+/// views into the memory of the CTCWorkspace.
+template<typename Real>
+struct CTCLattice {
+  CTCLattice(): label_acts(NULL), segment_acts(NULL), skip(NULL),
+                row_tmp(NULL) { }
+
+  Real *label_acts;      // (T, L+1) rows of L+1: blank, then every label
+  Real *segment_acts;    // activation of every segment, one frame
+  Real *skip;            // One() where s-2 -> s is allowed
+  Real *row_tmp;
+  CTCBandedMatrix<Real> forward_variables;   // every k-th frame when
+                                             // checkpointing
+  CTCBandedMatrix<Real> forward_block;       // frames between checkpoints
+  CTCBandedMatrix<Real> backward_variables;  // two rows in fused mode
+};
+
+/// Scratch space of the forward-backward pass over one sequence, laid out
+/// in a block of memory the workspace does not own (the caller's for
+/// CTCLoss::ComputeRaw); EvalBatch gives every worker thread its own.
+struct CTCWorkspace {
+  CTCWorkspace(): total_time(0), total_segments(0), checkpoint_interval(1),
+                  fused(false), forward_only(false), peak_bytes(0),
+                  log_space_fallbacks(0), forward_seconds(0.0),
+                  backward_seconds(0.0), gradient_seconds(0.0),
+                  columns(NULL), posteriors(NULL), data_(NULL),
+                  data_bytes_(0) { }
+
+  std::pair<int, int> segment_range(int time) const;
+  /// Segments [first, second) a frame can be in: reachable from the start,
+  /// and able to reach the end when total_time is known (>= 0)
+  static std::pair<int, int> SegmentRange(int time, int total_time,
+                                          int total_segments);
+
+  /// Bytes the scratch of a sequence of total_time frames and num_labels
+  /// labels takes under opts; the forward-only scratch of Score() keeps two
+  /// rows of forward variables and nothing for the backward pass
+  static size_t RequiredBytes(int32 total_time, int32 num_labels,
+                              const CTCLossOptions &opts,
+                              bool forward_only = false);
+
+  /// Use the given memory for the following sequences
+  void Bind(void *data, size_t bytes) {
+    data_ = static_cast<char*>(data);
+    data_bytes_ = bytes;
+  }
+
+  /// Lays the scratch of a sequence out in the bound memory, which must
+  /// hold RequiredBytes(); resolves the checkpoint interval of opts.
+  void Prepare(int32 total_time, int32 num_labels,
+               const CTCLossOptions &opts, bool forward_only = false);
+
+  int total_time;
+  int total_segments;
+  int checkpoint_interval;              // 1 keeps all forward rows
+  bool fused;                           // two rows of backward variables
+  bool forward_only;                    // two rows of forward variables
+  size_t peak_bytes;                    // largest scratch of one sequence
+  int64 log_space_fallbacks;            // scaled lattices that underflowed
+  // time spent in the phases of all the sequences so far; with a fused
+  // backward pass the posteriors are injected inside the backward phase
+  double forward_seconds;               // gather and forward recursion
+  double backward_seconds;              // backward recursion
+  double gradient_seconds;              // posteriors and errors
+  std::vector<int32> target;            // labels copied by ComputeRaw
+  int32 *columns;                       // blank, then the target
+  BaseFloat *posteriors;                // (T, L+1) label posteriors
+  CTCLattice<BaseFloat> log_lattice;    // log-space engine
+  CTCLattice<double> scaled_lattice;    // scaled engine, same memory
+
+ private:
+  char *data_;
+  size_t data_bytes_;
+};
+
+/// Grow-only host memory of CTCLoss, one region per buffer. A region is
+/// sized to the largest utterance seen (or reserved up front) and never
+/// shrinks, so once warm the loss allocates nothing on the host;
+/// NumAllocations() counts the times a region had to grow.
+class CTCArena {
+ public:
+  enum Region {
+    kNetOut = 0,       // downloaded network output
+    kDiff,             // errors before the upload
+    kLabelNetOut,      // blank and target columns of EvalPosteriors
+    kWorkspace,        // CTCWorkspace memory of all the threads
+    kStreamNetOut,     // EvalStreams output, one sequence after another;
+                       // ScoreStreams output, a sequence at a time
+    kStreamDiff,       // and its errors
+    kMergedPosteriors, // CombinePosteriors, one column per distinct label
+    kNumRegions
+  };
+
+  CTCArena(): num_allocations_(0) { }
+
+  /// Region r with room for at least bytes, 64-byte aligned; the contents
+  /// are undefined
+  char *Get(Region r, size_t bytes) {
+    std::vector<char> &mem = regions_[r];
+    if (mem.size() < bytes + 63) {
+      mem.resize(bytes + 63);
+      num_allocations_++;
+    }
+    return reinterpret_cast<char*>(
+        (reinterpret_cast<size_t>(&mem[0]) + 63) & ~static_cast<size_t>(63));
+  }
+  /// Bytes of region r that Get can hand out without allocating
+  size_t Capacity(Region r) const {
+    return regions_[r].size() < 63 ? 0 : regions_[r].size() - 63;
+  }
+
+  /// (rows, cols) matrix view of region r
+  SubMatrix<BaseFloat> MatrixView(Region r, int32 rows, int32 cols) {
+    size_t bytes = static_cast<size_t>(rows) * cols * sizeof(BaseFloat);
+    BaseFloat *data = reinterpret_cast<BaseFloat*>(Get(r, bytes));
+    return SubMatrix<BaseFloat>(data, rows, cols, cols);
+  }
+
+  int64 NumAllocations() const { return num_allocations_; }
+  size_t SizeInBytes() const {
+    size_t bytes = 0;
+    for (int32 r = 0; r < kNumRegions; r++) bytes += regions_[r].size();
+    return bytes;
+  }
+
+ private:
+  std::vector<char> regions_[kNumRegions];
+  int64 num_allocations_;
+};
+
+/// Phases of the CTC loss that are timed per utterance
+enum CTCPhase {
+  kCopyPhase = 0,             // transfers between device and host
+  kForwardPhase,              // gather and forward recursion
+  kBackwardPhase,             // backward recursion
+  kGradientPhase,             // posteriors and errors
+  kDecodePhase,               // greedy best path
+  kEditDistancePhase,         // Levenshtein distance to the reference
+  kNumPhases
+};
+
+/// Per-utterance latencies of the CTCLoss phases. Utterances are bucketed
+/// by their lattice size T*S, bucket b holding the sizes in [4^b, 4^(b+1)),
+/// and the slowest ones are remembered by key. An utterance is open from
+/// Begin() until the next Begin() (or Close()), so phases timed after the
+/// loss, like ErrorRate, are added to it.
+class CTCTimingStats {
+ public:
+  CTCTimingStats(): num_slowest_(5), num_utterances_(0), open_(false),
+                    open_cells_(0) { }
+
+  void SetNumSlowest(int32 num_slowest) { num_slowest_ = num_slowest; }
+
+  /// Closes the open utterance and opens one of total_time frames and
+  /// total_segments segments; an empty key is replaced by its index
+  void Begin(const std::string &key, int32 total_time,
+             int32 total_segments);
+  /// Adds seconds to a phase of the open utterance
+  void Add(CTCPhase phase, double seconds);
+  /// Adds the open utterance, if any, to the statistics
+  void Close();
+  /// Adds the utterances of other, which has none open
+  void Merge(const CTCTimingStats &other);
+  /// Forgets every utterance, the open one included
+  void Reset();
+
+  /// Histogram of mean and max milliseconds per phase and the slowest keys,
+  /// the open utterance included as it stands; leaves it open
+  std::string Report() const;
+
+ private:
+  struct Bucket {
+    int64 num_utterances;
+    double seconds[kNumPhases];
+    double max_seconds[kNumPhases];
+  };
+  struct Utterance {
+    double seconds;
+    int64 cells;
+    std::string key;
+  };
+
+  int32 num_slowest_;
+  int64 num_utterances_;
+  std::vector<Bucket> buckets_;
+  std::vector<Utterance> slowest_;        // slowest first
+  bool open_;
+  std::string open_key_;
+  int64 open_cells_;
+  double open_seconds_[kNumPhases];
+};
+
+/// Label posteriors of one sequence in compact form, the sparse
+/// counterpart of the dense errors: posteriors(t, j) is the occupation of
+/// network output labels[j] at frame t, where labels is the blank followed
+/// by the target (a label may appear more than once).
+struct CTCPosteriors {
+  Matrix<BaseFloat> posteriors;
+  std::vector<int32> labels;
+};
+
+/// What Eval and EvalLogits learn about one utterance when asked to decode
+/// it as well: the loss and the best path scored against the target
+struct CTCUtteranceResult {
+  BaseFloat log_prob;             // log[P(z|x)]
+  std::vector<int32> hyp;         // best path, repeats merged, no blanks
+  int32 num_errors;               // edit distance between hyp and target
+  int32 num_insertions;
+  int32 num_deletions;
+  int32 num_substitutions;
+  double error_rate;              // num_errors in percent of the target
+};
+
 class CTCLoss {
 public:
   CTCLoss(int blank_num, int report_step = 100)
-    : blank_(blank_num), total_time_(0), total_segments_(0),
-      frames_(0), sequences_num_(0), ref_num_(0), error_num_(0.0), frames_progress_(0),
+    : blank_(blank_num), engine_(kLogSpaceEngine), frames_(0), sequences_num_(0), ref_num_(0), error_num_(0.0), frames_progress_(0),
       sequences_progress_(0), ref_num_progress_(0), error_num_progress_(0.0),
-      obj_progress_(0.0), report_step_(report_step)
+      obj_progress_(0.0), report_step_(report_step),
+      num_device_allocations_(0), batch_copy_seconds_(0.0),
+      merged_fallbacks_(0)
   { KALDI_ASSERT(report_step > 0); }
   ~CTCLoss() { }
 
-  /// Evaluate connectionist temporal classification (CTC) errors from labels
+  void SetOptions(const CTCLossOptions &opts);
+
+  /// Name the next utterance evaluated, for the list of slowest ones
+  void SetUtteranceKey(const std::string &key) { utterance_key_ = key; }
+  /// Name the sequences of the next EvalBatch, EvalStreams or
+  /// ScoreStreams one by one, in the order of their seq_lengths
+  void SetUtteranceKeys(const std::vector<std::string> &keys) {
+    utterance_keys_ = keys;
+  }
+
+  /// Size every buffer for utterances of up to max_time frames and
+  /// max_labels labels over num_outputs outputs, so that evaluating them
+  /// allocates nothing
+  void Reserve(int32 max_time, int32 max_labels, int32 num_outputs);
+
+  /// Times a host buffer had to grow, and a device buffer had to change
+  /// size (the device allocator of CuDevice caches those)
+  int64 NumHostAllocations() const { return arena_.NumAllocations(); }
+  int64 NumDeviceAllocations() const { return num_device_allocations_; }
+
+  /// Evaluate connectionist temporal classification (CTC) errors from
+  /// labels. If result is not NULL the best path is decoded from the same
+  /// host copy while the errors are formed, and scored like ErrorRate()
+  /// does, so ErrorRate() need not be called.
   void Eval(const CuMatrixBase<BaseFloat> &log_net_out,
             const std::vector<int32> &target,
-            CuMatrix<BaseFloat> *diff);
-  
+            CuMatrix<BaseFloat> *diff,
+            CTCUtteranceResult *result = NULL);
+
+  /// Evaluate CTC errors like Eval, but from the pre-softmax activations
+  /// (logits) of a network whose final softmax has been removed. The
+  /// log-softmax is formed once per row on the host and diff receives the
+  /// errors with respect to the logits, softmax - posteriors.
+  void EvalLogits(const CuMatrixBase<BaseFloat> &logits,
+                  const std::vector<int32> &target,
+                  CuMatrix<BaseFloat> *diff,
+                  CTCUtteranceResult *result = NULL);
+
+  /// Evaluate CTC errors of several sequences at once. The sequences are
+  /// packed one after another along the rows of log_net_out, seq_lengths
+  /// gives the number of frames of each. The sequences are shared out
+  /// over opts.num_threads threads, longest first; log_probs (optional)
+  /// receives log[P(z|x)] of every sequence.
+  void EvalBatch(const CuMatrixBase<BaseFloat> &log_net_out,
+                 const std::vector<int32> &seq_lengths,
+                 const std::vector<std::vector<int32> > &targets,
+                 CuMatrix<BaseFloat> *diff,
+                 std::vector<BaseFloat> *log_probs = NULL);
+
+  /// Evaluate CTC errors of sequences interleaved frame by frame, as the
+  /// multi-stream LSTM components of nnet1 lay them out: row
+  /// t * num_streams + s of log_net_out is frame t of stream s, where
+  /// num_streams = seq_lengths.size() and stream s has seq_lengths[s]
+  /// frames. The rows past the end of a stream are padding; their errors
+  /// are zero. The streams are evaluated like EvalBatch; results
+  /// (optional) receives the loss and the decoded best path of every
+  /// stream, scored like ErrorRate().
+  void EvalStreams(const CuMatrixBase<BaseFloat> &log_net_out,
+                   const std::vector<int32> &seq_lengths,
+                   const std::vector<std::vector<int32> > &targets,
+                   CuMatrix<BaseFloat> *diff,
+                   std::vector<CTCUtteranceResult> *results = NULL);
+
+  /// Score() of every stream of an output interleaved as for EvalStreams,
+  /// by the forward recursion alone, for cross-validation; results
+  /// (optional) as for EvalStreams
+  void ScoreStreams(const CuMatrixBase<BaseFloat> &log_net_out,
+                    const std::vector<int32> &seq_lengths,
+                    const std::vector<std::vector<int32> > &targets,
+                    std::vector<CTCUtteranceResult> *results = NULL);
+
+  /// Bytes of workspace ComputeRaw needs for batch sequences of at most
+  /// max_time frames and max_labels labels over num_outputs outputs
+  size_t GetWorkspaceSize(int32 max_time, int32 max_labels,
+                          int32 num_outputs, int32 batch) const;
+
+  /// Evaluate CTC errors of batch sequences held in raw host buffers,
+  /// without copying them into matrices or allocating scratch. Sequence n
+  /// has lengths[n] frames, packed after the previous sequence: a row of
+  /// num_outputs log posteriors per frame, rows act_stride floats apart.
+  /// Its label_lengths[n] labels follow those of the previous sequence in
+  /// labels. grads (same packing, rows grad_stride apart) receives the
+  /// errors unless it is NULL; log_probs receives log[P(z|x)] of every
+  /// sequence. workspace holds workspace_bytes >= GetWorkspaceSize() bytes.
+  void ComputeRaw(const BaseFloat *log_acts, int32 act_stride,
+                  int32 num_outputs, const int32 *lengths,
+                  const int32 *labels, const int32 *label_lengths,
+                  int32 batch, BaseFloat *grads, int32 grad_stride,
+                  BaseFloat *log_probs, void *workspace,
+                  size_t workspace_bytes);
+
+  /// log[P(z|x)] of one utterance from the forward recursion alone, for
+  /// cross-validation and rescoring: only the blank and target columns are
+  /// downloaded, two rows of forward variables are kept and no errors are
+  /// computed. Adds the utterance to the statistics like Eval.
+  BaseFloat Score(const CuMatrixBase<BaseFloat> &log_net_out,
+                  const std::vector<int32> &target);
+
+  /// Score() of an output already on the host, which decodes its best
+  /// path as well when result is not NULL; touches no device memory, so
+  /// it may run on a thread of its own
+  BaseFloat ScoreOnHost(const MatrixBase<BaseFloat> &log_net_out,
+                        const std::vector<int32> &target,
+                        CTCUtteranceResult *result = NULL);
+
+  /// Score() from the pre-softmax activations, as EvalLogits takes them:
+  /// the log-softmax is formed on the host and scored by the forward
+  /// recursion alone, for cross-validation without the final softmax;
+  /// result (optional) as for ScoreOnHost
+  BaseFloat ScoreLogits(const CuMatrixBase<BaseFloat> &logits,
+                        const std::vector<int32> &target,
+                        CTCUtteranceResult *result = NULL);
+
+  /// Adds an utterance of num_frames frames and num_labels labels that
+  /// another CTCLoss evaluated and decoded into result (e.g. on another
+  /// thread) to the statistics, as if it had been evaluated here
+  void AddResult(const CTCUtteranceResult &result, int32 num_frames,
+                 int32 num_labels);
+  /// Adds the phase timings of other to those of Report()
+  void MergeTiming(CTCLoss *other);
+
+  /// Sequences whose scaled lattice underflowed and were recomputed in
+  /// log space, as Report() gives them
+  int64 NumLogSpaceFallbacks() const;
+
+  /// Evaluate CTC like Eval, but return the label posteriors in compact
+  /// form instead of dense errors; only the blank and target columns of
+  /// net_out are downloaded. CombinePosteriors() forms the errors. With
+  /// is_log false net_out holds the softmax output itself and only the
+  /// downloaded columns are taken the log of.
+  void EvalPosteriors(const CuMatrixBase<BaseFloat> &net_out,
+                      const std::vector<int32> &target,
+                      CTCPosteriors *post, bool is_log = true);
+
+  /// Subtract the posteriors from diff, which holds the network output
+  /// (softmax, not its log) on entry; this gives the errors of Eval. The
+  /// buffers only grow, see NumHostAllocations()/NumDeviceAllocations().
+  void CombinePosteriors(const CTCPosteriors &post,
+                         CuMatrixBase<BaseFloat> *diff);
+  static void CombinePosteriors(const MatrixBase<BaseFloat> &posteriors,
+                                const int32 *labels,
+                                MatrixBase<BaseFloat> *diff);
+
   /// the net_out can be log scale net out or just net out,
   ///   because we just need the relative value
   void ErrorRate(const CuMatrixBase<BaseFloat> &net_out,
                  const std::vector<int32> &label,
                  double *error_rate,
                  std::vector<int32> *hyp);
-  /// Generate string with error report
-  std::string Report();
+  /// Generate string with error report; changes nothing, so it may be
+  /// logged at any point of a run
+  std::string Report() const;
+  /// Starts the phase timings of Report() over
+  void ResetTiming();
 
 public:
-  /// Evaluate CTC errors on host matrix 
+  /// Evaluate CTC errors on host matrix; diff_host has the same size
   void eval_on_host(const MatrixBase<BaseFloat> &log_net_out_host,
                     const std::vector<int32> &target,
-                    Matrix<BaseFloat> *diff_host);
-  
-  std::pair<int, int> segment_range(int time) const;
+                    MatrixBase<BaseFloat> *diff_host,
+                    CTCUtteranceResult *result = NULL);
+
+  /// EvalLogits on host matrices; logits_host is overwritten with its
+  /// log-softmax, diff_host has the same size
+  void eval_logits_on_host(MatrixBase<BaseFloat> *logits_host,
+                           const std::vector<int32> &target,
+                           MatrixBase<BaseFloat> *diff_host,
+                           CTCUtteranceResult *result = NULL);
+
+  /// Replaces every row of logits by its log-softmax and writes the
+  /// softmax to probs, with one exp per element and one log per row;
+  /// best_ids (optional) receives the largest output of every row
+  static void log_softmax_on_host(MatrixBase<BaseFloat> *logits,
+                                  MatrixBase<BaseFloat> *probs,
+                                  int32 *best_ids = NULL);
+
+  /// Merges the repeats of the best output of every frame and drops the
+  /// blanks
+  void collapse_best_path(const std::vector<int32> &best_ids,
+                          std::vector<int32> *hyp) const;
+
+  /// Decodes the best path from maxid_host_, the best output of every
+  /// frame, scores it against label with the Levenshtein distance and adds
+  /// it to the error statistics; fills all of result but log_prob
+  void record_errors(const std::vector<int32> &label,
+                     CTCUtteranceResult *result);
+  /// Adds num_errors in num_labels reference labels to the statistics
+  void record_error_counts(int32 num_errors, int32 num_labels);
+
+  /// EvalStreams on host matrices; diff_host has the same size
+  void eval_streams_on_host(const MatrixBase<BaseFloat> &log_net_out_host,
+                            const std::vector<int32> &seq_lengths,
+                            const std::vector<std::vector<int32> > &targets,
+                            MatrixBase<BaseFloat> *diff_host,
+                            std::vector<CTCUtteranceResult> *results);
+
+  /// Evaluate CTC errors of packed sequences on host matrix; diff_host has
+  /// the same size
+  void eval_batch_on_host(const MatrixBase<BaseFloat> &log_net_out_host,
+                          const std::vector<int32> &seq_lengths,
+                          const std::vector<std::vector<int32> > &targets,
+                          MatrixBase<BaseFloat> *diff_host,
+                          std::vector<BaseFloat> *log_probs);
+
+  /// Forward-backward pass over one sequence using the scratch in work,
+  /// which must be bound to memory; writes the errors to diff (if not
+  /// NULL), the largest output of every frame to best_ids (if not NULL)
+  /// and returns log[P(z|x)]. Touches no member state, so it may run on
+  /// several threads at once.
+  BaseFloat compute_on_host(const MatrixBase<BaseFloat> &log_net_out_host,
+                            const int32 *target, int32 num_labels,
+                            CTCWorkspace *work,
+                            MatrixBase<BaseFloat> *diff_host,
+                            int32 *best_ids = NULL) const;
+
+  /// Forward-backward pass over one sequence whose activations are the
+  /// columns of log_acts listed in columns (the blank, then one per target
+  /// label); work has been prepared for the sequence. Writes the (T, L+1)
+  /// label posteriors and returns log[P(z|x)].
+  BaseFloat posteriors_on_host(const MatrixBase<BaseFloat> &log_acts,
+                               const int32 *columns,
+                               const int32 *target, int32 num_labels,
+                               CTCWorkspace *work,
+                               MatrixBase<BaseFloat> *posteriors) const;
+
+  /// Forward recursion alone over a sequence whose activations are the
+  /// columns of log_acts listed in columns; work has been prepared forward
+  /// only. Returns log[P(z|x)].
+  BaseFloat score_on_host(const MatrixBase<BaseFloat> &log_acts,
+                          const int32 *columns, const int32 *target,
+                          int32 num_labels, CTCWorkspace *work) const;
+
+  /// Gathers the columns of log_net_out on the device and downloads them
+  /// into the arena; returns the host copy
+  SubMatrix<BaseFloat> download_columns(
+      const CuMatrixBase<BaseFloat> &log_net_out,
+      const std::vector<int32> &columns);
+
+  /// Add one evaluated sequence to the statistics and report progress
+  void record_progress(BaseFloat log_prob, int32 num_frames);
+
+  /// Number of frames needed to emit target (repeated labels need a blank
+  /// in between)
+  static int32 required_time(const std::vector<int32> &target);
+  static int32 required_time(const int32 *target, int32 num_labels);
+
+  std::pair<int, int> segment_range(int time) const {
+    return workspace_.segment_range(time);
+  }
 public:
   int blank_;
- 
-  int total_time_;
-  int total_segments_;
-  std::vector<BaseFloat> de_dy_terms_;
-  Matrix<BaseFloat> forward_variables_;
-  Matrix<BaseFloat> backward_variables_;
-  Matrix<BaseFloat> log_net_out_host_;
-  Matrix<BaseFloat> diff_host_;
+  CTCLossOptions opts_;
+  CTCEngineType engine_;
+
+  CTCWorkspace workspace_;                     // used by Eval
+  std::vector<CTCWorkspace> batch_workspaces_; // other ComputeRaw threads
+  CTCArena arena_;                             // host buffers
+  std::vector<int32> batch_labels_;            // targets of EvalBatch
+  std::vector<int32> batch_label_lengths_;
+  std::vector<BaseFloat> batch_log_probs_;
+  std::vector<int32> stream_best_ids_;         // used by EvalStreams
+  std::vector<int32> raw_frame_offsets_;       // used by ComputeRaw
+  std::vector<int32> raw_label_offsets_;
+  std::vector<int32> raw_order_;
+  std::vector<CTCWorkspace*> raw_workers_;
+  std::vector<double> raw_phase_seconds_;      // forward, backward, gradient
+  CuMatrix<BaseFloat> label_net_out_;          // used by EvalPosteriors,
+  CuArray<MatrixIndexT> label_columns_;        // grows only
+  std::vector<MatrixIndexT> merged_columns_;   // used by CombinePosteriors,
+  std::vector<int32> merged_index_;            // merged_ grows only
+  CuMatrix<BaseFloat> merged_;
+  CuArray<MatrixIndexT> merged_columns_dev_;
+  std::vector<int32> score_columns_;           // used by Score
+  CuArray<int32> maxid_;                       // used by ErrorRate
+  std::vector<int32> maxid_host_;              // and by decoding Evals
 
   int32 frames_;              // total number of frames
   int32 sequences_num_;       // total number of sequences
@@ -71,6 +648,61 @@ public:
 
   int32 report_step_;         // report obj and accuracy every so many sequences/utterances
 
+  int64 num_device_allocations_;
+
+  CTCTimingStats timing_;     // per-utterance phase latencies
+  std::string utterance_key_; // key of the next utterance
+  std::vector<std::string> utterance_keys_; // keys of the next batch
+  double batch_copy_seconds_; // EvalBatch transfers, not per utterance
+  int64 merged_fallbacks_;    // log-space fallbacks of MergeTiming()
+};
+
+/// Forward-only CTC scoring of an utterance whose network output arrives
+/// in chunks, for recordings too long to hold at once. The forward
+/// variables of the last frame are carried from chunk to chunk; since the
+/// total length is unknown, the window of segments is only limited from
+/// above (CTCWorkspace::SegmentRange with total_time -1). Memory is the
+/// gathered (chunk, L+1) activations of the largest chunk plus O(S), and
+/// Finish() gives the same log[P(z|x)] as CTCLoss::Score on the whole
+/// output. The scaled engine cannot recompute a chunk once it is gone, so
+/// it is scored in log space.
+class CTCStreamingScorer {
+ public:
+  explicit CTCStreamingScorer(int32 blank,
+                              const CTCLossOptions &opts = CTCLossOptions());
+
+  /// Starts a new utterance with the given target
+  void Reset(const std::vector<int32> &target);
+
+  /// Consumes the next frames (rows) of log softmax network output
+  void AcceptChunk(const MatrixBase<BaseFloat> &log_net_out);
+  /// Same, downloading only the blank and target columns
+  void AcceptChunk(const CuMatrixBase<BaseFloat> &log_net_out);
+
+  int32 NumFramesDone() const { return num_frames_; }
+
+  /// log[P(z|x)] of the frames accepted so far, which must be enough to
+  /// emit the target; 0 for an empty target and no frames
+  BaseFloat Finish() const;
+
+ private:
+  /// Runs the recursion over chunk, whose columns listed in columns are
+  /// the blank and target activations
+  void accept_columns(const MatrixBase<BaseFloat> &chunk,
+                      const int32 *columns);
+
+  int32 blank_;
+  bool approx_;                         // log-approx engine
+  std::vector<int32> target_;
+  std::vector<int32> columns_;          // blank, then the target
+  std::vector<int32> identity_;         // columns of a gathered chunk
+  int32 num_frames_;
+  std::vector<BaseFloat> rows_;         // forward variables of t-1 and t
+  std::vector<BaseFloat> scratch_;      // acts, skip and tmp of a frame
+  std::vector<BaseFloat> label_acts_;   // (chunk, L+1) activations
+  CuMatrix<BaseFloat> label_chunk_;     // device gather, grows only
+  CuArray<MatrixIndexT> label_columns_;
+  Matrix<BaseFloat> label_chunk_host_;
 };
 
 } // namespace nnet1
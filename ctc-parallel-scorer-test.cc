@@ -0,0 +1,92 @@
+// ctc/ctc-parallel-scorer-test.cc
+
+#include "ctc/ctc-parallel-scorer.h"
+#include "ctc/ctc-test-utils.h"
+#include "base/kaldi-types.h"
+
+namespace kaldi {
+namespace nnet1 {
+
+  /// Posteriors of the outputs, as the network gives them, and the
+  /// outputs replaced by the log that the scorer takes of them; the tests
+  /// propagate through an empty Nnet, which copies its input
+  void ToPosteriors(std::vector<Matrix<BaseFloat> > *log_net_outs,
+                    std::vector<Matrix<BaseFloat> > *net_outs) {
+    net_outs->resize(log_net_outs->size());
+    for (size_t n = 0; n < log_net_outs->size(); n++) {
+      (*net_outs)[n] = (*log_net_outs)[n];
+      (*net_outs)[n].ApplyExp();
+      (*log_net_outs)[n] = (*net_outs)[n];
+      (*log_net_outs)[n].ApplyLog();
+    }
+  }
+
+  void UnitTestCTCParallelScorer() {
+    std::vector<Matrix<BaseFloat> > outputs, posteriors;
+    std::vector<std::vector<int32> > targets;
+    RandCTCSequences(40, 9, &outputs, &targets);
+    ToPosteriors(&outputs, &posteriors);
+    CTCLoss ctc_ref(0);
+    ScoreCTCSequences(outputs, targets, &ctc_ref);
+
+    // the same statistics on any number of threads, from posteriors or
+    // from logits
+    Nnet nnet_transf, nnet;
+    int32 num_threads[] = { 1, 2, 5 };
+    for (int32 k = 0; k < 3; k++) {
+      for (int32 logits = 0; logits < 2; logits++) {
+        CTCLoss ctc(0);
+        CTCParallelScorer scorer(nnet_transf, nnet, 0, CTCLossOptions(),
+                                 &ctc, num_threads[k], logits == 1);
+        for (size_t n = 0; n < outputs.size(); n++) {
+          Matrix<BaseFloat> net_out(posteriors[n]);
+          if (logits == 1) RandCTCLogits(outputs[n], 1.0, &net_out);
+          std::ostringstream key;
+          key << "utt" << n;
+          scorer.Submit(key.str(), net_out, targets[n]);
+        }
+        scorer.Finish();
+        KALDI_ASSERT(scorer.NumScored() == outputs.size());
+        KALDI_LOG << scorer.Report();
+        AssertCTCStatisticsEqual(ctc, ctc_ref, (logits == 1 ? 1e-4 : 0.0));
+      }
+    }
+  }
+
+  void UnitTestCTCParallelScorerError() {
+    // a target too long for its output fails on a worker and is reported
+    // to the caller, once the utterances before it are in
+    Nnet nnet_transf, nnet;
+    CTCLoss ctc(0);
+    CTCParallelScorer scorer(nnet_transf, nnet, 0, CTCLossOptions(), &ctc,
+                             2);
+    Matrix<BaseFloat> net_out;
+    std::vector<int32> target;
+    RandCTCSequence(30, 4, 10, 3.0, &net_out, &target);
+    net_out.ApplyExp();
+    scorer.Submit("good", net_out, target);
+    target.resize(40, 1);
+    bool threw = false;
+    try {
+      scorer.Submit("bad", net_out, target);
+      scorer.Finish();
+    } catch(const std::exception &e) {
+      threw = true;
+    }
+    KALDI_ASSERT(threw && scorer.NumScored() == 1);
+  }
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main()
+{
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  // unit-tests:
+  UnitTestCTCParallelScorer();
+  UnitTestCTCParallelScorerError();
+
+  KALDI_LOG << "Tests succeeded.";
+  return 0;
+}
@@ -0,0 +1,201 @@
+// ctc/ctc-parallel-scorer.cc
+
+#include "ctc/ctc-parallel-scorer.h"
+#include <iomanip>
+#include <limits>
+
+namespace kaldi {
+namespace nnet1 {
+
+class CTCParallelScorer::WorkerTask: public MultiThreadable {
+ public:
+  explicit WorkerTask(CTCParallelScorer *scorer): scorer_(scorer) { }
+  void operator() () { scorer_->work(thread_id_); }
+ private:
+  CTCParallelScorer *scorer_;
+};
+
+CTCParallelScorer::CTCParallelScorer(const Nnet &nnet_transf,
+                                     const Nnet &nnet, int32 blank_num,
+                                     const CTCLossOptions &ctc_opts,
+                                     CTCLoss *loss, int32 num_threads,
+                                     bool logits)
+  : loss_(loss), logits_(logits), max_pending_(2 * num_threads), queued_(0),
+    scored_(0), num_scored_(0), merge_wait_seconds_(0.0),
+    elapsed_seconds_(0.0), finished_(false), threader_(NULL)
+{
+  KALDI_ASSERT(loss != NULL && num_threads > 0);
+  for (int32 w = 0; w < num_threads; w++) {
+    Worker *worker = new Worker;
+    worker->nnet_transf = nnet_transf;
+    worker->nnet = nnet;
+    // the progress of the merged statistics is reported by loss
+    worker->loss = new CTCLoss(blank_num,
+                               std::numeric_limits<int32>::max());
+    worker->loss->SetOptions(ctc_opts);
+    worker->num_utts = 0;
+    worker->busy_seconds = 0.0;
+    workers_.push_back(worker);
+  }
+  threader_ = new MultiThreader<WorkerTask>(num_threads, WorkerTask(this));
+}
+
+CTCParallelScorer::~CTCParallelScorer()
+{
+  if (!finished_) {
+    try {
+      Finish();
+    } catch(const std::exception &e) {
+      KALDI_WARN << "CTC scoring failed: " << e.what();
+    }
+  }
+  for (size_t i = 0; i < pending_.size(); i++) delete pending_[i];
+  for (size_t i = 0; i < free_.size(); i++) delete free_[i];
+  for (size_t w = 0; w < workers_.size(); w++) {
+    delete workers_[w]->loss;
+    delete workers_[w];
+  }
+}
+
+void CTCParallelScorer::Submit(const std::string &key,
+                               const MatrixBase<BaseFloat> &feats,
+                               const std::vector<int32> &target)
+{
+  KALDI_ASSERT(!finished_);
+  while (merge_oldest(pending_.size() >= max_pending_)) { }
+
+  Slot *slot = NULL;
+  if (!free_.empty()) {
+    slot = free_.back();
+    free_.pop_back();
+  } else {
+    slot = new Slot;
+  }
+  slot->key = key;
+  if (slot->feats.NumRows() != feats.NumRows() ||
+      slot->feats.NumCols() != feats.NumCols()) {
+    slot->feats.Resize(feats.NumRows(), feats.NumCols(), kUndefined);
+  }
+  slot->feats.CopyFromMat(feats);
+  slot->target = target;
+  slot->done = false;
+  pending_.push_back(slot);
+
+  lock_.Lock();
+  queue_.push_back(slot);
+  lock_.Unlock();
+  queued_.Signal();
+}
+
+void CTCParallelScorer::Finish()
+{
+  if (finished_) return;
+  finished_ = true;
+  lock_.Lock();
+  for (size_t w = 0; w < workers_.size(); w++) queue_.push_back(NULL);
+  lock_.Unlock();
+  for (size_t w = 0; w < workers_.size(); w++) queued_.Signal();
+  delete threader_;  // joins the threads, every slot is done
+  threader_ = NULL;
+  elapsed_seconds_ = timer_.Elapsed();
+  while (merge_oldest(false)) { }
+  for (size_t w = 0; w < workers_.size(); w++) {
+    loss_->MergeTiming(workers_[w]->loss);
+  }
+}
+
+bool CTCParallelScorer::merge_oldest(bool wait)
+{
+  if (pending_.empty()) return false;
+  Slot *slot = pending_.front();
+  Timer timer;
+  while (true) {
+    lock_.Lock();
+    bool done = slot->done;
+    lock_.Unlock();
+    if (done) break;
+    if (!wait) return false;
+    scored_.Wait();  // a worker finished some slot
+  }
+  merge_wait_seconds_ += timer.Elapsed();
+
+  pending_.pop_front();
+  free_.push_back(slot);
+  if (!slot->error.empty()) {
+    KALDI_ERR << "CTC scoring of " << slot->key << " failed: " << slot->error;
+  }
+  loss_->AddResult(slot->result, slot->net_out.NumRows(),
+                   slot->target.size());
+  num_scored_++;
+  return true;
+}
+
+void CTCParallelScorer::work(int32 w)
+{
+  Worker *worker = workers_[w];
+  while (true) {
+    queued_.Wait();
+    lock_.Lock();
+    Slot *slot = queue_.front();
+    queue_.pop_front();
+    lock_.Unlock();
+    if (slot == NULL) return;
+
+    // a failure is reported when the caller reaches the utterance
+    Timer timer;
+    slot->error.clear();
+    try {
+      worker->nnet_transf.Feedforward(CuMatrix<BaseFloat>(slot->feats),
+                                      &worker->feats_transf);
+      worker->nnet.Propagate(worker->feats_transf, &worker->net_out);
+      if (!logits_) worker->net_out.ApplyLog();
+      const CuMatrix<BaseFloat> &net_out = worker->net_out;
+      if (slot->net_out.NumRows() != net_out.NumRows() ||
+          slot->net_out.NumCols() != net_out.NumCols()) {
+        slot->net_out.Resize(net_out.NumRows(), net_out.NumCols(),
+                             kUndefined);
+      }
+      net_out.CopyToMat(&slot->net_out);
+      if (logits_) {
+        if (slot->probs.NumRows() != slot->net_out.NumRows() ||
+            slot->probs.NumCols() != slot->net_out.NumCols()) {
+          slot->probs.Resize(slot->net_out.NumRows(),
+                             slot->net_out.NumCols(), kUndefined);
+        }
+        CTCLoss::log_softmax_on_host(&slot->net_out, &slot->probs);
+      }
+      worker->loss->SetUtteranceKey(slot->key);
+      worker->loss->ScoreOnHost(slot->net_out, slot->target,
+                                &slot->result);
+      worker->num_utts++;
+    } catch(const std::exception &e) {
+      slot->error = e.what();
+    }
+    worker->busy_seconds += timer.Elapsed();
+
+    lock_.Lock();
+    slot->done = true;
+    lock_.Unlock();
+    scored_.Signal();
+  }
+}
+
+std::string CTCParallelScorer::Report() const
+{
+  double elapsed = std::max(finished_ ? elapsed_seconds_ : timer_.Elapsed(),
+                            1.0e-9);
+  std::ostringstream oss;
+  oss << "Parallel scoring on " << workers_.size() << " threads, "
+      << "utterances (busy %) per thread:" << std::fixed
+      << std::setprecision(1);
+  for (size_t w = 0; w < workers_.size(); w++) {
+    oss << " " << workers_[w]->num_utts << " ("
+        << 100.0 * workers_[w]->busy_seconds / elapsed << "%)";
+  }
+  oss << "; waited " << std::setprecision(2) << merge_wait_seconds_
+      << " s for results, of " << elapsed << " s";
+  return oss.str();
+}
+
+} // namespace nnet1
+} // namespace kaldi
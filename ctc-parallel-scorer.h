@@ -0,0 +1,114 @@
+// ctc/ctc-parallel-scorer.h
+
+#ifndef KALDI_CTC_CTC_PARALLEL_SCORER_H_
+#define KALDI_CTC_CTC_PARALLEL_SCORER_H_
+
+#include "base/kaldi-common.h"
+#include "base/timer.h"
+#include "nnet/nnet-nnet.h"
+#include "thread/kaldi-thread.h"
+#include "thread/kaldi-mutex.h"
+#include "thread/kaldi-semaphore.h"
+#include "ctc/ctc-loss.h"
+#include <deque>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// Cross-validation on several threads. Each worker propagates utterances
+/// through its own copy of the feature transform and the network (an
+/// nnet1 Nnet keeps the activations of Propagate in its components, so
+/// the weights are copied rather than shared) and scores and decodes them
+/// with a CTCLoss of its own. Submit()ted utterances go to whichever
+/// worker is free; their results are added to the caller's CTCLoss in the
+/// order submitted, so the objective and token accuracy are those of a
+/// serial pass. The loss must not be used elsewhere until Finish().
+/// The workers use the device from several threads, so this is meant for
+/// CPU runs.
+class CTCParallelScorer {
+ public:
+  /// The workers' losses have blank_num and ctc_opts; with logits the
+  /// network outputs pre-softmax activations
+  CTCParallelScorer(const Nnet &nnet_transf, const Nnet &nnet,
+                    int32 blank_num, const CTCLossOptions &ctc_opts,
+                    CTCLoss *loss, int32 num_threads, bool logits = false);
+  /// Finishes the submitted utterances
+  ~CTCParallelScorer();
+
+  /// Queues the features of an utterance; adds the results that are
+  /// complete to the loss, waiting for the oldest while too many are
+  /// outstanding
+  void Submit(const std::string &key, const MatrixBase<BaseFloat> &feats,
+              const std::vector<int32> &target);
+
+  /// Waits for every submitted utterance and adds the results and the
+  /// timings of the workers to the loss
+  void Finish();
+
+  /// Utterances whose results are in the loss
+  int32 NumScored() const { return num_scored_; }
+
+  /// Utterances and busy time per worker, and how long the caller waited
+  /// for results; after Finish()
+  std::string Report() const;
+
+ public:
+  /// Work of a thread: propagates and scores queued utterances until
+  /// Finish()
+  void work(int32 worker);
+
+ private:
+  struct Slot {
+    std::string key;
+    Matrix<BaseFloat> feats;
+    std::vector<int32> target;
+    Matrix<BaseFloat> net_out;        // host copy of the network output
+    Matrix<BaseFloat> probs;          // scratch of the log-softmax
+    CTCUtteranceResult result;
+    std::string error;                // exception of the worker, if any
+    bool done;                        // set by the worker
+  };
+  struct Worker {
+    Nnet nnet_transf;
+    Nnet nnet;
+    CTCLoss *loss;
+    CuMatrix<BaseFloat> feats_transf, net_out;
+    int32 num_utts;
+    double busy_seconds;
+  };
+
+  /// Adds the oldest submitted result to the loss, if it is complete or
+  /// wait is set; false when nothing was added. Throws the error of the
+  /// utterance if its worker failed
+  bool merge_oldest(bool wait);
+
+  CTCLoss *loss_;
+  bool logits_;
+  size_t max_pending_;                  // submitted but not added yet
+  std::vector<Worker*> workers_;
+
+  Mutex lock_;                          // queue_ and the done flags
+  std::deque<Slot*> queue_;             // NULL ends a thread
+
+  Semaphore queued_;                    // signalled by every Submit()
+  Semaphore scored_;                    // signalled by every finished slot
+
+  // of the caller's thread
+  std::deque<Slot*> pending_;           // in the order submitted
+  std::vector<Slot*> free_;             // slots to reuse
+  int32 num_scored_;
+  double merge_wait_seconds_;           // waiting for the oldest result
+  Timer timer_;                         // running since construction
+  double elapsed_seconds_;              // frozen by Finish()
+  bool finished_;
+
+  class WorkerTask;
+  MultiThreader<WorkerTask> *threader_;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(CTCParallelScorer);
+};
+
+} // namespace nnet1
+} // namespace kaldi
+
+#endif // KALDI_CTC_CTC_PARALLEL_SCORER_H_
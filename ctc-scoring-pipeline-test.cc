@@ -0,0 +1,71 @@
+// ctc/ctc-scoring-pipeline-test.cc
+
+#include "ctc/ctc-scoring-pipeline.h"
+#include "ctc/ctc-test-utils.h"
+#include "base/kaldi-types.h"
+
+namespace kaldi {
+namespace nnet1 {
+
+  void UnitTestCTCScoringPipeline() {
+    std::vector<Matrix<BaseFloat> > outputs;
+    std::vector<std::vector<int32> > targets;
+    RandCTCSequences(30, 9, &outputs, &targets);
+    CTCLoss ctc_ref(0);
+    ScoreCTCSequences(outputs, targets, &ctc_ref);
+
+    // the same statistics however deep the queue, from log posteriors or
+    // from logits
+    int32 depths[] = { 1, 2, 8 };
+    for (int32 d = 0; d < 3; d++) {
+      for (int32 logits = 0; logits < 2; logits++) {
+        CTCLoss ctc(0);
+        CTCScoringPipeline pipeline(&ctc, depths[d], logits == 1);
+        for (size_t n = 0; n < outputs.size(); n++) {
+          Matrix<BaseFloat> net_out(outputs[n]);
+          if (logits == 1) RandCTCLogits(outputs[n], 1.0, &net_out);
+          std::ostringstream key;
+          key << "utt" << n;
+          pipeline.Submit(key.str(), CuMatrix<BaseFloat>(net_out),
+                          targets[n]);
+        }
+        pipeline.Finish();
+        KALDI_ASSERT(pipeline.NumScored() == outputs.size());
+        KALDI_LOG << pipeline.Report();
+        AssertCTCStatisticsEqual(ctc, ctc_ref, (logits == 1 ? 1e-4 : 0.0));
+      }
+    }
+  }
+
+  void UnitTestCTCScoringPipelineError() {
+    // a target too long for its output fails on the CTC thread and is
+    // reported to the caller
+    CTCLoss ctc(0);
+    CTCScoringPipeline pipeline(&ctc, 1);
+    Matrix<BaseFloat> log_net_out;
+    std::vector<int32> target;
+    RandCTCSequence(6, 4, 10, 3.0, &log_net_out, &target);
+    bool threw = false;
+    try {
+      pipeline.Submit("bad", CuMatrix<BaseFloat>(log_net_out), target);
+      pipeline.Finish();
+    } catch(const std::exception &e) {
+      threw = true;
+    }
+    KALDI_ASSERT(threw && pipeline.NumScored() == 0);
+  }
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main()
+{
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  // unit-tests:
+  UnitTestCTCScoringPipeline();
+  UnitTestCTCScoringPipelineError();
+
+  KALDI_LOG << "Tests succeeded.";
+  return 0;
+}
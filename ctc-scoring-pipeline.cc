@@ -0,0 +1,179 @@
+// ctc/ctc-scoring-pipeline.cc
+
+#include "ctc/ctc-scoring-pipeline.h"
+#include <iomanip>
+
+namespace kaldi {
+namespace nnet1 {
+
+class CTCScoringPipeline::ScoringTask: public MultiThreadable {
+ public:
+  explicit ScoringTask(CTCScoringPipeline *pipeline): pipeline_(pipeline) { }
+  void operator() () { pipeline_->score_loop(); }
+ private:
+  CTCScoringPipeline *pipeline_;
+};
+
+CTCScoringPipeline::CTCScoringPipeline(CTCLoss *loss, int32 depth,
+                                       bool logits)
+  : loss_(loss), depth_(depth), logits_(logits), num_scored_(0),
+    ctc_busy_seconds_(0.0), ctc_wait_seconds_(0.0), free_slots_(depth),
+    queued_(0), submit_wait_seconds_(0.0), queue_fill_sum_(0.0),
+    num_submitted_(0), elapsed_seconds_(0.0), finished_(false),
+    threader_(NULL)
+{
+  KALDI_ASSERT(loss != NULL && depth > 0);
+  threader_ = new MultiThreader<ScoringTask>(1, ScoringTask(this));
+}
+
+CTCScoringPipeline::~CTCScoringPipeline()
+{
+  if (!finished_) {
+    try {
+      Finish();
+    } catch(const std::exception &e) {
+      KALDI_WARN << "CTC scoring failed: " << e.what();
+    }
+  }
+  for (size_t i = 0; i < free_.size(); i++) delete free_[i];
+  for (size_t i = 0; i < queue_.size(); i++) delete queue_[i];
+}
+
+void CTCScoringPipeline::Submit(const std::string &key,
+                                const CuMatrixBase<BaseFloat> &net_out,
+                                const std::vector<int32> &target)
+{
+  KALDI_ASSERT(!finished_);
+  Timer timer;
+  free_slots_.Wait();
+  submit_wait_seconds_ += timer.Elapsed();
+  check_error();
+
+  lock_.Lock();
+  Slot *slot = NULL;
+  if (!free_.empty()) {
+    slot = free_.back();
+    free_.pop_back();
+  }
+  queue_fill_sum_ += queue_.size();
+  lock_.Unlock();
+  if (slot == NULL) slot = new Slot;
+
+  // the device is used on this thread only
+  slot->key = key;
+  if (slot->net_out.NumRows() != net_out.NumRows() ||
+      slot->net_out.NumCols() != net_out.NumCols()) {
+    slot->net_out.Resize(net_out.NumRows(), net_out.NumCols(), kUndefined);
+  }
+  net_out.CopyToMat(&slot->net_out);
+  slot->target = target;
+
+  lock_.Lock();
+  queue_.push_back(slot);
+  num_submitted_++;
+  lock_.Unlock();
+  queued_.Signal();
+}
+
+void CTCScoringPipeline::Finish()
+{
+  if (finished_) return;
+  finished_ = true;
+  lock_.Lock();
+  queue_.push_back(NULL);
+  lock_.Unlock();
+  queued_.Signal();
+  delete threader_;  // joins the thread
+  threader_ = NULL;
+  elapsed_seconds_ = timer_.Elapsed();
+  check_error();
+}
+
+void CTCScoringPipeline::check_error()
+{
+  lock_.Lock();
+  std::string error = thread_error_;
+  lock_.Unlock();
+  if (!error.empty()) {
+    KALDI_ERR << "CTC scoring failed: " << error;
+  }
+}
+
+void CTCScoringPipeline::score_loop()
+{
+  while (true) {
+    Timer timer;
+    queued_.Wait();
+    lock_.Lock();
+    ctc_wait_seconds_ += timer.Elapsed();
+    Slot *slot = queue_.front();
+    queue_.pop_front();
+    lock_.Unlock();
+    if (slot == NULL) return;
+
+    timer.Reset();
+    bool failed = false;
+    try {
+      if (logits_) {
+        if (slot->probs.NumRows() != slot->net_out.NumRows() ||
+            slot->probs.NumCols() != slot->net_out.NumCols()) {
+          slot->probs.Resize(slot->net_out.NumRows(),
+                             slot->net_out.NumCols(), kUndefined);
+        }
+        CTCLoss::log_softmax_on_host(&slot->net_out, &slot->probs);
+      }
+      CTCUtteranceResult result;
+      loss_->SetUtteranceKey(slot->key);
+      loss_->ScoreOnHost(slot->net_out, slot->target, &result);
+    } catch(const std::exception &e) {
+      lock_.Lock();
+      if (thread_error_.empty()) thread_error_ = e.what();
+      lock_.Unlock();
+      failed = true;
+    }
+
+    lock_.Lock();
+    ctc_busy_seconds_ += timer.Elapsed();
+    if (!failed) num_scored_++;
+    free_.push_back(slot);
+    lock_.Unlock();
+    // after a failure the caller finds the error once it is let in
+    free_slots_.Signal();
+  }
+}
+
+int32 CTCScoringPipeline::NumScored() const
+{
+  lock_.Lock();
+  int32 num_scored = num_scored_;
+  lock_.Unlock();
+  return num_scored;
+}
+
+std::string CTCScoringPipeline::Report() const
+{
+  lock_.Lock();
+  double ctc_busy = ctc_busy_seconds_, ctc_wait = ctc_wait_seconds_;
+  lock_.Unlock();
+  double elapsed = std::max(finished_ ? elapsed_seconds_ : timer_.Elapsed(),
+                            1.0e-9);
+  std::ostringstream oss;
+  oss << "Scoring pipeline, queue depth " << depth_ << ": forward stage busy "
+      << std::fixed << std::setprecision(1)
+      << 100.0 * (1.0 - submit_wait_seconds_ / elapsed) << "% (waited "
+      << std::setprecision(2) << submit_wait_seconds_
+      << " s for room in the queue), CTC stage busy " << std::setprecision(1)
+      << 100.0 * ctc_busy / elapsed << "% (waited " << std::setprecision(2)
+      << ctc_wait << " s for outputs), " << std::setprecision(2)
+      << queue_fill_sum_ / std::max(num_submitted_, 1)
+      << " utterances queued on average, of " << elapsed << " s; ";
+  if (submit_wait_seconds_ > ctc_wait) {
+    oss << "the CTC stage is the bottleneck";
+  } else {
+    oss << "the forward stage is the bottleneck";
+  }
+  return oss.str();
+}
+
+} // namespace nnet1
+} // namespace kaldi
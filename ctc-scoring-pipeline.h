@@ -0,0 +1,94 @@
+// ctc/ctc-scoring-pipeline.h
+
+#ifndef KALDI_CTC_CTC_SCORING_PIPELINE_H_
+#define KALDI_CTC_CTC_SCORING_PIPELINE_H_
+
+#include "base/kaldi-common.h"
+#include "base/timer.h"
+#include "cudamatrix/cu-matrix.h"
+#include "thread/kaldi-thread.h"
+#include "thread/kaldi-mutex.h"
+#include "thread/kaldi-semaphore.h"
+#include "ctc/ctc-loss.h"
+#include <deque>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// Overlaps the forward pass of one utterance with the CTC evaluation of
+/// the previous ones, for passes that do not backpropagate
+/// (cross-validation, scoring). The caller propagates and Submit()s the
+/// network output, which is copied to the host; a thread of the pipeline
+/// takes the outputs from a queue of at most depth utterances and scores
+/// and decodes them with the CTCLoss (ScoreOnHost), in the order
+/// submitted, so the statistics of the loss are those of a serial pass.
+/// The loss must not be used elsewhere until Finish().
+class CTCScoringPipeline {
+ public:
+  /// With logits the outputs are pre-softmax activations, their
+  /// log-softmax is formed on the CTC thread
+  CTCScoringPipeline(CTCLoss *loss, int32 depth, bool logits = false);
+  /// Finishes the queued utterances
+  ~CTCScoringPipeline();
+
+  /// Queues the output of an utterance; waits while the queue is full
+  void Submit(const std::string &key, const CuMatrixBase<BaseFloat> &net_out,
+              const std::vector<int32> &target);
+
+  /// Waits until every submitted utterance has been scored
+  void Finish();
+
+  int32 NumScored() const;
+
+  /// How busy the forward (caller) and CTC stages were and how full the
+  /// queue ran, so the slower stage shows
+  std::string Report() const;
+
+ public:
+  /// Work of the CTC thread: scores queued outputs until Finish()
+  void score_loop();
+
+ private:
+  struct Slot {
+    std::string key;
+    Matrix<BaseFloat> net_out;
+    Matrix<BaseFloat> probs;          // scratch of the log-softmax
+    std::vector<int32> target;
+  };
+
+  /// Throws the error of the CTC thread, if it failed
+  void check_error();
+
+  CTCLoss *loss_;
+  int32 depth_;
+  bool logits_;
+
+  mutable Mutex lock_;                  // the members up to the semaphores
+  std::deque<Slot*> queue_;             // NULL ends the thread
+  std::vector<Slot*> free_;             // slots to reuse
+  std::string thread_error_;            // exception of the CTC thread
+  int32 num_scored_;
+  double ctc_busy_seconds_;             // scoring, on the CTC thread
+  double ctc_wait_seconds_;             // waiting for outputs
+
+  Semaphore free_slots_;                // room in the queue
+  Semaphore queued_;                    // signalled by every Submit()
+
+  // of the caller's thread
+  double submit_wait_seconds_;          // waiting for room in the queue
+  double queue_fill_sum_;               // queued utterances, per Submit()
+  int32 num_submitted_;
+  Timer timer_;                         // running since construction
+  double elapsed_seconds_;              // frozen by Finish()
+  bool finished_;
+
+  class ScoringTask;
+  MultiThreader<ScoringTask> *threader_;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(CTCScoringPipeline);
+};
+
+} // namespace nnet1
+} // namespace kaldi
+
+#endif // KALDI_CTC_CTC_SCORING_PIPELINE_H_
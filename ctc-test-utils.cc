@@ -0,0 +1,90 @@
+// ctc/ctc-test-utils.cc
+
+#include "ctc/ctc-test-utils.h"
+#include <limits>
+
+namespace kaldi {
+namespace nnet1 {
+
+void RandCTCLogSoftmax(BaseFloat scale, MatrixBase<BaseFloat> *log_net_out)
+{
+  for (MatrixIndexT t = 0; t < log_net_out->NumRows(); t++) {
+    BaseFloat *row = log_net_out->RowData(t);
+    const MatrixIndexT dim = log_net_out->NumCols();
+    BaseFloat max = -std::numeric_limits<BaseFloat>::infinity();
+    for (MatrixIndexT v = 0; v < dim; v++) {
+      row[v] = scale * RandGauss();
+      max = std::max(max, row[v]);
+    }
+    double sum = 0.0;
+    for (MatrixIndexT v = 0; v < dim; v++) sum += exp(row[v] - max);
+    const BaseFloat log_sum = max + log(sum);
+    for (MatrixIndexT v = 0; v < dim; v++) row[v] -= log_sum;
+  }
+}
+
+void RandCTCSequence(int32 total_time, int32 num_outputs, int32 num_labels,
+                     BaseFloat scale, Matrix<BaseFloat> *log_net_out,
+                     std::vector<int32> *target)
+{
+  log_net_out->Resize(total_time, num_outputs, kUndefined);
+  RandCTCLogSoftmax(scale, log_net_out);
+  target->resize(num_labels);
+  for (int32 l = 0; l < num_labels; l++) {
+    (*target)[l] = (l % 7 == 3 ? (*target)[l-1] :
+                    RandInt(1, num_outputs - 1));
+  }
+}
+
+void RandCTCSequences(int32 num_utts, int32 num_outputs,
+                      std::vector<Matrix<BaseFloat> > *log_net_outs,
+                      std::vector<std::vector<int32> > *targets)
+{
+  log_net_outs->resize(num_utts);
+  targets->resize(num_utts);
+  for (int32 n = 0; n < num_utts; n++) {
+    int32 total_time = 10 + RandInt(0, 80);
+    RandCTCSequence(total_time, num_outputs, total_time / 3, 3.0,
+                    &(*log_net_outs)[n], &(*targets)[n]);
+  }
+}
+
+void RandCTCLogits(const MatrixBase<BaseFloat> &log_net_out, BaseFloat scale,
+                   Matrix<BaseFloat> *logits)
+{
+  *logits = log_net_out;
+  for (MatrixIndexT t = 0; t < logits->NumRows(); t++) {
+    logits->Row(t).Add(scale * RandGauss());
+  }
+}
+
+void ScoreCTCSequences(const std::vector<Matrix<BaseFloat> > &log_net_outs,
+                       const std::vector<std::vector<int32> > &targets,
+                       CTCLoss *loss)
+{
+  KALDI_ASSERT(log_net_outs.size() == targets.size());
+  for (size_t n = 0; n < log_net_outs.size(); n++) {
+    CuMatrix<BaseFloat> log_net_out(log_net_outs[n]);
+    double error_rate;
+    std::vector<int32> hyp;
+    loss->Score(log_net_out, targets[n]);
+    loss->ErrorRate(log_net_out, targets[n], &error_rate, &hyp);
+  }
+}
+
+void AssertCTCStatisticsEqual(const CTCLoss &loss, const CTCLoss &ref,
+                              BaseFloat tolerance)
+{
+  KALDI_ASSERT(loss.sequences_num_ == ref.sequences_num_ &&
+               loss.frames_ == ref.frames_ &&
+               loss.error_num_ == ref.error_num_ &&
+               loss.ref_num_ == ref.ref_num_);
+  if (tolerance > 0.0) {
+    AssertEqual(loss.obj_progress_, ref.obj_progress_, tolerance);
+  } else {
+    KALDI_ASSERT(loss.obj_progress_ == ref.obj_progress_);
+  }
+}
+
+} // namespace nnet1
+} // namespace kaldi
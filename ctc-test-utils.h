@@ -0,0 +1,53 @@
+// ctc/ctc-test-utils.h
+
+#ifndef KALDI_CTC_CTC_TEST_UTILS_H_
+#define KALDI_CTC_CTC_TEST_UTILS_H_
+
+#include "base/kaldi-common.h"
+#include "matrix/kaldi-matrix.h"
+#include "ctc/ctc-loss.h"
+
+namespace kaldi {
+namespace nnet1 {
+
+/// Synthetic network outputs and targets for the tests and benchmarks of
+/// the CTC loss; the blank is output 0.
+
+/// Fills log_net_out with the log-softmax of gaussian logits; scale sets
+/// how peaky the synthetic network output is
+void RandCTCLogSoftmax(BaseFloat scale, MatrixBase<BaseFloat> *log_net_out);
+
+/// A log-softmax output of total_time frames over num_outputs outputs and
+/// a target of num_labels labels, every 7th repeating its predecessor (the
+/// case that forces a blank in between)
+void RandCTCSequence(int32 total_time, int32 num_outputs, int32 num_labels,
+                     BaseFloat scale, Matrix<BaseFloat> *log_net_out,
+                     std::vector<int32> *target);
+
+/// num_utts sequences of 10 to 90 frames over num_outputs outputs, with
+/// targets of a third of their length
+void RandCTCSequences(int32 num_utts, int32 num_outputs,
+                      std::vector<Matrix<BaseFloat> > *log_net_outs,
+                      std::vector<std::vector<int32> > *targets);
+
+/// Logits whose log-softmax is log_net_out: every row shifted by a
+/// gaussian of standard deviation scale
+void RandCTCLogits(const MatrixBase<BaseFloat> &log_net_out, BaseFloat scale,
+                   Matrix<BaseFloat> *logits);
+
+/// Scores and decodes the sequences in turn with Score() and ErrorRate(),
+/// as a serial cross-validation pass does
+void ScoreCTCSequences(const std::vector<Matrix<BaseFloat> > &log_net_outs,
+                       const std::vector<std::vector<int32> > &targets,
+                       CTCLoss *loss);
+
+/// Asserts that loss holds the statistics of ref: the same sequences,
+/// frames and errors, and the objective exactly, or within tolerance
+/// relative when tolerance > 0
+void AssertCTCStatisticsEqual(const CTCLoss &loss, const CTCLoss &ref,
+                              BaseFloat tolerance = 0.0);
+
+} // namespace nnet1
+} // namespace kaldi
+
+#endif // KALDI_CTC_CTC_TEST_UTILS_H_
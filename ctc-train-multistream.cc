@@ -0,0 +1,287 @@
+// ctc/ctc-train-multistream.cc
+
+#include "nnet/nnet-trnopts.h"
+#include "nnet/nnet-nnet.h"
+#include "ctc/ctc-loss.h"
+#include "ctc/ctc-utterance-reader.h"
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "base/timer.h"
+#include "cudamatrix/cu-device.h"
+
+int main(int argc, char *argv[]) {
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  typedef kaldi::int32 int32;
+
+  try {
+    const char *usage =
+        "Perform one iteration of Neural Network training by Connectionist Temporal Classification (CTC),\n"
+        "on minibatches of several utterances. The utterances of a minibatch are the streams of the\n"
+        "multi-stream LSTM components: their frames are interleaved (row t * num-streams + s is frame t\n"
+        "of stream s) and the shorter ones are padded to the longest, the padding gets no errors.\n"
+        "The streams are taken in the order of the reader; with more than one stream that order must\n"
+        "come from a length index, --utterance-order=sorted or bucketed (with --bucket-size a multiple\n"
+        "of --num-streams), so the streams of a minibatch have similar lengths and little padding.\n"
+        "\n"
+        "Usage:  ctc-train-multistream [options] --blank-num=integer <feature-rspecifier> <targets-rspecifier> <model-in> [<model-out>]\n"
+        "e.g.: \n"
+        " ctc-train-multistream --blank-num=0 --num-streams=8 --length-index=ark:lengths.ark --utterance-order=bucketed \\\n"
+        "   --bucket-size=64 --shuffle-seed=1 cache:train.cache ark:target.ark nnet.init nnet.iter1\n";
+
+    ParseOptions po(usage);
+
+    NnetTrainOptions trn_opts;
+    trn_opts.Register(&po);
+
+    int blank_num = -1;
+    po.Register("blank-num", &blank_num, "The number that stands for blank in network. >= 0");
+
+    int32 num_streams = 4;
+    po.Register("num-streams", &num_streams, "Number of utterances packed into a minibatch, as parallel streams");
+
+    CTCLossOptions ctc_opts;
+    ctc_opts.Register(&po);
+
+    bool binary = true,
+         crossvalidate = false;
+    po.Register("binary", &binary, "Write output in binary mode");
+    po.Register("cross-validate", &crossvalidate, "Perform cross-validation (don't backpropagate)");
+
+    std::string feature_transform;
+    po.Register("feature-transform", &feature_transform, "Feature transform in Nnet format");
+
+    CTCReaderOptions reader_opts;
+    reader_opts.Register(&po);
+
+    std::string frame_weights;
+    po.Register("frame-weights", &frame_weights, "Per-frame weights to scale gradients (frame selection/weighting).");
+
+    std::string use_gpu="yes";
+    po.Register("use-gpu", &use_gpu, "yes|no|optional, only has effect if compiled with CUDA");
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 4-(crossvalidate?1:0) || blank_num < 0 ||
+        num_streams < 1) {
+      if (blank_num < 0) {
+        std::cerr << "invalid blank-num " << blank_num << "; blank-num should >= 0" << std::endl;
+      }
+      po.PrintUsage();
+      exit(1);
+    }
+    if (num_streams > 1) {
+      // the padding is only bounded when a minibatch is cut from a run of
+      // similar lengths
+      const std::string &order = reader_opts.utterance_order;
+      if (reader_opts.length_index_rspecifier == "" ||
+          (order != "sorted" && order != "bucketed")) {
+        KALDI_ERR << "--num-streams=" << num_streams << " needs "
+                  << "--length-index and --utterance-order=sorted|bucketed";
+      }
+      if (order == "bucketed" && reader_opts.bucket_size % num_streams != 0) {
+        KALDI_ERR << "--bucket-size=" << reader_opts.bucket_size
+                  << " is not a multiple of --num-streams=" << num_streams;
+      }
+    }
+
+    std::string feature_rspecifier = po.GetArg(1),
+      targets_rspecifier = po.GetArg(2),
+      model_filename = po.GetArg(3);
+
+    std::string target_model_filename;
+    if (!crossvalidate) {
+      target_model_filename = po.GetArg(4);
+    }
+
+    //Select the GPU
+#if HAVE_CUDA==1
+    CuDevice::Instantiate().SelectGpuId(use_gpu);
+    CuDevice::Instantiate().DisableCaching();
+#endif
+
+    Nnet nnet_transf;
+    if(feature_transform != "") {
+      nnet_transf.Read(feature_transform);
+    }
+
+    Nnet nnet;
+    nnet.Read(model_filename);
+    nnet.SetTrainOptions(trn_opts);
+
+    CTCLoss ctc_loss(blank_num);
+    ctc_loss.SetOptions(ctc_opts);
+
+    // the utterances of a minibatch, transformed on their own, stacked
+    // one after another and interleaved by a single row gather on the
+    // device
+    std::vector<CTCUtterance> utterances(num_streams);
+    std::vector<CuMatrix<BaseFloat> > feats_utt(num_streams);
+    std::vector<int32> seq_lengths, new_utt_flags;
+    std::vector<std::vector<int32> > targets;
+    std::vector<std::string> keys;
+    std::vector<MatrixIndexT> stream_rows_host;
+    CuArray<MatrixIndexT> stream_rows;
+    Vector<BaseFloat> frame_mask_host;
+    CuMatrix<BaseFloat> feats_stacked, feats, nnet_out, obj_diff;
+    CuVector<BaseFloat> frame_mask;
+    std::vector<CTCUtteranceResult> results;
+
+    Timer time;
+    KALDI_LOG << (crossvalidate?"CROSS-VALIDATION":"TRAINING") << " STARTED";
+
+    CTCUtteranceReader utterance_reader(feature_rspecifier,
+                                        targets_rspecifier, frame_weights,
+                                        reader_opts);
+    int32 num_done = 0, num_minibatches = 0;
+    kaldi::int64 total_frames = 0, total_padded_frames = 0;
+    bool end_of_input = false;
+    while (!end_of_input) {
+      // take the next num_streams utterances
+      int32 n = 0, max_frames = 0, num_frames = 0;
+      for (; n < num_streams; n++) {
+        if (!utterance_reader.Next(&utterances[n])) {
+          end_of_input = true;
+          break;
+        }
+        nnet_transf.Feedforward(CuMatrix<BaseFloat>(utterances[n].Features()),
+                                &feats_utt[n]);
+        max_frames = std::max(max_frames, feats_utt[n].NumRows());
+        num_frames += feats_utt[n].NumRows();
+      }
+      if (n == 0) break;
+
+      // stack the streams (the stack only grows), then gather the rows in
+      // interleaved order; -1 zeros a row of padding. The mask weighs the
+      // frames and zeros the padding
+      int32 dim = feats_utt[0].NumCols();
+      if (feats_stacked.NumRows() < num_frames ||
+          feats_stacked.NumCols() != dim) {
+        feats_stacked.Resize(num_frames, dim, kUndefined);
+      }
+      stream_rows_host.assign(max_frames * n, -1);
+      frame_mask_host.Resize(max_frames * n, kSetZero);
+      seq_lengths.resize(n);
+      targets.resize(n);
+      keys.resize(n);
+      for (int32 s = 0, offset = 0; s < n; offset += seq_lengths[s++]) {
+        const Vector<BaseFloat> &weights = utterances[s].weights;
+        seq_lengths[s] = feats_utt[s].NumRows();
+        targets[s].swap(utterances[s].targets);
+        keys[s] = utterances[s].key;
+        feats_stacked.RowRange(offset, seq_lengths[s]).CopyFromMat(
+            feats_utt[s]);
+        for (int32 t = 0; t < seq_lengths[s]; t++) {
+          stream_rows_host[t * n + s] = offset + t;
+          frame_mask_host(t * n + s) = weights(t);
+        }
+      }
+      stream_rows.CopyFromVec(stream_rows_host);
+      if (feats.NumRows() != max_frames * n || feats.NumCols() != dim) {
+        feats.Resize(max_frames * n, dim, kUndefined);
+      }
+      feats.CopyRows(feats_stacked, stream_rows);
+
+      // every stream starts a new utterance
+      new_utt_flags.assign(n, 1);
+      nnet.ResetLstmStreams(new_utt_flags);
+      nnet.SetSeqLengths(seq_lengths);
+
+      // forward pass
+      nnet.Propagate(feats, &nnet_out);
+      nnet_out.ApplyLog();
+
+      // evaluate objective function, per stream; cross-validation needs
+      // no errors, so it runs the forward recursion alone
+      ctc_loss.SetUtteranceKeys(keys);
+      if (crossvalidate) {
+        ctc_loss.ScoreStreams(nnet_out, seq_lengths, targets, &results);
+      } else {
+        ctc_loss.EvalStreams(nnet_out, seq_lengths, targets, &obj_diff,
+                             &results);
+      }
+
+      // backward pass
+      if (!crossvalidate) {
+        // re-scale the gradients, the padding has none
+        frame_mask.Resize(frame_mask_host.Dim(), kUndefined);
+        frame_mask.CopyFromVec(frame_mask_host);
+        obj_diff.MulRowsVec(frame_mask);
+        nnet.Backpropagate(obj_diff, NULL);
+      }
+
+      // 1st minibatch : show what happens in network
+      if (kaldi::g_kaldi_verbose_level >= 1 && total_frames == 0) { // vlog-1
+        KALDI_VLOG(1) << "### After " << total_frames << " frames,";
+        KALDI_VLOG(1) << nnet.InfoPropagate();
+        if (!crossvalidate) {
+          KALDI_VLOG(1) << nnet.InfoBackPropagate();
+          KALDI_VLOG(1) << nnet.InfoGradient();
+        }
+      }
+
+      // report the speed
+      if (kaldi::g_kaldi_verbose_level >= 2) { // vlog-2
+        if ((total_frames/25000) != ((total_frames+num_frames)/25000)) { // print every 25k frames
+          KALDI_VLOG(2) << "### After " << total_frames << " frames,";
+          KALDI_VLOG(2) << nnet.InfoPropagate();
+          if (!crossvalidate) {
+            KALDI_VLOG(2) << nnet.InfoGradient();
+          }
+        }
+      }
+      if ((num_done / 5000) != ((num_done + n) / 5000)) {
+        double time_now = time.Elapsed();
+        KALDI_VLOG(1) << "After " << num_done + n << " utterances: time elapsed = "
+                      << time_now/60 << " min; processed " << total_frames/time_now
+                      << " frames per second.";
+#if HAVE_CUDA==1
+        // check the GPU is not overheated
+        CuDevice::Instantiate().CheckGpuHealth();
+#endif
+      }
+      num_done += n;
+      num_minibatches++;
+      total_frames += num_frames;
+      total_padded_frames += max_frames * n - num_frames;
+    }
+
+    // after last minibatch : show what happens in network
+    if (kaldi::g_kaldi_verbose_level >= 1) { // vlog-1
+      KALDI_VLOG(1) << "### After " << total_frames << " frames,";
+      KALDI_VLOG(1) << nnet.InfoPropagate();
+      if (!crossvalidate) {
+        KALDI_VLOG(1) << nnet.InfoBackPropagate();
+        KALDI_VLOG(1) << nnet.InfoGradient();
+      }
+    }
+
+    if (!crossvalidate) {
+      nnet.Write(target_model_filename, binary);
+    }
+
+    KALDI_LOG << "Done " << num_done << " files, "
+              << utterance_reader.NumNoTargets() << " with no tgt_mats, "
+              << utterance_reader.NumOtherErrors()
+              << " with other errors. "
+              << "[" << (crossvalidate?"CROSS-VALIDATION":"TRAINING")
+              << ", " << num_minibatches << " minibatches of " << num_streams
+              << " streams, " << time.Elapsed()/60 << " min, fps" << total_frames/time.Elapsed()
+              << ", utt/s " << num_done/time.Elapsed()
+              << ", padding " << 100.0 * total_padded_frames /
+                 std::max<kaldi::int64>(total_frames + total_padded_frames, 1)
+              << "%]";
+
+    KALDI_LOG << ctc_loss.Report();
+    KALDI_LOG << utterance_reader.Report();
+
+#if HAVE_CUDA==1
+    CuDevice::Instantiate().PrintProfile();
+#endif
+
+    return 0;
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -3,6 +3,9 @@
 #include "nnet/nnet-trnopts.h"
 #include "nnet/nnet-nnet.h"
 #include "ctc/ctc-loss.h"
+#include "ctc/ctc-utterance-reader.h"
+#include "ctc/ctc-scoring-pipeline.h"
+#include "ctc/ctc-parallel-scorer.h"
 #include "nnet/nnet-randomizer.h"
 #include "base/kaldi-common.h"
 #include "util/common-utils.h"
@@ -22,7 +25,19 @@ int main(int argc, char *argv[]) {
         "\n"
         "Usage:  ctc-train-perutt [options] --blank-num=integer <feature-rspecifier> <targets-rspecifier> <model-in> [<model-out>]\n"
         "e.g.: \n"
-        " ctc-train-perutt --blank-num=0 scp:feature.scp ark:target.ark nnet.init nnet.iter1\n";
+        " ctc-train-perutt --blank-num=0 scp:feature.scp ark:target.ark nnet.init nnet.iter1\n"
+        "CMVN and deltas may be applied on the reader threads instead of a pipe:\n"
+        " ctc-train-perutt --blank-num=0 --cmvn-stats=scp:cmvn.scp --utt2spk=ark:utt2spk --norm-vars=true --delta-order=2 \\\n"
+        "   scp:feature.scp ark:target.ark nnet.init nnet.iter1\n"
+        "or read the final features from a cache of ctc-cache-feats, shuffled per epoch:\n"
+        " ctc-train-perutt --blank-num=0 --shuffle-seed=1 cache:train.cache ark:target.ark nnet.init nnet.iter1\n"
+        "and with the lengths of ctc-index-lengths, skip unusable utterances unread and bucket by length:\n"
+        " ctc-train-perutt --blank-num=0 --length-index=ark:lengths.ark --utterance-order=bucketed --shuffle-seed=1 \\\n"
+        "   cache:train.cache ark:target.ark nnet.init nnet.iter1\n"
+        "Cross-validation may score on a thread of its own while the next utterances are propagated:\n"
+        " ctc-train-perutt --blank-num=0 --cross-validate=true --pipeline-depth=4 cache:cv.cache ark:target.ark nnet.iter1\n"
+        "or, on CPU, propagate and score on several threads with copies of the network:\n"
+        " ctc-train-perutt --blank-num=0 --cross-validate=true --use-gpu=no --num-threads=8 cache:cv.cache ark:target.ark nnet.iter1\n";
 
     ParseOptions po(usage);
 
@@ -35,17 +50,32 @@ int main(int argc, char *argv[]) {
     int report_step = 100;
     po.Register("report-step", &report_step, "The steps that print report");
 
+    CTCLossOptions ctc_opts;
+    ctc_opts.Register(&po);
+
+    bool sparse_posteriors = false;
+    po.Register("sparse-posteriors", &sparse_posteriors, "Download only the blank and target columns of the network output and form the errors on the GPU");
+
+    bool logits = false;
+    po.Register("logits", &logits, "The network has no final softmax and outputs logits; the log-softmax and the errors with respect to the logits are formed inside the CTC loss");
+
     bool binary = true, 
          crossvalidate = false;
     po.Register("binary", &binary, "Write output in binary mode");
     po.Register("cross-validate", &crossvalidate, "Perform cross-validation (don't backpropagate)");
 
+    int32 pipeline_depth = 0;
+    po.Register("pipeline-depth", &pipeline_depth, "With --cross-validate, score the network outputs on a thread of their own, overlapping the forward pass of the next utterances; at most this many outputs wait for scoring (0 scores them in turn)");
+
+    int32 num_threads = 1;
+    po.Register("num-threads", &num_threads, "With --cross-validate, number of threads propagating and scoring utterances, each with its own copy of the network; CPU only");
+
     std::string feature_transform;
     po.Register("feature-transform", &feature_transform, "Feature transform in Nnet format");
 
-    int32 length_tolerance = 5;
-    po.Register("length-tolerance", &length_tolerance, "Allowed length difference of features/weights (frames)");
-    
+    CTCReaderOptions reader_opts;
+    reader_opts.Register(&po);
+
     std::string frame_weights;
     po.Register("frame-weights", &frame_weights, "Per-frame weights to scale gradients (frame selection/weighting).");
 
@@ -68,6 +98,20 @@ int main(int argc, char *argv[]) {
       exit(1);
     }
 
+    if (logits && sparse_posteriors) {
+      KALDI_ERR << "--logits and --sparse-posteriors cannot be combined";
+    }
+    if (pipeline_depth > 0 && !crossvalidate) {
+      // the next forward pass needs the update of this utterance
+      KALDI_ERR << "--pipeline-depth needs --cross-validate";
+    }
+    if (num_threads > 1 && !crossvalidate) {
+      KALDI_ERR << "--num-threads needs --cross-validate";
+    }
+    if (num_threads > 1 && pipeline_depth > 0) {
+      KALDI_ERR << "--num-threads and --pipeline-depth cannot be combined";
+    }
+
     std::string feature_rspecifier = po.GetArg(1),
       targets_rspecifier = po.GetArg(2),
       model_filename = po.GetArg(3);
@@ -85,6 +129,9 @@ int main(int argc, char *argv[]) {
 #if HAVE_CUDA==1
     CuDevice::Instantiate().SelectGpuId(use_gpu);
     CuDevice::Instantiate().DisableCaching();
+    if (num_threads > 1 && CuDevice::Instantiate().Enabled()) {
+      KALDI_ERR << "--num-threads is for CPU runs, use --use-gpu=no";
+    }
 #endif
 
     Nnet nnet_transf;
@@ -95,117 +142,116 @@ int main(int argc, char *argv[]) {
     Nnet nnet;
     nnet.Read(model_filename);
     nnet.SetTrainOptions(trn_opts);
+    if (logits && nnet.NumComponents() > 0 &&
+        nnet.GetComponent(nnet.NumComponents() - 1).GetType() ==
+        Component::kSoftmax) {
+      KALDI_ERR << "--logits expects a network without its final softmax, "
+                << "but " << model_filename << " ends with one";
+    }
 
     kaldi::int64 total_frames = 0;
 
-    SequentialBaseFloatMatrixReader feature_reader(feature_rspecifier);
-    RandomAccessInt32VectorReader targets_reader(targets_rspecifier);
-    RandomAccessBaseFloatVectorReader weights_reader;
-    if (frame_weights != "") {
-      weights_reader.Open(frame_weights);
-    }
-
     RandomizerMask randomizer_mask(rnd_opts);
     MatrixRandomizer feature_randomizer(rnd_opts);
     PosteriorRandomizer targets_randomizer(rnd_opts);
     VectorRandomizer weights_randomizer(rnd_opts);
 
     CTCLoss ctc_loss(blank_num);
+    ctc_loss.SetOptions(ctc_opts);
 
     CuMatrix<BaseFloat> feats, feats_transf, nnet_out, obj_diff;
+    CTCPosteriors posteriors;
+    CTCUtteranceResult result;
 
     Timer time;
     KALDI_LOG << (crossvalidate?"CROSS-VALIDATION":"TRAINING") << " STARTED";
 
-    int32 num_done = 0, num_no_tgt_mat = 0, num_other_error = 0;
-    for ( ; !feature_reader.Done(); feature_reader.Next()) {
-      std::string utt = feature_reader.Key();
-      KALDI_VLOG(3) << "Reading " << utt;
-      // check that we have targets
-      if (!targets_reader.HasKey(utt)) {
-        KALDI_WARN << utt << ", missing targets";
-        num_no_tgt_mat++;
-        continue;
-      }
-      // check we have per-frame weights
-      if (frame_weights != "" && !weights_reader.HasKey(utt)) {
-        KALDI_WARN << utt << ", missing per-frame weights";
-        num_other_error++;
-        feature_reader.Next();
-        continue;
-      }
-      // get feature / target pair
-      Matrix<BaseFloat> mat = feature_reader.Value();
-      const std::vector<int32> &targets = targets_reader.Value(utt);
-      // get per-frame weights
-      Vector<BaseFloat> weights;
-      if (frame_weights != "") {
-        weights = weights_reader.Value(utt);
-      } else { // all per-frame weights are 1.0
-        weights.Resize(mat.NumRows());
-        weights.Set(1.0);
-      }
-      // correct small length mismatch ... or drop sentence
-      {
-        // add lengths to vector
-        std::vector<int32> lenght;
-        lenght.push_back(mat.NumRows());
-        lenght.push_back(weights.Dim());
-        // find min, max
-        int32 min = *std::min_element(lenght.begin(),lenght.end());
-        int32 max = *std::max_element(lenght.begin(),lenght.end());
-        // fix or drop ?
-        if (max - min < length_tolerance) {
-          if(mat.NumRows() != min) mat.Resize(min, mat.NumCols(), kCopyData);
-          if(weights.Dim() != min) weights.Resize(min, kCopyData);
+    // utterances are read and checked on the reader threads, ahead of
+    // the training below
+    CTCUtteranceReader utterance_reader(feature_rspecifier,
+                                        targets_rspecifier, frame_weights,
+                                        reader_opts);
+    // in cross-validation the CTC evaluation may run behind the forward
+    // passes, on a thread of its own
+    CTCScoringPipeline *pipeline = NULL;
+    if (pipeline_depth > 0) {
+      pipeline = new CTCScoringPipeline(&ctc_loss, pipeline_depth, logits);
+    }
+    // or be spread over threads with copies of the network, the results
+    // added to ctc_loss in the order read
+    CTCParallelScorer *scorer = NULL;
+    if (num_threads > 1) {
+      scorer = new CTCParallelScorer(nnet_transf, nnet, blank_num, ctc_opts,
+                                     &ctc_loss, num_threads, logits);
+    }
+    CTCUtterance utterance;
+    int32 num_done = 0;
+    while (utterance_reader.Next(&utterance)) {
+      const std::string &utt = utterance.key;
+      // rows of the feature cache are not copied before the transform
+      const SubMatrix<BaseFloat> mat(utterance.Features());
+      const std::vector<int32> &targets = utterance.targets;
+      const Vector<BaseFloat> &weights = utterance.weights;
+      if (scorer != NULL) {
+        scorer->Submit(utt, mat, targets);
+      } else {
+        // apply optional feature transform
+        nnet_transf.Feedforward(CuMatrix<BaseFloat>(mat), &feats_transf);
+ 
+        // get block of feature/target pairs
+        //const Vector<BaseFloat>& frm_weights = weights_randomizer.Value();
+
+        // forward pass
+        nnet.Propagate(feats_transf, &nnet_out);
+      
+        // apply log, unless the CTC loss forms the log-softmax itself, or
+        // takes the log of the columns it downloads (sparse posteriors,
+        // whose errors are formed in place in the softmax output)
+        bool sparse = sparse_posteriors && !crossvalidate;
+        if (!logits && !sparse) nnet_out.ApplyLog();
+
+        if (pipeline != NULL) {
+          pipeline->Submit(utt, nnet_out, targets);
         } else {
-          KALDI_WARN << utt << ", length mismatch of weights " << weights.Dim()
-                     << " and features " << mat.NumRows();
-          num_other_error++;
-          continue;
-        }
-      }
-      // check features length is enough for targets or drop sentence
-      {
-        int total_time = mat.NumRows();
-        int required_time = targets.size();
-        int old_label = -1;
-        for (size_t i = 0; i != targets.size(); i++) {
-          if (old_label == targets[i]) {
-            required_time++;
+          // evaluate objective function
+          // the dense evaluations decode the best path from their host copy
+          // of the output, the others leave it to ErrorRate
+          ctc_loss.SetUtteranceKey(utt);
+          bool decoded = true;
+          if (logits && crossvalidate) {
+            // the log-softmax and the forward recursion, no errors
+            ctc_loss.ScoreLogits(nnet_out, targets, &result);
+          } else if (logits) {
+            // the errors are with respect to the logits
+            ctc_loss.EvalLogits(nnet_out, targets, &obj_diff, &result);
+          } else if (crossvalidate) {
+            // no errors to backpropagate, the forward recursion is enough
+            ctc_loss.Score(nnet_out, targets);
+            decoded = false;
+          } else if (sparse) {
+            // decoded before the output becomes the errors, softmax -
+            // posteriors; the swap hands its buffer to obj_diff, no copy
+            ctc_loss.EvalPosteriors(nnet_out, targets, &posteriors, false);
+            ctc_loss.ErrorRate(nnet_out, targets, &result.error_rate,
+                               &result.hyp);
+            ctc_loss.CombinePosteriors(posteriors, &nnet_out);
+            obj_diff.Swap(&nnet_out);
+          } else {
+            ctc_loss.Eval(nnet_out, targets, &obj_diff, &result);
+          }
+          if (!decoded) {
+            ctc_loss.ErrorRate(nnet_out, targets, &result.error_rate,
+                               &result.hyp);
           }
-          old_label = targets[i];
         }
-        if (total_time < required_time) {
-          KALDI_WARN << utt << ", required time > total time";
-          num_other_error++;
-          continue;
+        // backward pass
+        if (!crossvalidate) {
+          // re-scale the gradients
+          obj_diff.MulRowsVec(CuVector<BaseFloat>(weights));
+          // backpropagate
+          nnet.Backpropagate(obj_diff, NULL);
         }
       }
-      // apply optional feature transform
-      nnet_transf.Feedforward(CuMatrix<BaseFloat>(mat), &feats_transf);
- 
-      // get block of feature/target pairs
-      //const Vector<BaseFloat>& frm_weights = weights_randomizer.Value();
-
-      // forward pass
-      nnet.Propagate(feats_transf, &nnet_out);
-      
-      // apply log
-      nnet_out.ApplyLog();
-
-      // evaluate objective function
-      ctc_loss.Eval(nnet_out, targets, &obj_diff);
-      double err = 0.0;
-      std::vector<int32> hyp;
-      ctc_loss.ErrorRate(nnet_out, targets, &err, &hyp);
-      // backward pass
-      if (!crossvalidate) {
-        // re-scale the gradients
-        obj_diff.MulRowsVec(CuVector<BaseFloat>(weights));
-        // backpropagate
-        nnet.Backpropagate(obj_diff, NULL);
-      }
 
       // 1st minibatch : show what happens in network 
       if (kaldi::g_kaldi_verbose_level >= 1 && total_frames == 0) { // vlog-1
@@ -219,7 +265,7 @@ int main(int argc, char *argv[]) {
       
       // monitor the NN training
       if (kaldi::g_kaldi_verbose_level >= 2) { // vlog-2
-        if ((total_frames/25000) != ((total_frames+feats_transf.NumRows())/25000)) { // print every 25k frames
+        if ((total_frames/25000) != ((total_frames+mat.NumRows())/25000)) { // print every 25k frames
           KALDI_VLOG(2) << "### After " << total_frames << " frames,";
           KALDI_VLOG(2) << nnet.InfoPropagate();
           if (!crossvalidate) {
@@ -230,7 +276,7 @@ int main(int argc, char *argv[]) {
       
       // report the speed
       num_done++;
-      total_frames += feats_transf.NumRows();
+      total_frames += mat.NumRows();
       if (num_done % 5000 == 0) {
         double time_now = time.Elapsed();
         KALDI_VLOG(1) << "After " << num_done << " utterances: time elapsed = "
@@ -243,6 +289,9 @@ int main(int argc, char *argv[]) {
       }
     }
       
+    if (pipeline != NULL) pipeline->Finish();
+    if (scorer != NULL) scorer->Finish();
+
     // after last minibatch : show what happens in network 
     if (kaldi::g_kaldi_verbose_level >= 1) { // vlog-1
       KALDI_VLOG(1) << "### After " << total_frames << " frames,";
@@ -257,8 +306,9 @@ int main(int argc, char *argv[]) {
       nnet.Write(target_model_filename, binary);
     }
 
-    KALDI_LOG << "Done " << num_done << " files, " << num_no_tgt_mat
-              << " with no tgt_mats, " << num_other_error
+    KALDI_LOG << "Done " << num_done << " files, "
+              << utterance_reader.NumNoTargets() << " with no tgt_mats, "
+              << utterance_reader.NumOtherErrors()
               << " with other errors. "
               << "[" << (crossvalidate?"CROSS-VALIDATION":"TRAINING")
               << ", " << (randomize?"RANDOMIZED":"NOT-RANDOMIZED") 
@@ -266,6 +316,15 @@ int main(int argc, char *argv[]) {
               << "]";  
 
     KALDI_LOG << ctc_loss.Report();
+    KALDI_LOG << utterance_reader.Report();
+    if (pipeline != NULL) {
+      KALDI_LOG << pipeline->Report();
+      delete pipeline;
+    }
+    if (scorer != NULL) {
+      KALDI_LOG << scorer->Report();
+      delete scorer;
+    }
 
 #if HAVE_CUDA==1
     CuDevice::Instantiate().PrintProfile();
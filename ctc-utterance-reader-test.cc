@@ -0,0 +1,343 @@
+// ctc/ctc-utterance-reader-test.cc
+
+#include "ctc/ctc-utterance-reader.h"
+#include "ctc/ctc-loss.h"
+#include "base/kaldi-types.h"
+#include "util/common-utils.h"
+#include "feat/feature-functions.h"
+#include "transform/cmvn.h"
+
+#include <algorithm>
+#include <unistd.h>
+
+namespace kaldi {
+namespace nnet1 {
+
+  const char *kFeatsWspecifier = "ark:tmp-ctc-reader.feats.ark",
+      *kTargetsWspecifier = "ark:tmp-ctc-reader.targets.ark",
+      *kWeightsWspecifier = "ark:tmp-ctc-reader.weights.ark",
+      *kCmvnWspecifier = "ark:tmp-ctc-reader.cmvn.ark",
+      *kUtt2spkWspecifier = "ark:tmp-ctc-reader.utt2spk.ark",
+      *kLengthsWspecifier = "ark:tmp-ctc-reader.lengths.ark",
+      *kCacheFilename = "tmp-ctc-reader.cache";
+
+  /// Writes num_utts utterances, every fifth one broken in a different
+  /// way; returns the keys of the usable ones and the number dropped for
+  /// missing targets and for other reasons
+  void WriteReaderTables(int32 num_utts, std::vector<std::string> *usable,
+                         int32 *num_no_targets, int32 *num_other_errors) {
+    BaseFloatMatrixWriter feats_writer(kFeatsWspecifier);
+    Int32VectorWriter targets_writer(kTargetsWspecifier);
+    BaseFloatVectorWriter weights_writer(kWeightsWspecifier);
+    *num_no_targets = *num_other_errors = 0;
+    for (int32 n = 0; n < num_utts; n++) {
+      std::ostringstream key;
+      key << "utt" << n;
+      int32 num_frames = 20 + RandInt(0, 30);
+      Matrix<BaseFloat> feats(num_frames, 3);
+      feats.SetRandn();
+      feats(0, 0) = n;  // tells the utterances apart
+      std::vector<int32> targets(5, 1);
+      for (size_t l = 0; l < targets.size(); l++) targets[l] = l + 1;
+      Vector<BaseFloat> weights(num_frames + (n % 5 == 3 ? 2 : 0));
+      weights.Set(0.5);
+      switch (n % 5) {
+        case 1:  // no targets
+          (*num_no_targets)++;
+          break;
+        case 2:  // no weights
+          targets_writer.Write(key.str(), targets);
+          (*num_other_errors)++;
+          break;
+        case 4:  // weights too long to trim, or targets too long
+          if (n % 10 == 4) weights.Resize(num_frames + 9);
+          else targets.resize(2 * num_frames, 1);
+          (*num_other_errors)++;
+          // fall through
+        default:  // usable, utterances 3, 8, ... after trimming the weights
+          targets_writer.Write(key.str(), targets);
+          weights_writer.Write(key.str(), weights);
+          if (n % 5 != 4) usable->push_back(key.str());
+      }
+      feats_writer.Write(key.str(), feats);
+    }
+  }
+
+  void UnitTestCTCUtteranceReader() {
+    std::vector<std::string> usable;
+    int32 num_no_targets, num_other_errors;
+    WriteReaderTables(60, &usable, &num_no_targets, &num_other_errors);
+
+    // the order and the content do not depend on the threads
+    int32 threads[] = { 0, 1, 3, 4 }, depths[] = { 1, 1, 2, 16 };
+    for (int32 i = 0; i < 4; i++) {
+      CTCReaderOptions opts;
+      opts.num_threads = threads[i];
+      opts.queue_depth = depths[i];
+      CTCUtteranceReader reader(kFeatsWspecifier, kTargetsWspecifier,
+                                kWeightsWspecifier, opts);
+      CTCUtterance utt;
+      size_t num_read = 0;
+      while (reader.Next(&utt)) {
+        KALDI_ASSERT(num_read < usable.size() && utt.key == usable[num_read]);
+        KALDI_ASSERT(utt.feats.NumRows() == utt.weights.Dim() &&
+                     utt.feats.NumCols() == 3 && utt.targets.size() == 5);
+        KALDI_ASSERT(utt.feats(0, 0) == atoi(utt.key.c_str() + 3));
+        KALDI_ASSERT(utt.weights(0) == 0.5);
+        num_read++;
+      }
+      KALDI_ASSERT(num_read == usable.size());
+      KALDI_ASSERT(!reader.Next(&utt));
+      KALDI_ASSERT(reader.NumNoTargets() == num_no_targets &&
+                   reader.NumOtherErrors() == num_other_errors);
+      KALDI_ASSERT(reader.ConsumerStallSeconds() >= 0.0 &&
+                   reader.ProducerStallSeconds() >= 0.0);
+      KALDI_LOG << reader.Report();
+    }
+
+    // without weights every frame weighs 1
+    CTCReaderOptions opts;
+    CTCUtteranceReader reader(kFeatsWspecifier, kTargetsWspecifier, "",
+                              opts);
+    CTCUtterance utt;
+    KALDI_ASSERT(reader.Next(&utt) && utt.key == "utt0" &&
+                 utt.weights.Dim() == utt.feats.NumRows() &&
+                 utt.weights.Sum() == utt.feats.NumRows());
+  }
+
+  void UnitTestCTCUtteranceReaderFeatures() {
+    std::vector<std::string> usable;
+    int32 num_no_targets, num_other_errors;
+    WriteReaderTables(30, &usable, &num_no_targets, &num_other_errors);
+    // three speakers with stats over their utterances; speaker 2 has none
+    std::vector<Matrix<double> > stats(3, Matrix<double>(2, 4));
+    {
+      SequentialBaseFloatMatrixReader feats_reader(kFeatsWspecifier);
+      TokenWriter utt2spk_writer(kUtt2spkWspecifier);
+      for (int32 n = 0; !feats_reader.Done(); feats_reader.Next(), n++) {
+        std::ostringstream spk;
+        spk << "spk" << n % 3;
+        utt2spk_writer.Write(feats_reader.Key(), spk.str());
+        const Matrix<BaseFloat> &feats = feats_reader.Value();
+        for (int32 t = 0; t < feats.NumRows(); t++) {
+          for (int32 d = 0; d < 3; d++) {
+            stats[n % 3](0, d) += feats(t, d);
+            stats[n % 3](1, d) += feats(t, d) * feats(t, d);
+          }
+          stats[n % 3](0, 3) += 1.0;
+        }
+      }
+      DoubleMatrixWriter cmvn_writer(kCmvnWspecifier);
+      cmvn_writer.Write("spk0", stats[0]);
+      cmvn_writer.Write("spk1", stats[1]);
+    }
+
+    CTCReaderOptions opts;
+    opts.num_threads = 2;
+    opts.features.cmvn_rspecifier = kCmvnWspecifier;
+    opts.features.utt2spk_rspecifier = kUtt2spkWspecifier;
+    opts.features.norm_vars = true;
+    opts.features.delta_order = 2;
+    CTCUtteranceReader reader(kFeatsWspecifier, kTargetsWspecifier,
+                              kWeightsWspecifier, opts);
+    RandomAccessBaseFloatMatrixReader feats_reader(kFeatsWspecifier);
+    CTCUtterance utt;
+    int32 num_read = 0;
+    while (reader.Next(&utt)) {
+      int32 n = atoi(utt.key.c_str() + 3);
+      KALDI_ASSERT(n % 3 != 2);
+      // what apply-cmvn | add-deltas gives
+      Matrix<BaseFloat> feats(feats_reader.Value(utt.key)), deltas;
+      ApplyCmvn(stats[n % 3], true, &feats);
+      ComputeDeltas(DeltaFeaturesOptions(2, 2), feats, &deltas);
+      KALDI_ASSERT(utt.feats.NumCols() == 9 &&
+                   utt.feats.NumRows() == utt.weights.Dim());
+      AssertEqual(utt.feats, deltas.RowRange(0, utt.feats.NumRows()), 1e-5);
+      num_read++;
+    }
+    // the usable utterances of speaker 2 lack their stats
+    int32 num_spk2 = 0;
+    for (size_t i = 0; i < usable.size(); i++) {
+      num_spk2 += (atoi(usable[i].c_str() + 3) % 3 == 2);
+    }
+    KALDI_ASSERT(num_read + num_spk2 == usable.size() && num_spk2 > 0 &&
+                 reader.NumOtherErrors() == num_other_errors + num_spk2);
+  }
+
+  void UnitTestCTCUtteranceReaderCache() {
+    std::vector<std::string> usable;
+    int32 num_no_targets, num_other_errors;
+    WriteReaderTables(40, &usable, &num_no_targets, &num_other_errors);
+    {
+      SequentialBaseFloatMatrixReader feats_reader(kFeatsWspecifier);
+      CTCFeatureCacheWriter writer;
+      writer.Open(kCacheFilename);
+      for (; !feats_reader.Done(); feats_reader.Next()) {
+        writer.Write(feats_reader.Key(), feats_reader.Value());
+      }
+      writer.Close();
+    }
+    std::string cache_rspecifier = std::string("cache:") + kCacheFilename;
+
+    // in the order of the cache, the same utterances as from the table
+    for (int32 threads = 0; threads <= 2; threads++) {
+      CTCReaderOptions opts;
+      opts.num_threads = threads;
+      CTCUtteranceReader table_reader(kFeatsWspecifier, kTargetsWspecifier,
+                                      kWeightsWspecifier, opts),
+          cache_reader(cache_rspecifier, kTargetsWspecifier,
+                       kWeightsWspecifier, opts);
+      CTCUtterance table_utt, cache_utt;
+      size_t num_read = 0;
+      while (table_reader.Next(&table_utt)) {
+        KALDI_ASSERT(cache_reader.Next(&cache_utt) &&
+                     cache_utt.key == table_utt.key &&
+                     cache_utt.cached_feats != NULL &&
+                     cache_utt.feats.NumRows() == 0);
+        // trimmed in place
+        SubMatrix<BaseFloat> feats(cache_utt.Features());
+        KALDI_ASSERT(feats.NumRows() == cache_utt.weights.Dim());
+        AssertEqual(feats, table_utt.Features(), 0.0);
+        num_read++;
+      }
+      KALDI_ASSERT(!cache_reader.Next(&cache_utt) && num_read == usable.size());
+      KALDI_ASSERT(cache_reader.NumNoTargets() == num_no_targets &&
+                   cache_reader.NumOtherErrors() == num_other_errors);
+    }
+
+    // shuffled through the index: a permutation, the same for a seed
+    std::vector<std::string> keys[2];
+    for (int32 i = 0; i < 2; i++) {
+      CTCReaderOptions opts;
+      opts.num_threads = 2;
+      opts.shuffle_seed = 3;
+      CTCUtteranceReader reader(cache_rspecifier, kTargetsWspecifier,
+                                kWeightsWspecifier, opts);
+      CTCUtterance utt;
+      while (reader.Next(&utt)) {
+        KALDI_ASSERT(utt.Features()(0, 0) == atoi(utt.key.c_str() + 3));
+        keys[i].push_back(utt.key);
+      }
+    }
+    KALDI_ASSERT(keys[0] == keys[1] && keys[0] != usable);
+    std::sort(keys[0].begin(), keys[0].end());
+    std::sort(usable.begin(), usable.end());
+    KALDI_ASSERT(keys[0] == usable);
+  }
+
+  void UnitTestCTCUtteranceReaderLengthIndex() {
+    std::vector<std::string> usable;
+    int32 num_no_targets, num_other_errors;
+    WriteReaderTables(50, &usable, &num_no_targets, &num_other_errors);
+    // what ctc-index-lengths writes, and a cache to read by key
+    int32 num_infeasible = 0;
+    {
+      SequentialBaseFloatMatrixReader feats_reader(kFeatsWspecifier);
+      RandomAccessInt32VectorReader targets_reader(kTargetsWspecifier);
+      Int32VectorWriter index_writer(kLengthsWspecifier);
+      CTCFeatureCacheWriter cache_writer;
+      cache_writer.Open(kCacheFilename);
+      for (; !feats_reader.Done(); feats_reader.Next()) {
+        std::string key = feats_reader.Key();
+        cache_writer.Write(key, feats_reader.Value());
+        if (!targets_reader.HasKey(key)) continue;
+        CTCUtteranceLength length;
+        length.num_frames = feats_reader.Value().NumRows();
+        length.num_targets = targets_reader.Value(key).size();
+        length.required_time =
+            CTCLoss::required_time(targets_reader.Value(key));
+        num_infeasible += !length.Feasible();
+        CTCLengthIndex::Write(key, length, &index_writer);
+      }
+      cache_writer.Close();
+    }
+    KALDI_ASSERT(num_infeasible > 0);
+
+    // the order of the rspecifier: the same utterances, the infeasible
+    // ones dropped before their features are read
+    {
+      CTCReaderOptions opts;
+      opts.length_index_rspecifier = kLengthsWspecifier;
+      CTCUtteranceReader reader(kFeatsWspecifier, kTargetsWspecifier,
+                                kWeightsWspecifier, opts);
+      CTCUtterance utt;
+      size_t num_read = 0;
+      while (reader.Next(&utt)) {
+        KALDI_ASSERT(num_read < usable.size() && utt.key == usable[num_read]);
+        num_read++;
+      }
+      KALDI_ASSERT(num_read == usable.size() &&
+                   reader.NumNoTargets() == num_no_targets &&
+                   reader.NumOtherErrors() == num_other_errors &&
+                   reader.NumUnread() == num_infeasible);
+    }
+
+    // by key, from the table or the cache, in every order of the index
+    std::vector<std::string> sorted_usable(usable);
+    std::sort(sorted_usable.begin(), sorted_usable.end());
+    const char *orders[] = { "index", "sorted", "bucketed" };
+    for (int32 o = 0; o < 3; o++) {
+      for (int32 cache = 0; cache < 2; cache++) {
+        CTCReaderOptions opts;
+        opts.num_threads = 2;
+        opts.length_index_rspecifier = kLengthsWspecifier;
+        opts.utterance_order = orders[o];
+        opts.bucket_size = 4;
+        opts.shuffle_seed = 11;
+        CTCUtteranceReader reader(
+            cache ? std::string("cache:") + kCacheFilename : kFeatsWspecifier,
+            kTargetsWspecifier, kWeightsWspecifier, opts);
+        CTCUtterance utt;
+        std::vector<std::string> keys;
+        int32 last_frames = 0;
+        while (reader.Next(&utt)) {
+          KALDI_ASSERT(utt.Features()(0, 0) == atoi(utt.key.c_str() + 3) &&
+                       (utt.cached_feats != NULL) == (cache == 1));
+          if (o == 1) KALDI_ASSERT(utt.NumFrames() >= last_frames);
+          last_frames = utt.NumFrames();
+          keys.push_back(utt.key);
+        }
+        std::sort(keys.begin(), keys.end());
+        KALDI_ASSERT(keys == sorted_usable);
+        KALDI_ASSERT(reader.NumUnread() == 0);
+      }
+    }
+  }
+
+  void UnitTestCTCUtteranceReaderStop() {
+    // readers blocked on a full queue are stopped by the destructor
+    for (int32 depth = 1; depth <= 3; depth++) {
+      CTCReaderOptions opts;
+      opts.num_threads = 2;
+      opts.queue_depth = depth;
+      CTCUtteranceReader reader(kFeatsWspecifier, kTargetsWspecifier,
+                                kWeightsWspecifier, opts);
+      CTCUtterance utt;
+      KALDI_ASSERT(reader.Next(&utt) && utt.key == "utt0");
+    }
+  }
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main()
+{
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  // unit-tests:
+  UnitTestCTCUtteranceReader();
+  UnitTestCTCUtteranceReaderFeatures();
+  UnitTestCTCUtteranceReaderCache();
+  UnitTestCTCUtteranceReaderLengthIndex();
+  UnitTestCTCUtteranceReaderStop();
+  unlink(kCacheFilename);
+  unlink("tmp-ctc-reader.feats.ark");
+  unlink("tmp-ctc-reader.cmvn.ark");
+  unlink("tmp-ctc-reader.utt2spk.ark");
+  unlink("tmp-ctc-reader.targets.ark");
+  unlink("tmp-ctc-reader.weights.ark");
+  unlink("tmp-ctc-reader.lengths.ark");
+
+  KALDI_LOG << "Tests succeeded.";
+  return 0;
+}
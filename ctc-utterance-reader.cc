@@ -0,0 +1,364 @@
+// ctc/ctc-utterance-reader.cc
+
+#include "ctc/ctc-utterance-reader.h"
+#include "ctc/ctc-loss.h"
+#include "feat/feature-functions.h"
+#include "transform/cmvn.h"
+#include <iomanip>
+
+namespace kaldi {
+namespace nnet1 {
+
+void TransformCTCFeatures(const CTCFeatureOptions &opts,
+                          const MatrixBase<double> *cmvn_stats,
+                          Matrix<BaseFloat> *feats,
+                          Matrix<BaseFloat> *scratch)
+{
+  if (cmvn_stats != NULL) ApplyCmvn(*cmvn_stats, opts.norm_vars, feats);
+  if (opts.delta_order > 0) {
+    DeltaFeaturesOptions delta_opts(opts.delta_order, opts.delta_window);
+    ComputeDeltas(delta_opts, *feats, scratch);
+    feats->Swap(scratch);
+  }
+}
+
+SubMatrix<BaseFloat> CTCUtterance::Features() const
+{
+  if (cached_feats == NULL) {
+    return SubMatrix<BaseFloat>(const_cast<BaseFloat*>(feats.Data()),
+                                feats.NumRows(), feats.NumCols(),
+                                feats.Stride());
+  }
+  return SubMatrix<BaseFloat>(const_cast<BaseFloat*>(cached_feats),
+                              num_cached_frames, cached_dim, cached_dim);
+}
+
+class CTCUtteranceReader::ReaderTask: public MultiThreadable {
+ public:
+  explicit ReaderTask(CTCUtteranceReader *reader): reader_(reader) { }
+  void operator() () { reader_->read_loop(); }
+ private:
+  CTCUtteranceReader *reader_;
+};
+
+CTCUtteranceReader::CTCUtteranceReader(const std::string &feature_rspecifier,
+                                       const std::string &targets_rspecifier,
+                                       const std::string &weights_rspecifier,
+                                       const CTCReaderOptions &opts)
+  : opts_(opts), targets_reader_(targets_rspecifier),
+    have_weights_(weights_rspecifier != ""),
+    have_cmvn_(opts.features.cmvn_rspecifier != ""),
+    have_length_index_(opts.length_index_rspecifier != ""), keyed_(false),
+    next_read_(0), end_of_input_(false), next_consumed_(0), num_read_(0),
+    finished_(false), stop_(false), producer_stall_seconds_(0.0),
+    free_slots_(opts.queue_depth), published_(0),
+    consumer_stall_seconds_(0.0), num_no_targets_(0), num_other_errors_(0),
+    num_unread_(0), threader_(NULL)
+{
+  KALDI_ASSERT(opts.num_threads >= 0 && opts.queue_depth > 0);
+  KALDI_ASSERT(opts.features.delta_order >= 0 &&
+               opts.features.delta_window > 0);
+  if (feature_rspecifier.compare(0, 6, "cache:") == 0) {
+    if (!opts.features.Identity()) {
+      KALDI_ERR << "The features of " << feature_rspecifier << " are final, "
+                << "CMVN and deltas are applied by ctc-cache-feats";
+    }
+    cache_.Open(feature_rspecifier.substr(6));
+  }
+  if (have_length_index_) length_index_.Read(opts.length_index_rspecifier);
+  if (opts.utterance_order != "") {
+    if (!have_length_index_) {
+      KALDI_ERR << "--utterance-order needs a --length-index";
+    }
+    length_index_.Order(opts.utterance_order, opts.bucket_size,
+                        opts.shuffle_seed, &order_);
+    keyed_ = true;
+    if (!cache_.IsOpen()) keyed_feature_reader_.Open(feature_rspecifier);
+    if (opts.shuffle_seed >= 0 && opts.utterance_order == "sorted") {
+      KALDI_WARN << "--shuffle-seed has no effect on sorted utterances";
+    }
+  } else if (cache_.IsOpen()) {
+    // the cache is visited through its index, never rewritten
+    std::vector<int32> positions;
+    cache_.Order(opts.shuffle_seed, &positions);
+    order_.resize(positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+      order_[i] = cache_.Key(positions[i]);
+    }
+    keyed_ = true;
+  } else {
+    feature_reader_.Open(feature_rspecifier);
+    if (opts.shuffle_seed >= 0) {
+      KALDI_WARN << "--shuffle-seed has no effect on " << feature_rspecifier
+                 << " without --utterance-order";
+    }
+  }
+  if (have_weights_) weights_reader_.Open(weights_rspecifier);
+  if (have_cmvn_) {
+    cmvn_reader_.Open(opts.features.cmvn_rspecifier,
+                      opts.features.utt2spk_rspecifier);
+  } else if (opts.features.utt2spk_rspecifier != "") {
+    KALDI_WARN << "--utt2spk has no effect without --cmvn-stats";
+  }
+  if (opts_.num_threads > 0) {
+    threader_ = new MultiThreader<ReaderTask>(opts_.num_threads,
+                                              ReaderTask(this));
+  }
+}
+
+CTCUtteranceReader::~CTCUtteranceReader()
+{
+  if (threader_ == NULL) return;
+  queue_lock_.Lock();
+  stop_ = true;
+  queue_lock_.Unlock();
+  // every reader waits at most once more before it sees stop_
+  for (int32 n = 0; n < opts_.num_threads; n++) free_slots_.Signal();
+  delete threader_;  // joins the threads
+  for (std::map<int64, Slot*>::iterator it = ready_.begin();
+       it != ready_.end(); ++it) {
+    delete it->second;
+  }
+}
+
+bool CTCUtteranceReader::Next(CTCUtterance *utt)
+{
+  while (true) {
+    Slot *slot = NULL;
+    Timer timer;
+    if (threader_ == NULL) {
+      // all the reading stalls training
+      slot = &sync_slot_;
+      bool done = read_utterance(slot) < 0;
+      if (!done) prepare_utterance(slot);
+      consumer_stall_seconds_ += timer.Elapsed();
+      if (done) return false;
+    } else {
+      queue_lock_.Lock();
+      while (true) {
+        if (!thread_error_.empty()) {
+          std::string error = thread_error_;
+          queue_lock_.Unlock();
+          KALDI_ERR << "Reading utterances failed: " << error;
+        }
+        std::map<int64, Slot*>::iterator it = ready_.find(next_consumed_);
+        if (it != ready_.end()) {
+          slot = it->second;
+          ready_.erase(it);
+          next_consumed_++;
+          break;
+        }
+        if (finished_ && next_consumed_ >= num_read_) break;
+        queue_lock_.Unlock();
+        published_.Wait();
+        queue_lock_.Lock();
+      }
+      queue_lock_.Unlock();
+      consumer_stall_seconds_ += timer.Elapsed();
+      if (slot == NULL) return false;
+    }
+
+    bool usable = slot->error.empty();
+    if (usable) {
+      utt->key.swap(slot->utt.key);
+      utt->feats.Swap(&slot->utt.feats);
+      utt->cached_feats = slot->utt.cached_feats;
+      utt->num_cached_frames = slot->utt.num_cached_frames;
+      utt->cached_dim = slot->utt.cached_dim;
+      utt->targets.swap(slot->utt.targets);
+      utt->weights.Swap(&slot->utt.weights);
+    } else {
+      // warned about here, so the log follows the order of the rspecifier
+      KALDI_WARN << slot->utt.key << ", " << slot->error;
+      if (slot->no_targets) {
+        num_no_targets_++;
+      } else {
+        num_other_errors_++;
+        if (slot->unread) num_unread_++;
+      }
+    }
+    if (threader_ != NULL) {
+      delete slot;
+      free_slots_.Signal();
+    }
+    if (usable) return true;
+  }
+}
+
+void CTCUtteranceReader::read_loop()
+{
+  try {
+    while (true) {
+      Timer timer;
+      free_slots_.Wait();
+      queue_lock_.Lock();
+      producer_stall_seconds_ += timer.Elapsed();
+      bool stop = stop_;
+      queue_lock_.Unlock();
+      if (stop) return;
+
+      Slot *slot = new Slot;
+      int64 seq = read_utterance(slot);
+      if (seq < 0) {
+        delete slot;
+        // give the slot back, so the other readers find the end as well
+        free_slots_.Signal();
+        queue_lock_.Lock();
+        finished_ = true;
+        num_read_ = next_read_;
+        queue_lock_.Unlock();
+        published_.Signal();
+        return;
+      }
+      prepare_utterance(slot);
+      publish(seq, slot);
+    }
+  } catch(const std::exception &e) {
+    queue_lock_.Lock();
+    if (thread_error_.empty()) thread_error_ = e.what();
+    queue_lock_.Unlock();
+    published_.Signal();
+  }
+}
+
+int64 CTCUtteranceReader::read_utterance(Slot *slot)
+{
+  table_lock_.Lock();
+  try {
+    if (end_of_input_ || (keyed_ ?
+                          next_read_ >= static_cast<int64>(order_.size()) :
+                          feature_reader_.Done())) {
+      end_of_input_ = true;
+      table_lock_.Unlock();
+      return -1;
+    }
+    int64 seq = next_read_++;
+    CTCUtterance &utt = slot->utt;
+    utt.key = keyed_ ? order_[seq] : feature_reader_.Key();
+    utt.cached_feats = NULL;
+    KALDI_VLOG(3) << "Reading " << utt.key;
+    slot->no_targets = false;
+    slot->unread = false;
+    slot->error.clear();
+    const CTCUtteranceLength *length =
+        have_length_index_ ? length_index_.Find(utt.key) : NULL;
+    int32 position = cache_.IsOpen() ? cache_.Find(utt.key) : -1;
+    // check that we have targets and per-frame weights, and that the
+    // utterance is long enough, before the features are read
+    if (!targets_reader_.HasKey(utt.key)) {
+      slot->no_targets = true;
+      slot->error = "missing targets";
+    } else if (have_weights_ && !weights_reader_.HasKey(utt.key)) {
+      slot->error = "missing per-frame weights";
+    } else if (length != NULL && !length->Feasible()) {
+      slot->unread = true;
+      slot->error = "required time > total time";
+    } else if (have_cmvn_ && !cmvn_reader_.HasKey(utt.key)) {
+      slot->error = "missing CMVN stats";
+    } else if (keyed_ && (cache_.IsOpen() ? position < 0 :
+                          !keyed_feature_reader_.HasKey(utt.key))) {
+      slot->error = "missing features";
+    } else {
+      if (cache_.IsOpen()) {
+        // the pages are read while the utterance waits in the queue
+        cache_.Prefetch(position);
+        SubMatrix<BaseFloat> feats(cache_.Features(position));
+        utt.cached_feats = feats.Data();
+        utt.num_cached_frames = feats.NumRows();
+        utt.cached_dim = feats.NumCols();
+      } else if (keyed_) {
+        utt.feats = keyed_feature_reader_.Value(utt.key);
+      } else {
+        utt.feats.Swap(&feature_reader_.Value());
+      }
+      utt.targets = targets_reader_.Value(utt.key);
+      if (have_weights_) utt.weights = weights_reader_.Value(utt.key);
+      if (have_cmvn_) slot->cmvn_stats = cmvn_reader_.Value(utt.key);
+    }
+    if (!keyed_) feature_reader_.Next();
+    table_lock_.Unlock();
+    return seq;
+  } catch(...) {
+    table_lock_.Unlock();
+    throw;
+  }
+}
+
+void CTCUtteranceReader::prepare_utterance(Slot *slot) const
+{
+  if (!slot->error.empty()) return;
+  CTCUtterance &utt = slot->utt;
+  if (!have_weights_) {  // all per-frame weights are 1.0
+    utt.weights.Resize(utt.NumFrames(), kUndefined);
+    utt.weights.Set(1.0);
+  }
+  // correct small length mismatch ... or drop sentence
+  int32 min = std::min(utt.NumFrames(), utt.weights.Dim()),
+      max = std::max(utt.NumFrames(), utt.weights.Dim());
+  if (max - min >= opts_.length_tolerance) {
+    std::ostringstream oss;
+    oss << "length mismatch of weights " << utt.weights.Dim()
+        << " and features " << utt.NumFrames();
+    slot->error = oss.str();
+    return;
+  }
+  if (utt.cached_feats != NULL) {
+    // the view of the cache is trimmed without a copy
+    utt.num_cached_frames = min;
+  } else {
+    // the features are transformed before they are trimmed, as they were
+    // by the pipe in front of the trainer
+    TransformCTCFeatures(opts_.features,
+                         have_cmvn_ ? &slot->cmvn_stats : NULL,
+                         &utt.feats, &slot->deltas);
+    if (utt.feats.NumRows() != min) {
+      utt.feats.Resize(min, utt.feats.NumCols(), kCopyData);
+    }
+  }
+  if (utt.weights.Dim() != min) utt.weights.Resize(min, kCopyData);
+  // check features length is enough for targets or drop sentence
+  if (utt.NumFrames() < CTCLoss::required_time(utt.targets)) {
+    slot->error = "required time > total time";
+  }
+}
+
+void CTCUtteranceReader::publish(int64 seq, Slot *slot)
+{
+  queue_lock_.Lock();
+  ready_[seq] = slot;
+  queue_lock_.Unlock();
+  published_.Signal();
+}
+
+double CTCUtteranceReader::ProducerStallSeconds() const
+{
+  queue_lock_.Lock();
+  double seconds = producer_stall_seconds_;
+  queue_lock_.Unlock();
+  return seconds;
+}
+
+std::string CTCUtteranceReader::Report() const
+{
+  std::ostringstream oss;
+  double elapsed = timer_.Elapsed();
+  oss << "Utterance reader" << (cache_.IsOpen() ? " of a feature cache" : "")
+      << ", " << opts_.num_threads << " threads, queue depth "
+      << opts_.queue_depth << ": training waited " << std::fixed
+      << std::setprecision(2) << consumer_stall_seconds_ << " s for input ("
+      << std::setprecision(1)
+      << 100.0 * consumer_stall_seconds_ / std::max(elapsed, 1.0e-9)
+      << "% of " << std::setprecision(2) << elapsed << " s)";
+  if (threader_ != NULL) {
+    oss << ", the readers waited " << ProducerStallSeconds()
+        << " s for room in the queue";
+  }
+  if (have_length_index_) {
+    oss << "; " << num_unread_ << " utterances too short for their targets "
+        << "were dropped without reading their features";
+  }
+  return oss.str();
+}
+
+} // namespace nnet1
+} // namespace kaldi
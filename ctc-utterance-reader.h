@@ -0,0 +1,238 @@
+// ctc/ctc-utterance-reader.h
+
+#ifndef KALDI_CTC_CTC_UTTERANCE_READER_H_
+#define KALDI_CTC_CTC_UTTERANCE_READER_H_
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "base/timer.h"
+#include "itf/options-itf.h"
+#include "thread/kaldi-thread.h"
+#include "thread/kaldi-mutex.h"
+#include "thread/kaldi-semaphore.h"
+#include "ctc/ctc-feature-cache.h"
+#include "ctc/ctc-length-index.h"
+#include <map>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// The transforms of the features the reader applies, as an
+/// apply-cmvn | add-deltas pipe would
+struct CTCFeatureOptions {
+  std::string cmvn_rspecifier;    // CMVN stats per speaker (or utterance)
+  std::string utt2spk_rspecifier; // maps utterances to the stats' keys
+  bool norm_vars;             // normalize variances as well as means
+  int32 delta_order;          // 0 appends no deltas
+  int32 delta_window;
+
+  CTCFeatureOptions(): norm_vars(false), delta_order(0), delta_window(2) { }
+
+  /// True if the features are used as read
+  bool Identity() const { return cmvn_rspecifier == "" && delta_order == 0; }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("cmvn-stats", &cmvn_rspecifier,
+                   "If set, rspecifier of CMVN stats applied to the features "
+                   "on the reader threads, as apply-cmvn would");
+    opts->Register("utt2spk", &utt2spk_rspecifier,
+                   "rspecifier of the utterance to speaker map of "
+                   "--cmvn-stats; without it the stats are per utterance");
+    opts->Register("norm-vars", &norm_vars,
+                   "If true, CMVN normalizes variances as well as means");
+    opts->Register("delta-order", &delta_order,
+                   "Order of the deltas appended to the (normalized) "
+                   "features on the reader threads, as add-deltas would; "
+                   "0 appends none");
+    opts->Register("delta-window", &delta_window,
+                   "Half-width of the window of the deltas");
+  }
+};
+
+/// Applies CMVN with cmvn_stats (if not NULL) and the deltas of opts to
+/// feats; scratch holds the deltas while they are computed
+void TransformCTCFeatures(const CTCFeatureOptions &opts,
+                          const MatrixBase<double> *cmvn_stats,
+                          Matrix<BaseFloat> *feats,
+                          Matrix<BaseFloat> *scratch);
+
+struct CTCReaderOptions {
+  int32 num_threads;          // reader threads, 0 reads on the caller
+  int32 queue_depth;          // utterances read ahead of the trainer
+  int32 length_tolerance;     // frames features and weights may differ by
+  std::string length_index_rspecifier;  // lengths of ctc-index-lengths
+  std::string utterance_order;  // empty keeps the feature rspecifier's
+  int32 bucket_size;          // utterances per bucket of "bucketed"
+  int32 shuffle_seed;         // -1 keeps the order
+  CTCFeatureOptions features;
+
+  CTCReaderOptions(): num_threads(1), queue_depth(4), length_tolerance(5),
+                      bucket_size(64), shuffle_seed(-1) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("reader-threads", &num_threads,
+                   "Threads reading and checking utterances ahead of the "
+                   "training loop; 0 reads them on the training thread");
+    opts->Register("reader-queue-depth", &queue_depth,
+                   "Number of utterances the reader threads may prepare "
+                   "ahead of the training loop");
+    opts->Register("length-tolerance", &length_tolerance,
+                   "Allowed length difference of features/weights (frames)");
+    opts->Register("length-index", &length_index_rspecifier,
+                   "If set, rspecifier of the utterance lengths written by "
+                   "ctc-index-lengths; utterances too short for their "
+                   "targets are dropped before their features are read");
+    opts->Register("utterance-order", &utterance_order,
+                   "With --length-index, visit the utterances of the index "
+                   "in this order instead of the feature rspecifier's: "
+                   "index, sorted (by length) or bucketed (buckets of "
+                   "similar length, shuffled with --shuffle-seed); the "
+                   "features are read by key then, from an scp or cache");
+    opts->Register("bucket-size", &bucket_size,
+                   "Utterances per bucket of --utterance-order=bucketed");
+    opts->Register("shuffle-seed", &shuffle_seed,
+                   "Visit the utterances of a cache: feature rspecifier, or "
+                   "of --utterance-order=index|bucketed, in an order "
+                   "shuffled with this seed (e.g. the epoch); -1 keeps the "
+                   "order");
+    features.Register(opts);
+  }
+};
+
+/// A training utterance whose lengths have been checked: weights has a
+/// weight per frame of the features, and they are long enough for targets.
+/// The features are either in feats, or rows of a feature cache that are
+/// used in place (cached_feats); Features() gives either.
+struct CTCUtterance {
+  std::string key;
+  Matrix<BaseFloat> feats;
+  std::vector<int32> targets;
+  Vector<BaseFloat> weights;
+  const BaseFloat *cached_feats;  // NULL unless read from a cache
+  int32 num_cached_frames;
+  int32 cached_dim;
+
+  CTCUtterance(): cached_feats(NULL), num_cached_frames(0), cached_dim(0) { }
+
+  int32 NumFrames() const {
+    return cached_feats != NULL ? num_cached_frames : feats.NumRows();
+  }
+  /// The features; those of a cache are read-only
+  SubMatrix<BaseFloat> Features() const;
+};
+
+/// Reads (features, targets, weights) of the utterances of a feature
+/// rspecifier in its order, drops those with missing targets or weights
+/// or unusable lengths, and trims small length mismatches. The features
+/// are normalized with CMVN stats and extended by deltas if the options
+/// ask for it, replacing an apply-cmvn | add-deltas pipe. A feature
+/// rspecifier "cache:<file>" reads a feature cache of ctc-cache-feats
+/// instead: its features are final and used in place, and its index may
+/// be shuffled (opts.shuffle_seed). With a length index, utterances that
+/// cannot be aligned are dropped before their features are read, and the
+/// utterances may be visited ordered by length (opts.utterance_order). With
+/// opts.num_threads > 0 the reading and checking run on background threads
+/// that keep up to opts.queue_depth utterances ready; Next() still returns
+/// them in the order of the rspecifier, so training is reproducible.
+class CTCUtteranceReader {
+ public:
+  /// weights_rspecifier may be empty, every weight is 1 then
+  CTCUtteranceReader(const std::string &feature_rspecifier,
+                     const std::string &targets_rspecifier,
+                     const std::string &weights_rspecifier,
+                     const CTCReaderOptions &opts);
+  /// Stops the reader threads
+  ~CTCUtteranceReader();
+
+  /// Takes the next usable utterance; returns false after the last one
+  bool Next(CTCUtterance *utt);
+
+  int32 NumNoTargets() const { return num_no_targets_; }
+  int32 NumOtherErrors() const { return num_other_errors_; }
+  /// Of those, the ones dropped by the length index without a read
+  int32 NumUnread() const { return num_unread_; }
+
+  /// Seconds Next() waited for the readers, i.e. the trainer was I/O bound
+  double ConsumerStallSeconds() const { return consumer_stall_seconds_; }
+  /// Seconds the readers waited for room in the queue, summed over the
+  /// threads, i.e. the reading kept ahead of the trainer
+  double ProducerStallSeconds() const;
+
+  /// Stall times and the share of the reading time they amount to
+  std::string Report() const;
+
+ public:
+  /// Work of the reader threads: reads utterances until the end of the
+  /// rspecifier or until the reader is destroyed
+  void read_loop();
+
+ private:
+  /// An utterance in flight; error is set if it is dropped
+  struct Slot {
+    CTCUtterance utt;
+    Matrix<double> cmvn_stats;
+    Matrix<BaseFloat> deltas;         // scratch of the delta computation
+    bool no_targets;
+    bool unread;                      // dropped by the length index
+    std::string error;
+  };
+
+  /// Reads the next utterance of the rspecifier into slot and returns its
+  /// sequence number, or -1 at the end; the tables are used under
+  /// table_lock_, the lengths are checked outside it
+  int64 read_utterance(Slot *slot);
+
+  /// Checks and trims the lengths of a read utterance and applies CMVN and
+  /// deltas to its features
+  void prepare_utterance(Slot *slot) const;
+
+  /// Hands a finished slot to the consumer
+  void publish(int64 seq, Slot *slot);
+
+  CTCReaderOptions opts_;
+  SequentialBaseFloatMatrixReader feature_reader_;
+  RandomAccessBaseFloatMatrixReader keyed_feature_reader_;
+  RandomAccessInt32VectorReader targets_reader_;
+  RandomAccessBaseFloatVectorReader weights_reader_;
+  RandomAccessDoubleMatrixReaderMapped cmvn_reader_;
+  bool have_weights_;
+  bool have_cmvn_;
+  CTCFeatureCache cache_;               // open for a cache: rspecifier
+  CTCLengthIndex length_index_;
+  bool have_length_index_;
+  bool keyed_;                          // reads the keys of order_
+  std::vector<std::string> order_;
+
+  Mutex table_lock_;                    // the table readers, next_read_
+  int64 next_read_;                     // sequence number of the next read
+  bool end_of_input_;
+
+  mutable Mutex queue_lock_;            // the members up to the semaphores
+  std::map<int64, Slot*> ready_;        // finished, by sequence number
+  int64 next_consumed_;
+  int64 num_read_;                      // total, once end_of_input_
+  bool finished_;
+  bool stop_;
+  std::string thread_error_;            // exception of a reader thread
+  double producer_stall_seconds_;
+
+  Semaphore free_slots_;                // room in the queue
+  Semaphore published_;                 // signalled by every publish()
+
+  double consumer_stall_seconds_;
+  Timer timer_;                         // running since construction
+  Slot sync_slot_;                      // used without reader threads
+  int32 num_no_targets_;
+  int32 num_other_errors_;
+  int32 num_unread_;
+
+  class ReaderTask;
+  MultiThreader<ReaderTask> *threader_;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(CTCUtteranceReader);
+};
+
+} // namespace nnet1
+} // namespace kaldi
+
+#endif // KALDI_CTC_CTC_UTTERANCE_READER_H_
@@ -16,6 +16,10 @@ learn_rate=0.0001
 momentum=0.9
 
 norm_vars=true
+reshuffle=false  # visit the training utterances in a new order every epoch
+utterance_order= # index, sorted or bucketed; empty keeps the order of train.scp
+cv_pipeline_depth=4 # cross-validation scores this many utterances behind the forward pass; 0 scores in turn
+cv_num_threads=1    # >1 runs cross-validation on the CPU, on this many threads with copies of the network
 
 verbose=1
 ## End configuration section
@@ -46,12 +50,27 @@ done
 cat $data_tr/feats.scp | utils/shuffle_list.pl --srand ${seed:-777} > $dir/train.scp
 cat $data_cv/feats.scp | utils/shuffle_list.pl --srand ${seed:-777} > $dir/cv.scp
 
-feats_tr="ark,s,cs:apply-cmvn --norm-vars=$norm_vars --utt2spk=ark:$data_tr/utt2spk scp:$data_tr/cmvn.scp scp:$dir/train.scp ark:- |"
-feats_cv="ark,s,cs:apply-cmvn --norm-vars=$norm_vars --utt2spk=ark:$data_cv/utt2spk scp:$data_cv/cmvn.scp scp:$dir/cv.scp ark:- |"
+if $use_cmu_tool; then
+  feats_tr="ark,s,cs:apply-cmvn --norm-vars=$norm_vars --utt2spk=ark:$data_tr/utt2spk scp:$data_tr/cmvn.scp scp:$dir/train.scp ark:- |"
+  feats_cv="ark,s,cs:apply-cmvn --norm-vars=$norm_vars --utt2spk=ark:$data_cv/utt2spk scp:$data_cv/cmvn.scp scp:$dir/cv.scp ark:- |"
 
-# add delta
-feats_tr="$feats_tr add-deltas --delta-order=2 ark:- ark:- |"
-feats_cv="$feats_cv add-deltas --delta-order=2 ark:- ark:- |"
+  # add delta
+  feats_tr="$feats_tr add-deltas --delta-order=2 ark:- ark:- |"
+  feats_cv="$feats_cv add-deltas --delta-order=2 ark:- ark:- |"
+else
+  # the normalized features with deltas are the same every epoch, they are
+  # computed once into caches that ctc-train-perutt maps into memory
+  for set in train cv; do
+    [ $set == train ] && data=$data_tr || data=$data_cv
+    if [ ! -f $dir/$set.cache ]; then
+      ctc-cache-feats --cmvn-stats=scp:$data/cmvn.scp --utt2spk=ark:$data/utt2spk \
+        --norm-vars=$norm_vars --delta-order=2 scp:$dir/$set.scp $dir/$set.cache \
+        >& $dir/log/cache_feats.$set.log || exit 1;
+    fi
+  done
+  feats_tr="cache:$dir/train.cache"
+  feats_cv="cache:$dir/cv.cache"
+fi
 
 ## end of feature setup
 
@@ -60,6 +79,28 @@ labels_tr="ark:$dir/targets.tr.ark"
 labels_cv="ark:$dir/targets.cv.ark"
 ##
 
+## utterance lengths, so utterances too short for their targets are dropped
+## before their features are read
+if ! $use_cmu_tool; then
+  for set in tr cv; do
+    [ $set == tr ] && feats=$feats_tr || feats=$feats_cv
+    [ $set == tr ] && labels=$labels_tr || labels=$labels_cv
+    if [ ! -f $dir/lengths.$set.ark ]; then
+      ctc-index-lengths "$feats" "$labels" ark:$dir/lengths.$set.ark \
+        >& $dir/log/index_lengths.$set.log || exit 1;
+    fi
+  done
+  feat_opts_tr="--length-index=ark:$dir/lengths.tr.ark"
+  feat_opts_cv="--length-index=ark:$dir/lengths.cv.ark"
+  [ ! -z "$utterance_order" ] && feat_opts_tr="$feat_opts_tr --utterance-order=$utterance_order"
+  if [ $cv_num_threads -gt 1 ]; then
+    feat_opts_cv="$feat_opts_cv --use-gpu=no --num-threads=$cv_num_threads"
+  else
+    feat_opts_cv="$feat_opts_cv --pipeline-depth=$cv_pipeline_depth"
+  fi
+fi
+##
+
 # initialize model
 if [ ! -f $dir/nnet/nnet.iter0 ]; then
   echo "Initializing model as $dir/nnet/nnet.iter0"
@@ -80,9 +121,12 @@ for iter in $(seq $start_epoch_num $max_iters); do
       "$feats_tr" "$labels_tr" $dir/nnet/nnet-cmu.iter$[iter-1] $dir/nnet/nnet-cmu.iter${iter} \
       >& $dir/log/tr.iter$iter.log
   else 
+    # the cache is shuffled through its index, not rewritten
+    shuffle_opts=
+    $reshuffle && shuffle_opts="--shuffle-seed=$iter"
     $train_tool --learn-rate=$learn_rate --momentum=$momentum \
       --verbose=$verbose \
-      --blank-num=0 \
+      --blank-num=0 $feat_opts_tr $shuffle_opts \
       "$feats_tr" "$labels_tr" $dir/nnet/nnet.iter$[iter-1] $dir/nnet/nnet.iter$iter \
       >& $dir/log/tr.iter$iter.log
   fi
@@ -97,7 +141,7 @@ for iter in $(seq $start_epoch_num $max_iters); do
     $train_tool --learn-rate=$learn_rate --momentum=$momentum \
       --cross-validate=true \
       --verbose=$verbose \
-      --blank-num=0 \
+      --blank-num=0 $feat_opts_cv \
       "$feats_cv" "$labels_cv" $dir/nnet/nnet.iter${iter} \
       >& $dir/log/cv.iter${iter}.log
   cvacc=$(cat $dir/log/cv.iter${iter}.log | grep "TOKEN_ACCURACY" | tail -n 1 | awk '{ acc=$3; gsub("%", "", acc); print acc; }')
@@ -0,0 +1,261 @@
+// ctc/log-bench.cc
+
+#include "ctc/Log.hpp"
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "base/timer.h"
+
+#include <iomanip>
+
+namespace kaldi {
+namespace nnet1 {
+
+/// One implementation of a Log<T> operation over n elements; unary
+/// operations ignore y.
+template<class T>
+struct LogBenchVariant {
+  const char *op;
+  const char *name;
+  bool unary;
+  bool log_output;  // error measured in the log domain, else relative
+  void (*run)(const T *x, const T *y, T *out, int n);
+};
+
+template<class T> void ScalarSafeExp(const T *x, const T *y, T *out, int n) {
+  for (int i = 0; i < n; i++) out[i] = Log<T>::safe_exp(x[i]);
+}
+template<class T> void ScalarSafeLog(const T *x, const T *y, T *out, int n) {
+  for (int i = 0; i < n; i++) out[i] = Log<T>::safe_log(x[i]);
+}
+template<class T> void ScalarLogAdd(const T *x, const T *y, T *out, int n) {
+  for (int i = 0; i < n; i++) out[i] = Log<T>::log_add(x[i], y[i]);
+}
+template<class T> void ScalarLogAddApprox(const T *x, const T *y, T *out,
+                                          int n) {
+  for (int i = 0; i < n; i++) out[i] = Log<T>::log_add_approx(x[i], y[i]);
+}
+template<class T> void ScalarLogSubtract(const T *x, const T *y, T *out,
+                                         int n) {
+  for (int i = 0; i < n; i++) out[i] = Log<T>::log_subtract(x[i], y[i]);
+}
+template<class T> void ScalarLogMultiply(const T *x, const T *y, T *out,
+                                         int n) {
+  for (int i = 0; i < n; i++) out[i] = Log<T>::log_multiply(x[i], y[i]);
+}
+template<class T> void SpanSafeExp(const T *x, const T *y, T *out, int n) {
+  Log<T>::safe_exp(x, out, n);
+}
+template<class T> void SpanLogAdd(const T *x, const T *y, T *out, int n) {
+  Log<T>::log_add(x, y, out, n);
+}
+template<class T> void SpanLogAddApprox(const T *x, const T *y, T *out,
+                                        int n) {
+  Log<T>::log_add_approx(x, y, out, n);
+}
+template<class T> void SpanLogMultiply(const T *x, const T *y, T *out,
+                                       int n) {
+  Log<T>::log_multiply(x, y, out, n);
+}
+
+/// Every variant the harness knows; new vectorized or approximate kernels
+/// are added here.
+template<class T>
+std::vector<LogBenchVariant<T> > LogBenchVariants() {
+  const LogBenchVariant<T> variants[] = {
+    { "safe_exp", "scalar", true, false, ScalarSafeExp<T> },
+    { "safe_exp", "span", true, false, SpanSafeExp<T> },
+    { "safe_log", "scalar", true, true, ScalarSafeLog<T> },
+    { "log_add", "scalar", false, true, ScalarLogAdd<T> },
+    { "log_add", "span", false, true, SpanLogAdd<T> },
+    { "log_add", "approx", false, true, ScalarLogAddApprox<T> },
+    { "log_add", "approx-span", false, true, SpanLogAddApprox<T> },
+    { "log_subtract", "scalar", false, true, ScalarLogSubtract<T> },
+    { "log_multiply", "scalar", false, true, ScalarLogMultiply<T> },
+    { "log_multiply", "span", false, true, SpanLogMultiply<T> },
+  };
+  return std::vector<LogBenchVariant<T> >(
+      variants, variants + sizeof(variants) / sizeof(variants[0]));
+}
+
+/// The exact result of op in double precision, with logZero read as an
+/// empty probability; returns -infinity for a zero probability.
+template<class T>
+double LogBenchReference(const std::string &op, T x, T y) {
+  const double inf = std::numeric_limits<double>::infinity();
+  double dx = (x == Log<T>::logZero ? -inf : x),
+      dy = (y == Log<T>::logZero ? -inf : y);
+  if (op == "safe_exp") return std::exp(dx);
+  if (op == "safe_log") return x > 0 ? std::log(static_cast<double>(x)) : -inf;
+  if (op == "log_multiply") return dx + dy;
+  double m = std::max(dx, dy);
+  if (op == "log_add") {
+    if (m == -inf) return -inf;
+    return m + std::log(std::exp(dx - m) + std::exp(dy - m));
+  }
+  KALDI_ASSERT(op == "log_subtract");
+  if (dy >= dx) return -inf;
+  return dx + std::log(1.0 - std::exp(dy - dx));
+}
+
+/// Log-domain operands as CTC lattices see them: log probabilities spread
+/// over [min_log, 0], a zero_fraction of them logZero. safe_log gets the
+/// probabilities instead, zero_fraction of them 0 and the rest normal.
+template<class T>
+void LogBenchInput(const std::string &op, int n, double min_log,
+                   double zero_fraction, std::vector<T> *x,
+                   std::vector<T> *y) {
+  x->resize(n);
+  y->resize(n);
+  for (int i = 0; i < n; i++) {
+    T *v[2] = { &(*x)[i], &(*y)[i] };
+    for (int j = 0; j < 2; j++) {
+      if (RandUniform() < zero_fraction) {
+        *v[j] = (op == "safe_log" ? 0 : Log<T>::logZero);
+      } else {
+        T log_value = min_log * RandUniform();
+        if (op == "safe_log") {  // safe_log(expMin) is logZero
+          log_value = std::max(log_value, std::log(Log<T>::expMin) + 1);
+        }
+        *v[j] = (op == "safe_log" ? std::exp(log_value) : log_value);
+      }
+    }
+  }
+}
+
+template<class T>
+void RunLogBench(const char *type, int n, int num_iters, double min_log,
+                 const std::vector<BaseFloat> &zero_fractions,
+                 std::ostream *csv) {
+  std::vector<LogBenchVariant<T> > variants = LogBenchVariants<T>();
+  std::vector<T> x, y, out(n);
+  for (size_t z = 0; z < zero_fractions.size(); z++) {
+    for (size_t v = 0; v < variants.size(); v++) {
+      const LogBenchVariant<T> &variant = variants[v];
+      const std::string op = variant.op;
+      LogBenchInput(op, n, min_log, zero_fractions[z], &x, &y);
+
+      variant.run(&x[0], &y[0], &out[0], n);  // warm up
+      Timer timer;
+      for (int iter = 0; iter < num_iters; iter++) {
+        variant.run(&x[0], &y[0], &out[0], n);
+      }
+      const double ns = 1.0e9 * timer.Elapsed() / num_iters / n;
+
+      // zero results are compared by their zero-ness, the rest by absolute
+      // error in the log domain or relative error in the linear one, where
+      // anything below the smallest normal T counts as zero
+      double max_error = 0.0, sum_error = 0.0;
+      int32 num_compared = 0, num_zero_mismatches = 0;
+      for (int i = 0; i < n; i++) {
+        double ref = LogBenchReference(op, x[i], y[i]);
+        bool ref_zero = (variant.log_output ?
+                         ref < Log<T>::logZero : ref < Log<T>::expMin),
+            out_zero = (variant.log_output ?
+                        out[i] <= Log<T>::logZero : out[i] < Log<T>::expMin);
+        if (ref_zero || out_zero) {
+          if (ref_zero != out_zero) num_zero_mismatches++;
+          continue;
+        }
+        double error = (variant.log_output ? std::abs(out[i] - ref) :
+                        std::abs(out[i] - ref) / ref);
+        max_error = std::max(max_error, error);
+        sum_error += error;
+        num_compared++;
+      }
+      const double mean_error = num_compared > 0 ?
+          sum_error / num_compared : 0.0;
+
+      std::cout << std::setw(7) << type << std::setw(6) << zero_fractions[z]
+                << std::setw(14) << variant.op << std::setw(12)
+                << variant.name << std::fixed << std::setprecision(3)
+                << std::setw(10) << ns << std::setw(10) << 1.0e3 / ns
+                << std::scientific << std::setprecision(2)
+                << std::setw(11) << max_error << std::setw(11) << mean_error
+                << std::setw(8) << num_zero_mismatches << std::endl;
+      std::cout.unsetf(std::ios::floatfield);
+      std::cout << std::setprecision(6);
+      if (csv != NULL) {
+        *csv << type << ',' << zero_fractions[z] << ',' << variant.op << ','
+             << variant.name << ',' << ns << ',' << max_error << ','
+             << mean_error << ',' << num_zero_mismatches << '\n';
+      }
+    }
+  }
+}
+
+} // namespace nnet1
+} // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  using namespace kaldi;
+  using namespace kaldi::nnet1;
+  typedef kaldi::int32 int32;
+
+  try {
+    const char *usage =
+        "Measure the speed and the accuracy of the Log<T> operations used by\n"
+        "the CTC loss, scalar and span versions, in float and double.\n"
+        "Errors are against a double-precision reference: absolute in the\n"
+        "log domain, relative for safe_exp; zero mismatches count results\n"
+        "that are logZero (or 0) in one of the two only.\n"
+        "Usage:  log-bench [options]\n"
+        "e.g.: \n"
+        " log-bench --zero-fractions=0:0.5:0.9 --csv=log-bench.csv\n";
+
+    ParseOptions po(usage);
+
+    int32 dim = 4096;
+    po.Register("dim", &dim, "Elements per call, e.g. a lattice row");
+    int32 num_iters = 2000;
+    po.Register("iterations", &num_iters, "Timed calls of every variant");
+    BaseFloat min_log = -100.0;
+    po.Register("min-log", &min_log,
+                "Log probabilities are drawn from [min-log, 0]");
+    std::string zero_fractions_str = "0:0.5:0.9";
+    po.Register("zero-fractions", &zero_fractions_str,
+                "Colon-separated fractions of logZero operands");
+    int32 seed = 777;
+    po.Register("seed", &seed, "Seed of the synthetic operands");
+    std::string csv_wxfilename;
+    po.Register("csv", &csv_wxfilename,
+                "If set, also write the results as CSV to this file");
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 0) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::vector<BaseFloat> zero_fractions;
+    if (!SplitStringToFloats(zero_fractions_str, ":", false,
+                             &zero_fractions)) {
+      KALDI_ERR << "Bad --zero-fractions " << zero_fractions_str;
+    }
+    KALDI_ASSERT(dim > 0 && num_iters > 0 && min_log < 0);
+    srand(seed);
+
+    Output csv;
+    std::ostream *csv_stream = NULL;
+    if (csv_wxfilename != "") {
+      csv.Open(csv_wxfilename, false, false);
+      csv_stream = &csv.Stream();
+      *csv_stream << "type,zero_fraction,op,variant,ns_per_element,"
+                  << "max_error,mean_error,zero_mismatches\n";
+    }
+    std::cout << std::setw(7) << "type" << std::setw(6) << "zero"
+              << std::setw(14) << "op" << std::setw(12) << "variant"
+              << std::setw(10) << "ns/elem" << std::setw(10) << "Melem/s"
+              << std::setw(11) << "max-err" << std::setw(11) << "mean-err"
+              << std::setw(8) << "zero-mm" << std::endl;
+    RunLogBench<float>("float", dim, num_iters, min_log, zero_fractions,
+                       csv_stream);
+    RunLogBench<double>("double", dim, num_iters, min_log, zero_fractions,
+                        csv_stream);
+    if (csv_stream != NULL) csv.Close();
+    return 0;
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -25,6 +25,112 @@ namespace nnet1 {
     AssertEqual(exp(mul(log(0), log(0.2))), 0 * 0.2);
   }
 
+  void UnitTestLogSpan() {
+    // odd length, so the vector loops leave a scalar tail
+    const int n = 37;
+    std::vector<T> x(n), y(n), out(n);
+    for (int i = 0; i < n; i++) {
+      x[i] = -60.0 + 3.0 * i;
+      y[i] = 30.0 - 2.5 * i;
+    }
+    x[3] = y[3] = x[5] = y[8] = Log<T>::logZero;
+    x[n-1] = Log<T>::expLimit + 1;
+
+    Log<T>::safe_exp(&x[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      AssertEqual(out[i], exp(x[i]));
+    }
+    Log<T>::log_add(&x[0], &y[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      KALDI_ASSERT((out[i] == Log<T>::logZero) == (add(x[i], y[i]) == Log<T>::logZero));
+      AssertEqual(out[i], add(x[i], y[i]));
+    }
+    Log<T>::log_multiply(&x[0], &y[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      AssertEqual(out[i], mul(x[i], y[i]));
+    }
+  }
+
+  void UnitTestLogSpanLogZero() {
+    // mostly logZero and values that underflow, as in the corners of a
+    // CTC lattice; a multiple of every vector width, so no scalar tail
+    const int n = 64;
+    std::vector<T> x(n), y(n), out(n);
+    for (int i = 0; i < n; i++) {
+      x[i] = (i % 2 == 0 ? Log<T>::logZero : -90.0 - 5.0 * i);
+      y[i] = (i % 3 == 0 ? Log<T>::logZero : -1.0 - 0.5 * i);
+    }
+    Log<T>::safe_exp(&x[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      KALDI_ASSERT(out[i] == 0.0);
+    }
+    Log<T>::log_add(&x[0], &y[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      KALDI_ASSERT((out[i] == Log<T>::logZero) == (add(x[i], y[i]) == Log<T>::logZero));
+      AssertEqual(out[i], add(x[i], y[i]));
+    }
+#if defined(__SSE2__) && KALDI_DOUBLEPRECISION == 0
+    // the lanes the kernels discard are computed as well, and must not
+    // come out denormal (slow)
+    float lanes[16];
+    for (int i = 0; i < n; i++) {
+      log_simd::store(lanes, log_simd::exp_core(log_simd::set1(x[i])));
+      KALDI_ASSERT(lanes[0] >= std::numeric_limits<float>::min());
+    }
+#endif
+  }
+
+  void UnitTestLogSpanFlush() {
+    // down to where the scalar safe_exp gives denormals and then 0; an
+    // odd length, so the vector loop leaves a scalar tail
+    const int n = 37;
+    std::vector<T> x(n), out(n);
+    for (int i = 0; i < n; i++) x[i] = -80.0 - 0.7 * i;
+    Log<T>::safe_exp(&x[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      T scalar = exp(x[i]);
+#if defined(__SSE2__) && KALDI_DOUBLEPRECISION == 0
+      // the float span flushes what is below the smallest normal to 0
+      if (x[i] < log_simd::expLow) {
+        KALDI_ASSERT(out[i] == 0.0 &&
+                     scalar < std::numeric_limits<float>::min());
+      } else {
+        AssertEqual(out[i], scalar, 1e-6);
+      }
+#else
+      KALDI_ASSERT(out[i] == scalar);
+#endif
+    }
+#if defined(__SSE2__) && KALDI_DOUBLEPRECISION == 0
+    // the scalar version does return denormals there
+    KALDI_ASSERT(exp(-95.0f) > 0.0f &&
+                 exp(-95.0f) < std::numeric_limits<float>::min());
+#endif
+  }
+
+  void UnitTestLogAddApprox() {
+    // both orders, equal operands, the cutoff and logZero
+    const int n = 45;
+    std::vector<T> x(n), y(n), out(n);
+    for (int i = 0; i < n; i++) {
+      x[i] = -3.0 - 0.1 * i;
+      y[i] = -3.0 - 0.4 * (i % 11) - 0.05 * i;
+    }
+    x[2] = Log<T>::logZero;
+    y[7] = Log<T>::logZero;
+    x[9] = y[9] = Log<T>::logZero;
+    x[12] = y[12] + LogAddTable<T>::cutoff;
+
+    Log<T>::log_add_approx(&x[0], &y[0], &out[0], n);
+    for (int i = 0; i < n; i++) {
+      T approx = Log<T>::log_add_approx(x[i], y[i]), exact = add(x[i], y[i]);
+      KALDI_ASSERT(std::abs(approx - exact) < 2e-5);
+      KALDI_ASSERT(std::abs(out[i] - approx) < 1e-6);
+      KALDI_ASSERT(Log<T>::log_add_approx(y[i], x[i]) == approx);
+    }
+    KALDI_ASSERT(out[9] == Log<T>::logZero && out[12] == x[12]);
+  }
+
 } // namespace nnet1
 } // namespace kaldi
 
@@ -34,6 +140,10 @@ int main()
   using namespace kaldi::nnet1;  
   // unit-tests:
   UnitTestLog();
+  UnitTestLogSpan();
+  UnitTestLogSpanLogZero();
+  UnitTestLogSpanFlush();
+  UnitTestLogAddApprox();
   
   KALDI_LOG << "Tests succeeded.";
   return 0;